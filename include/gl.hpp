@@ -15,4 +15,12 @@
 namespace opengl
 {
     void glErrorAssert();
+
+    // Entry points newer than the GL 3.3 glad header are resolved by hand
+    // The window stores its loader here once glad is initialized
+    void glSetLoader(GLADloadproc loader);
+    void* glGetProc(const char *name);
+    bool glExtensionSupported(const char *name);
+    // True if the current context is at least major.minor
+    bool glVersionAtLeast(int major, int minor);
 }
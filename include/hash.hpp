@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <cstdio>
+
+namespace opengl
+{
+	using namespace std;
+
+	// 64 bit FNV-1a, stable across runs and platforms for cache keys
+	#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+	#define FNV_PRIME 0x100000001b3ULL
+
+	inline uint64_t fnv1a(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS)
+	{
+		const unsigned char *bytes = (const unsigned char*)data;
+		uint64_t ret = seed;
+		for (size_t i = 0; i < size; i++)
+		{
+			ret ^= bytes[i];
+			ret *= FNV_PRIME;
+		}
+		return ret;
+	}
+	inline uint64_t fnv1a(const string &str, uint64_t seed = FNV_OFFSET_BASIS)
+	{
+		// The terminator separates consecutive strings fed into one hash
+		return fnv1a(str.c_str(), str.size() + 1, seed);
+	}
+
+	inline string hashToString(uint64_t hash)
+	{
+		char buffer[17];
+		snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)hash);
+		return buffer;
+	}
+}
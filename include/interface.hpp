@@ -2,11 +2,24 @@
 
 #include "loader/arrayLoader.hpp"
 #include "camera.hpp"
+#include "render/frameCapture.hpp"
+#include "render/renderTarget.hpp"
+#include "render/resolutionScaler.hpp"
+#include "render/deferredRenderer.hpp"
+#include "render/clusteredRenderer.hpp"
+#include "ringQueue.hpp"
 
 #include <thread>
 #include <atomic>
 #include <functional>
 #include <any>
+#include <deque>
+#include <mutex>
+#include <bitset>
+#include <exception>
+
+// Input events a window holds between frames, later ones wait on the main thread
+#define INPUT_QUEUE_SIZE 1024
 
 namespace opengl
 {
@@ -14,6 +27,12 @@ namespace opengl
 
 	class DLL_SIGN window;
 
+	typedef enum _render_path {
+		FORWARD_RENDER,
+		DEFERRED_RENDER,
+		CLUSTERED_RENDER
+	}renderPath;
+
 	// Interaction with single input device, using callback
 	template <typename T>
 	class DLL_SIGN interaction
@@ -55,11 +74,56 @@ namespace opengl
 	{
 	private:
 		static DLL_SIGN map<GLFWwindow*, window*> existingWindow;
+		// Guards existingWindow, callbacks look windows up while others are made or destroyed
+		static DLL_SIGN mutex windowLock;
 
 		static DLL_SIGN bool initialized;
+		// GLFW calls other than the thread safe ones only work here
+		static DLL_SIGN thread::id mainThread;
+		static DLL_SIGN deque<function<void ()>> mainTasks;
+		static DLL_SIGN mutex taskLock;
+		static DLL_SIGN void runMainTasks();
 
 		GLFWwindow *windowPtr;
-		// thread *windowThread;
+		// Render loop of a detached window, owns the context while it runs
+		thread *windowThread;
+		atomic<bool> running;
+		bool detached;
+		exception_ptr failure;
+
+		// Input recorded by the main thread inside glfwPollEvents, handled on
+		// the render thread once per frame with mouse and scroll runs merged
+		typedef enum _input_kind {
+			KEY_INPUT,
+			SCROLL_INPUT,
+			MOUSE_INPUT,
+			RESIZE_INPUT
+		}inputKind;
+		typedef struct __input_event {
+			inputKind kind;
+			int key;
+			int scancode;
+			int action;
+			int mods;
+			double x;
+			double y;
+			double time;
+		}inputEvent;
+		ringQueue<inputEvent, INPUT_QUEUE_SIZE> events;
+		// Events the full ring could not take, in order, main thread only
+		// Motion and scroll runs merge here, keys are never dropped.
+		deque<inputEvent> spilled;
+		bitset<GLFW_KEY_LAST + 1> keys;
+		double eventTime;
+		static DLL_SIGN void postEvent(GLFWwindow *window, inputEvent &&event);
+		// Moves spilled events into the ring as it frees up, main thread only
+		void flushEvents();
+		void dispatchEvents();
+		void handleEvent(const inputEvent &event);
+
+		// Hidden window sharing objects with windowPtr, current on loaderThread
+		GLFWwindow *loaderContext;
+		thread *loaderThread;
 
 		// Callback processing inputs
 		interactModel model;
@@ -81,6 +145,17 @@ namespace opengl
 		double lastFrame;
 		double frameRate;
 
+		// Asynchronous frame grabbing
+		frameCapture *capturer;
+
+		// Dynamic resolution, scene renders offscreen and is upscaled
+		renderTarget *sceneTarget;
+		resolutionScaler *scaler;
+
+		// Created on first use of their path
+		deferredRenderer *deferred;
+		clusteredRenderer *clustered;
+
 		// Global callback layer
 		static DLL_SIGN void frameBufferCallback(GLFWwindow *window, int width, int height);
 
@@ -110,16 +185,33 @@ namespace opengl
 			bool enableBlending;
 			bool enableFaceCulling;
 
+			// Scale scene resolution between the bounds to meet the GPU budget
+			bool enableDynamicResolution;
+			float minResolutionScale;
+			float maxResolutionScale;
+			// Milliseconds
+			double gpuFrameBudget;
+
+			// Relink programs whose shader files change on disk
+			bool shaderHotReload;
+
+			// Unscaled, unaccelerated motion while the cursor is captured, where supported
+			bool rawMouseMotion;
+
 			// This could discard the usage of pointer cast.
 			vector<any> anyArgs;
 
 			abstractWindowInfo(const char *title, int width, int height, const vector<float> &bgColor):
 			title(title), width(width), height(height), frameDelta(0.0), lastX(0.0), lastY(0.0), backgroundColor(bgColor),
-			enableDepth(true), enableStencil(false), enableBlending(false), enableFaceCulling(true) {}
+			enableDepth(true), enableStencil(false), enableBlending(false), enableFaceCulling(true),
+			enableDynamicResolution(false), minResolutionScale(0.5f), maxResolutionScale(1.0f), gpuFrameBudget(16.0), shaderHotReload(true),
+			rawMouseMotion(false) {}
 
 			abstractWindowInfo(const char *title, int width, int height, vector<float> &&bgColor):
 			title(title), width(width), height(height), frameDelta(0.0), lastX(0.0), lastY(0.0), backgroundColor(bgColor),
-			enableDepth(true), enableStencil(false), enableBlending(false), enableFaceCulling(true) {}
+			enableDepth(true), enableStencil(false), enableBlending(false), enableFaceCulling(true),
+			enableDynamicResolution(false), minResolutionScale(0.5f), maxResolutionScale(1.0f), gpuFrameBudget(16.0), shaderHotReload(true),
+			rawMouseMotion(false) {}
 		};
 
 		// Default render info
@@ -137,13 +229,28 @@ namespace opengl
 
 			bool firstEnter;
 
+			renderPath path;
+
+			// Move scene textures into texture arrays and atlases after loading
+			// Off by default, loading then waits for every decode and arrays
+			// upload whole instead of streaming their mip levels.
+			bool packTextures;
+
+			// Build definitions on a loader thread, frames start right away and
+			// show each definition once it is complete
+			bool asyncLoad;
+			bool sceneLoaded;
+			double loadStart;
+
 			defaultWindowInfo(const char *title, const char *jsonName, int width, int height, const vector<float> &bgColor):
 			abstractWindowInfo(title, width, height, bgColor),
-			jsonFileName(jsonName), renderArray(NULL), defaultCamera(NULL), rotateAxis(glm::vec3(0.5f, 1.0f, 0.0f)), degrees(50.0f), firstEnter(true) {}
+			jsonFileName(jsonName), renderArray(NULL), defaultCamera(NULL), rotateAxis(glm::vec3(0.5f, 1.0f, 0.0f)), degrees(50.0f), firstEnter(true), path(FORWARD_RENDER), packTextures(false),
+			asyncLoad(true), sceneLoaded(false), loadStart(0.0) {}
 
 			defaultWindowInfo(const char *title, const char *jsonName, int width, int height, vector<float> &&bgColor):
 			abstractWindowInfo(title, width, height, bgColor),
-			jsonFileName(jsonName), renderArray(NULL), defaultCamera(NULL), rotateAxis(glm::vec3(0.5f, 1.0f, 0.0f)), degrees(50.0f), firstEnter(true) {}
+			jsonFileName(jsonName), renderArray(NULL), defaultCamera(NULL), rotateAxis(glm::vec3(0.5f, 1.0f, 0.0f)), degrees(50.0f), firstEnter(true), path(FORWARD_RENDER), packTextures(false),
+			asyncLoad(true), sceneLoaded(false), loadStart(0.0) {}
 		};
 
 		window(
@@ -159,16 +266,40 @@ namespace opengl
 
 		void frameCounter();
 
+		// Scale the scene is currently rendered at
+		float getResolutionScale() const;
+
 		void preRenderLoop();
 		void postRenderLoop();
 
 		void init();
 		void start();
 
+		// Runs the render loop on a thread of its own. Create and init every
+		// window first, then the main thread calls runDetached to poll events.
 		void startDetach();
+		// Polls events until every detached window has closed, rethrows the
+		// first error of their render loops
+		static void runDetached();
+
+		// Runs task on the main thread, right away when called there
+		static void onMainThread(function<void ()> task);
+		// Key state as of the events handled this frame
+		bool keyDown(int key) const;
+		// When the event being handled happened, on the glfwGetTime clock
+		double getEventTime() const;
+		// Hides and locks the cursor for camera control, or gives it back
+		void captureCursor(bool capture);
+
+		// Runs job on a thread of its own with a context sharing this window's
+		// buffers, textures and programs, or right here if none can be made
+		void runLoader(function<void ()> job);
 
 		void setPreRender(render preCallback);
 		void setRender(render callback);
 
+		// Save a finished frame as PNG, the render loop never waits on it
+		void capture(const string &filename);
+
 	};
 }
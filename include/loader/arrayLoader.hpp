@@ -2,16 +2,27 @@
 
 #include "loader/shaderLoader.hpp"
 #include "loader/textureLoader.hpp"
+#include "loader/texturePacker.hpp"
 #include "loader/modelLoader.hpp"
+#include "loader/meshletCuller.hpp"
 
 #include <vector>
 #include <string>
 #include <fstream>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <exception>
 
 #include "nlohmann/json.hpp"
 
 #include "glm/glm.hpp"
 
+// Object textures take the units below this, renderers bind their own
+// buffers from here up to the 16 GL 3.3 guarantees a fragment shader
+#define OBJECT_TEXTURE_UNITS 13
+
 namespace opengl
 {
 	using json = nlohmann::json;
@@ -25,13 +36,32 @@ namespace opengl
 	protected:
 		GLuint bufferObject;
 		vector<T> data;
+		// Borrowed range used instead of data, kept alive by its owner
+		const T *view;
+		size_t viewLength;
+		shared_ptr<const void> viewOwner;
+		// Length kept once the CPU copy is gone
+		GLuint releasedLength;
+		bool released;
 
 		virtual void loadData(const json &arrayFile) = 0;
-
-		const T* getData();
+		// Takes a "value" given as streamed binary, a base64 data URI or the
+		// path of a raw little endian file, false leaves plain arrays to the caller
+		bool loadBuffer(const json &value);
+		// Moves a streamed binary "value" out of a document the array owns,
+		// loadBuffer then finds it taken over instead of copying it
+		void adoptBuffer(json &arrayFile);
+
+		const T* getData() const;
 	public:
-		baseArray(){}
+		baseArray():
+		view(NULL), viewLength(0), releasedLength(0), released(false){}
 		baseArray(const vector<T> &data);
+		baseArray(vector<T> &&data);
+		baseArray(const T *view, size_t length, shared_ptr<const void> owner);
+
+		// Drops the CPU copy once the buffer object holds it
+		void release();
 		virtual ~baseArray(){}
 
 		GLuint getLength() const;
@@ -42,35 +72,69 @@ namespace opengl
 		virtual void setVertexPointer(GLenum normalize) const = 0;
 	};
 
+	// One attribute of an interleaved vertex, offset in bytes from its start
+	typedef struct __vertex_attribute {
+		GLuint size;
+		GLenum type;
+		GLboolean normalized;
+		GLuint offset;
+	}vertexAttribute;
+
 	class DLL_SIGN vertexArray: public baseArray<GLfloat>
 	{
 	private:
-		vector<GLuint> depth;
+		vector<vertexAttribute> layout;
+		// Bytes per vertex
+		GLuint stride;
 
 		GLuint verticeCount;
-		GLuint lengthPerCount;
+		// Lowest and highest component of each attribute, taken before the data is released
+		vector<pair<GLfloat, GLfloat>> ranges;
+
+		// Quantized positions decode as positionOffset + value * positionScale
+		bool quantized;
+		glm::vec3 positionOffset;
+		glm::vec3 positionScale;
+
+		// Tightly packed float attributes of the given sizes
+		void floatLayout(const vector<GLuint> &depth);
+		// Component i of an attribute of the vertex, converted the way GL reads it
+		static GLfloat readComponent(const unsigned char *vertex, const vertexAttribute &attribute, GLuint i);
 
 		virtual void loadData(const json &arrayFile);
 	public:
 		vertexArray(const vector<GLfloat> &rawData, initializer_list<GLuint> &&depth = {3, 3, 2}):
-		baseArray(rawData), depth(depth)
+		baseArray(rawData), quantized(false), positionOffset(0.0f), positionScale(1.0f)
+		{
+			floatLayout(depth);
+		}
+		// Uploads straight from memory the owner keeps, a mapped mesh cache for one
+		vertexArray(const GLfloat *view, size_t length, shared_ptr<const void> owner, initializer_list<GLuint> &&depth = {3, 3, 2}):
+		baseArray(view, length, owner), quantized(false), positionOffset(0.0f), positionScale(1.0f)
 		{
-			lengthPerCount = 0;
-			for (auto len : this->depth)
-			{
-				lengthPerCount += len;
-			}
-			verticeCount = this->depth.size() / lengthPerCount;
+			floatLayout(depth);
 		}
+		// Typed vertices of stride bytes, attribute 0 being positions quantized across offset and scale
+		vertexArray(const GLfloat *view, size_t length, shared_ptr<const void> owner, const vector<vertexAttribute> &layout, GLuint stride, const glm::vec3 &positionOffset, const glm::vec3 &positionScale):
+		baseArray(view, length, owner), layout(layout), stride(stride), verticeCount(getSize() / stride),
+		quantized(true), positionOffset(positionOffset), positionScale(positionScale){}
 
 		vertexArray(const string &filename);
 		vertexArray(ifstream &arrayFile);
 		vertexArray(const json &arrayFile);
+		vertexArray(json &&arrayFile);
 		virtual ~vertexArray(){}
 
 		virtual void bindBuffer() const;
 		virtual void genBuffer(GLenum usage);
 		virtual void setVertexPointer(GLenum normalize) const;
+
+		// True if every component of the attribute lies within [low, high]
+		bool attributeInRange(GLuint index, GLfloat low, GLfloat high) const;
+
+		bool isQuantized() const;
+		const glm::vec3& getPositionOffset() const;
+		const glm::vec3& getPositionScale() const;
 	};
 
 	class DLL_SIGN indiceArray: public baseArray<GLuint>
@@ -79,15 +143,22 @@ namespace opengl
 		const static DLL_SIGN map<string, GLenum> convertMap;
 
 		GLenum primitive;
+		// GL_UNSIGNED_SHORT once uploaded if every index fits
+		GLenum indexType;
 
 		virtual void loadData(const json &arrayFile);
 	public:
 		indiceArray(const vector<GLuint> &rawData, GLenum primitive = GL_TRIANGLES):
-		baseArray(rawData), primitive(primitive){}
+		baseArray(rawData), primitive(primitive), indexType(GL_UNSIGNED_INT){}
+		indiceArray(vector<GLuint> &&rawData, GLenum primitive = GL_TRIANGLES):
+		baseArray(move(rawData)), primitive(primitive), indexType(GL_UNSIGNED_INT){}
+		indiceArray(const GLuint *view, size_t length, shared_ptr<const void> owner, GLenum primitive = GL_TRIANGLES):
+		baseArray(view, length, owner), primitive(primitive), indexType(GL_UNSIGNED_INT){}
 
 		indiceArray(const string &filename);
 		indiceArray(ifstream &arrayFile);
 		indiceArray(const json &arrayFile);
+		indiceArray(json &&arrayFile);
 		virtual ~indiceArray(){}
 
 		virtual void bindBuffer() const;
@@ -95,6 +166,7 @@ namespace opengl
 		virtual void setVertexPointer(GLenum normalize) const;
 
 		GLenum getPrimitive() const;
+		GLenum getIndexType() const;
 	};
 
 	class DLL_SIGN singleObject
@@ -105,14 +177,18 @@ namespace opengl
 		indiceArray *iArray;
 		shaderProgram *sProgram;
 		map<string, texture> *textureList;
+		// Set for imported models, drawn meshlet by meshlet
+		shared_ptr<meshletCuller> culler;
 
-		void genObject(const json &jsonObject);
+		// Moves the geometry out of jsonObject
+		void genObject(json &jsonObject);
 
 	public:
 		singleObject();
 		singleObject(const string &filename);
 		singleObject(ifstream &file);
 		singleObject(const json &jsonObject);
+		singleObject(json &&jsonObject);
 		~singleObject();
 
 		shaderProgram& getShaderProgram();
@@ -120,8 +196,15 @@ namespace opengl
 		const map<string, texture>& getTextureList() const;
 
 		void genObjectBuffer(GLenum usage = GL_STATIC_DRAW, GLenum normalize = GL_FALSE);
+		// Buffer objects are shared between contexts, so this half may run on a loader context
+		void genBuffers(GLenum usage = GL_STATIC_DRAW);
+		// Vertex array objects are not, this half runs on the context that draws
+		void genVertexArray(GLenum normalize = GL_FALSE);
 
 		void draw() const;
+		// Only the meshlets in view, transform takes model space to clip space and
+		// eye is the camera in model space. Returns the meshlets drawn.
+		size_t draw(const glm::mat4 &transform, const glm::vec3 &eye, bool cones) const;
 
 		friend class objectArray;
 	};
@@ -151,9 +234,16 @@ namespace opengl
 			color(NULL), callback(NULL){}
 		}objectUsage;
 
+		typedef enum __light_type {
+			POINT_LIGHT,
+			PARALLEL_LIGHT,
+			SPOT_LIGHT
+		}lightType;
+
 		typedef struct __light_usage {
 			string name;
 			GLuint id;
+			lightType type;
 
 			glm::vec3 pos;
 			glm::vec3 color;
@@ -166,7 +256,16 @@ namespace opengl
 
 			__light_usage(){}
 			__light_usage(const string &name, GLuint id, const glm::vec3 &pos):
-			name(name), id(id), pos(pos), cutoff(0.0f), outerCutoff(0.0f){}
+			name(name), id(id), type(POINT_LIGHT), pos(pos), direction(0.0f), cutoff(0.0f), outerCutoff(0.0f){}
+
+			// Distance at which the light falls below threshold, infinite for parallel lights
+			// A spot light's ambient is left out, renderers add it through ambient()
+			float radius(float threshold = 5.0f / 256.0f) const;
+			// Parallel lights reach every fragment and are never culled
+			bool unbounded() const;
+			// Ambient of a spot light, which is not attenuated and reaches outside
+			// the cone, zero for other lights
+			glm::vec3 ambient() const;
 		}lightUsage;
 
 	private:
@@ -174,24 +273,100 @@ namespace opengl
 		map<string, vector<objectUsage>> usage;
 
 		map<string, lightUsage> lightSource;
+		// Light marked "flashlight" in the scene file
+		string flashlightSource;
 
-		void genArray(const json &jsonObject, bool gen);
+		size_t meshletsDrawn;
+		size_t meshletsTested;
 
-		void genDefination(const json &jsonObject, const string &name);
-		static singleObject&& genObject(const plainModel &model);
+		// A definition built by load, waiting for its fence and swapIn
+		typedef struct __pending_definition {
+			string name;
+			vector<singleObject> objects;
+			GLsync fence;
+		}pendingDefinition;
+		// Scene file kept by prepare for load, its geometry is moved out
+		json deferred;
+		mutex pendingLock;
+		deque<pendingDefinition> pendingQueue;
+		exception_ptr loadError;
+		atomic<bool> loadDone;
+		// Summary of the packing load did, written before loadDone
+		string packReport;
+
+		// Moves the geometry out of jsonObject
+		void genArray(json &jsonObject, bool gen);
+		// Runs body on every entry of the kind, "usage" or "defination", in file order
+		static void eachEntry(json &jsonObject, const string &kind, const function<void (json&, const string&, GLuint)> &body);
+		// Starts importing the model definitions on the thread pool, by entry index
+		static map<GLuint, future<shared_ptr<scene>>> submitImports(const json &jsonObject);
+
+		// imported holds the scene of a model definition, loaded off the GL thread
+		// Touches no member, so load can run it on its own thread, moves the
+		// geometry out of jsonObject
+		static vector<singleObject> genDefination(json &jsonObject, shared_ptr<scene> imported);
+		// Takes the model's vertices and indices over without copying them
+		static singleObject genObject(plainModel &&model);
 		void genUsage(const json &jsonObject, const string &name);
+		// One usage of an object, culled per meshlet when it has them
+		void drawUsage(const singleObject &single, const glm::mat4 &viewProjection, const glm::mat4 &model, const glm::vec3 &eye, bool cones);
 		objectUsage genUsageAttr(const json &jsonObject, const string &name, GLuint id);
+
+		// Defines every forward variant shares, from the light counts and flashlight
+		shaderDefines sceneDefines() const;
+		shaderProgram& programFor(singleObject &single, const shaderDefines &scene);
+		// Starts compiling the variants one definition needs without waiting
+		void submitPrograms(const string &name);
+		// Fences a built definition and queues it for swapIn
+		void publish(pendingDefinition &&ready);
+		static void addTextures(texturePacker &packer, vector<singleObject> &objects);
 	public:
+		// Compiles the camera flashlight into the forward shader variants
+		bool flashlight;
+		// Cull imported models per meshlet, backfacing ones too while face culling is on
+		bool meshletCulling;
+		// Extra uniforms set on the forward variant each object draws with
+		map<string, vector<float>> uniforms;
+
 		objectArray(const string &filename, bool gen = true);
 		objectArray(const char *filename, bool gen = true);
 		objectArray(ifstream &file, bool gen = true);
 		objectArray(const json &jsonObject, bool gen = true);
+		// Empty, filled by prepare, load and swapIn
+		objectArray();
 		~objectArray();
 
+		// Asynchronous loading. prepare reads the file and its usages on the
+		// calling thread. load builds the definitions and their buffers, meant
+		// for a thread whose context shares objects with the drawing one.
+		// swapIn, on the drawing context between frames, adopts the definitions
+		// whose buffers are complete, one whole definition at a time, and
+		// returns true once load has finished and everything is in.
+		// With pack, load moves the textures into arrays before any of them
+		// upload and the definitions come in together afterwards.
+		void prepare(const string &filename);
+		void load(bool pack = false);
+		bool swapIn();
+
 		auto& operator[](const string &str);
 		const auto& operator[](const string &str) const;
 
 		void draw(const glm::mat4 &view, const glm::mat4 &projection, const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo);
+		// Draw every usage with an external program, textures bound by name from each object
+		void drawGeometry(const glm::mat4 &view, const glm::mat4 &projection, shaderProgram &program, void *globalInfo);
+
+		// Meshlets drawn out of those culled in the last draw call
+		string cullingReport() const;
+
+		// Moves the object textures into texture arrays and atlases, waits for
+		// their decodes and returns a summary, or the one of load(true)
+		string packTextures();
+
+		// Light sources with their usage callback applied to the position
+		map<string, lightUsage> getLights(void *globalInfo);
+		// Spot light following the camera, a 5 to 10 degree cone with the
+		// strength and attenuation of the light marked "flashlight"
+		lightUsage getFlashlight(const glm::vec3 &pos, const glm::vec3 &direction) const;
 
 		map<string, vector<singleObject>>& getDefination();
 		const map<string, vector<singleObject>>& getDefination() const;
@@ -0,0 +1,42 @@
+#pragma once
+#include "gl.hpp"
+
+#include <vector>
+
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+
+namespace opengl
+{
+	using namespace std;
+
+	typedef enum _block_format {
+		// RGB, 8 bytes per 4x4 block
+		BC1_FORMAT,
+		// RGBA, BC1 color plus an interpolated alpha block
+		BC3_FORMAT,
+		// Two interpolated channels, red and green
+		BC5_FORMAT
+	}blockFormat;
+
+	// CPU encoder for the BCn block formats
+	// Endpoints come from the inset bounding box of each block and indices
+	// from a projection onto the endpoint line, four pixels at a time with
+	// SSE. Fast enough to run once at first load, not meant to be optimal.
+	class DLL_SIGN blockCompressor
+	{
+	private:
+		static void encodeColor(const unsigned char *block, unsigned char *out);
+		static void encodeChannel(const unsigned char *block, int channel, unsigned char *out);
+	public:
+		static GLenum glFormat(blockFormat format);
+		// Bytes per 4x4 block of a GL compressed format
+		static size_t blockBytes(GLenum glFormat);
+		static size_t compressedSize(blockFormat format, int width, int height);
+
+		// Input is tightly packed RGBA8, edges are clamped for partial blocks
+		static vector<unsigned char> compress(const unsigned char *rgba, int width, int height, blockFormat format);
+		// 2x2 box filter to the next mip level
+		static vector<unsigned char> downsample(const unsigned char *rgba, int width, int height);
+	};
+}
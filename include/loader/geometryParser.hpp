@@ -0,0 +1,29 @@
+#pragma once
+#include "gl.hpp"
+
+#include "nlohmann/json.hpp"
+
+#include <string>
+#include <vector>
+#include <istream>
+
+namespace opengl
+{
+	using json = nlohmann::json;
+
+	using namespace std;
+
+	// Reads scene and array files without building a DOM of their geometry
+	// The "value" arrays of "vertex" and "indice" objects are parsed number by
+	// number into GLfloat and GLuint bytes, kept in the document as binary
+	// values. Everything else comes out as json::parse builds it.
+	class DLL_SIGN geometryParser
+	{
+	public:
+		// root names the top level object, "vertex" or "indice" for array files
+		static json parse(istream &input, const string &root = string());
+
+		// Payload of a base64 data URI, or of a bare base64 string
+		static vector<unsigned char> decodeBase64(const string &text);
+	};
+}
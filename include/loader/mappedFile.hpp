@@ -0,0 +1,29 @@
+#pragma once
+#include "gl.hpp"
+
+#include <string>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Read only view of a whole file, unmapped with the object
+	class DLL_SIGN mappedFile
+	{
+	private:
+		const unsigned char *address;
+		size_t length;
+#ifdef _WIN32
+		void *fileHandle;
+		void *mappingHandle;
+#endif
+	public:
+		// Throws if the file cannot be opened or mapped
+		mappedFile(const string &path);
+		mappedFile(const mappedFile&) = delete;
+		~mappedFile();
+
+		const unsigned char* data() const;
+		size_t size() const;
+	};
+}
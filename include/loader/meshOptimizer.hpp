@@ -0,0 +1,51 @@
+#pragma once
+#include "gl.hpp"
+#include "loader/modelLoader.hpp"
+
+#include <vector>
+#include <string>
+#include <atomic>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Reorders imported triangle meshes for the GPU, once before they reach the mesh cache
+	// Identical vertices are welded, triangles ordered for the post transform
+	// cache after Forsyth, runs of them sorted outside in against overdraw, and
+	// vertices renumbered by first use so fetches walk the buffer forward.
+	class DLL_SIGN meshOptimizer
+	{
+	private:
+		typedef struct __optimize_stats {
+			atomic<GLuint> meshes;
+			atomic<uint64_t> triangles;
+			atomic<uint64_t> verticesBefore;
+			atomic<uint64_t> verticesAfter;
+			atomic<uint64_t> missesBefore;
+			atomic<uint64_t> missesAfter;
+		}optimizeStats;
+		static optimizeStats stats;
+
+		static glm::vec3 position(const plainModel &model, size_t vertex);
+		// Triangle order for an LRU cache of FORSYTH_CACHE_SIZE entries
+		static vector<indiceData> cacheOrder(const vector<indiceData> &indices, size_t vertexCount);
+		// Splits the order into runs that each start cold and sorts them by how far they face outwards
+		static void sortClusters(const plainModel &model, vector<indiceData> &indices);
+	public:
+		// Entries of the FIFO cache ACMR is measured against
+		static size_t cacheSize;
+		// Meshlet limits, 124 triangles keep 64 vertices at a typical 2:1 ratio
+		static size_t meshletVertices;
+		static size_t meshletTriangles;
+
+		// The model must hold its vertices in vectors, not a mapping
+		static void optimize(plainModel &model);
+		// Vertices transformed by a FIFO cache of cacheSize, over all triangles
+		static size_t cacheMisses(const vector<indiceData> &indices, size_t vertexCount);
+		// Covers the index buffer of a model with meshlets, run after optimize
+		static void buildMeshlets(plainModel &model);
+		// Average cache miss ratio before and after, over every mesh so far
+		static string report();
+	};
+}
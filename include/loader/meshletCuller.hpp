@@ -0,0 +1,40 @@
+#pragma once
+#include "gl.hpp"
+#include "loader/modelLoader.hpp"
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+namespace opengl
+{
+	using namespace std;
+
+	// Per frame frustum and backface rejection of the meshlets of one object
+	// Bounds are kept four to a group so SSE tests four meshlets at once, large
+	// objects are split over the render pool. Survivors next to each other in the
+	// index buffer merge into one range for glMultiDrawElements.
+	class DLL_SIGN meshletCuller
+	{
+	private:
+		size_t count;
+		// Padded to a multiple of four, padding lanes are never drawn
+		vector<float> centerX, centerY, centerZ, radius;
+		vector<float> axisX, axisY, axisZ, cutoff;
+		vector<GLuint> first, length;
+
+		void cullGroups(const glm::vec4 *planes, const glm::vec3 &eye, bool cones, unsigned char *visible, size_t begin, size_t end) const;
+	public:
+		meshletCuller(const vector<meshlet> &meshlets);
+
+		size_t size() const;
+
+		// transform takes model space to clip space and eye is the camera in model
+		// space, cones also rejects meshlets facing away. Fills counts and byte
+		// offsets of the ranges to draw and returns the meshlets kept.
+		size_t cull(const glm::mat4 &transform, const glm::vec3 &eye, bool cones, GLuint indexBytes, vector<GLsizei> &counts, vector<const void*> &offsets) const;
+
+		// Objects with at least this many meshlets are culled on the render pool
+		static size_t parallelThreshold;
+	};
+}
@@ -8,6 +8,7 @@
 
 #include "gl.hpp"
 #include "loader/textureLoader.hpp"
+#include "loader/mappedFile.hpp"
 
 #include <vector>
 #include <initializer_list>
@@ -24,17 +25,61 @@ namespace opengl
 		glm::vec2 texture;
 	}vertexData;
 
+	// 16 bytes against 32, positions in unorm16 across the model bounds,
+	// octahedral normals in snorm16 and half float texture coordinates
+	typedef struct __packed_vertex {
+		GLushort vertex[4];
+		GLshort normal[2];
+		GLushort texture[2];
+	}packedVertex;
+
 	typedef GLuint indiceData;
 
+	// A run of triangles in the index buffer touching at most 64 vertices
+	typedef struct __meshlet {
+		GLuint indiceOffset;
+		GLuint indiceCount;
+		glm::vec3 center;
+		float radius;
+		// Normals of every triangle lie within the cone around coneAxis, coneCutoff
+		// is the sine of its half angle, 1 when it is too wide to ever cull
+		glm::vec3 coneAxis;
+		float coneCutoff;
+	}meshlet;
+
 	typedef struct __plain_model {
 		vector<vertexData> vertices;
+		// Used instead of vertices when quantized, boundsMin and the extent
+		// of the bounds turn the positions back into model space
+		vector<packedVertex> packedVertices;
+		bool quantized;
 		vector<indiceData> indices;
+		// Cover the index buffer in order, culled per frame below the mesh level
+		vector<meshlet> meshlets;
 
 		map<string, texture> textures;
+		// Texture files relative to the model directory, by uniform name
+		map<string, string> texturePaths;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+
+		// Set when loaded from the mesh cache, the vertices and indices are
+		// then ranges inside the mapping and the vectors stay empty
+		shared_ptr<mappedFile> mapping;
+		const unsigned char *mappedVertices;
+		size_t mappedVertexCount;
+		const indiceData *mappedIndices;
+		size_t mappedIndiceCount;
+
+		__plain_model():
+		quantized(false), boundsMin(0.0f), boundsMax(0.0f), mappedVertices(NULL), mappedVertexCount(0), mappedIndices(NULL), mappedIndiceCount(0){}
 
+		// Packed vertices come out as 4 byte words all the same
 		const GLfloat* rawVertex() const;
 		size_t rawVertexSize() const;
 		size_t vertexSize() const;
+		// Bytes per vertex
+		size_t vertexStride() const;
 
 		const GLuint* rawIndice() const;
 		size_t rawIndiceSize() const;
@@ -49,20 +94,40 @@ namespace opengl
 		string directory;
 
 		void convertor(const aiNode *node, const aiScene *scene);
+
+		// Compiled meshes next to the source, keyed by the content of the model
+		// and its material libraries and by the postprocess flags
+		// The sources are only hashed again once their size or modification
+		// time changed, restamp is then set if the contents still match.
+		bool readCache(const string &path, const string &filename, bool &restamp);
+		void writeCache(const string &path, const string &filename) const;
 	public:
+		// Skip assimp on later loads through <model>.meshcache
+		static bool useCache;
+		// Convert into packedVertex instead of vertexData
+		static bool quantize;
+		// Weld and reorder the meshes through meshOptimizer
+		static bool optimize;
+
 		scene() = delete;
-		scene(const string &filename);
+		// Safe on any thread without textures, loadTextures then runs on the GL thread
+		scene(const string &filename, bool withTextures = true);
+
+		// Creates the textures named by texturePaths, they start decoding right away
+		void loadTextures();
 
+		// Hands every model over to hook, the scene is empty afterwards
 		template <class T>
-		vector<T>&& map(function<T&& (const plainModel&)> hook)
+		vector<T> map(function<T (plainModel&&)> hook)
 		{
-			vector<T> *ret = new vector<T>();
-			ret->reserve(this->size());
-			for (auto model : *this)
+			vector<T> ret;
+			ret.reserve(this->size());
+			for (auto &model : *this)
 			{
-				ret->emplace_back(hook(model));
+				ret.emplace_back(hook(move(model)));
 			}
-			return move(*ret);
+			this->clear();
+			return ret;
 		}
 	};
 }
@@ -0,0 +1,48 @@
+#pragma once
+#include "gl.hpp"
+
+#include <string>
+#include <mutex>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Linked program binaries kept on disk between runs
+	// Files are named after a hash of the preprocessed sources and the GL
+	// vendor, renderer and version strings, so a driver update misses
+	// instead of loading a stale binary.
+	class DLL_SIGN programCache
+	{
+	private:
+		typedef struct __cache_stats {
+			GLuint hits;
+			GLuint compiled;
+			// Cache files that existed but could not be used
+			GLuint rejected;
+			double loadSeconds;
+			double compileSeconds;
+		}cacheStats;
+
+		// Every window thread builds programs, so the stats are updated under statsLock
+		static cacheStats stats;
+		static mutex statsLock;
+
+		static bool supported();
+		static string path(const string &key);
+	public:
+		static string directory;
+		static bool enabled;
+
+		static string key(const string &vertexCode, const string &fragmentCode);
+
+		// Asks the driver to keep the binary retrievable, call before linking
+		static void prepare(GLuint program);
+		// False if there is no usable entry, the program can then be linked from source
+		static bool load(GLuint program, const string &key);
+		static void store(GLuint program, const string &key);
+
+		static void recordCompile(double seconds);
+		static string report();
+	};
+}
@@ -11,6 +11,10 @@
 #include <initializer_list>
 #include <map>
 #include <variant>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <atomic>
 
 namespace opengl
 {
@@ -20,15 +24,29 @@ namespace opengl
 
 	using namespace std;
 
+	// Macro name to value, ordered so equal sets give equal keys
+	typedef map<string, string> shaderDefines;
+
 	class DLL_SIGN shader
 	{
 	private:
 		GLenum shaderType;
 		GLuint shaderId;
 	public:
-		shader(const string &filename, GLenum shaderType);
+		// Defines are inserted right after the #version line
+		// Compilation is only started, check() reads the result
+		shader(const string &filename, GLenum shaderType, const string &defines = string());
+		shader(const shader&) = delete;
 		~shader();
 
+		void check() const;
+
+		// Strings without whitespace are file names, anything else is code
+		static bool isFile(const string &str);
+		// File contents (or the string itself if it is code) with the defines applied
+		static string preprocess(const string &str, const string &defines);
+		static string injectDefines(const string &code, const string &defines);
+
 		GLuint getShader() const
 		{
 			return shaderId;
@@ -58,26 +76,100 @@ namespace opengl
 	class DLL_SIGN shaderProgram
 	{
 	private:
-		static map<string, GLuint> regProgram;
-
-		GLuint programId;
-
-		map<string, uniformSetter> setterList;
-
+		// Compile and link in flight, kept until the result is read
+		typedef struct __pending_build {
+			unique_ptr<shader> vertexShader;
+			unique_ptr<shader> fragmentShader;
+			string cacheKey;
+			chrono::steady_clock::time_point start;
+			// Compile and link time so far, the time the program waits
+			// unused before its first draw is not counted
+			double seconds;
+			bool linked;
+		}pendingBuild;
+
+		// One linked GL program, shared by every handle whose preprocessed
+		// sources hash the same. The program is deleted with the last handle.
+		typedef struct __program_record {
+			GLuint programId;
+			map<string, uniformSetter> setterList;
+			unique_ptr<pendingBuild> pending;
+
+			// Kept for hot reload
+			uint64_t hash;
+			string vertexSource;
+			string fragmentSource;
+			string defineBlock;
+
+			__program_record():
+			programId(0), hash(0){}
+			~__program_record();
+		}programRecord;
+
+		typedef struct __registry_stats {
+			atomic<GLuint> links;
+			atomic<GLuint> shared;
+			atomic<GLuint> binds;
+			atomic<GLuint> skippedBinds;
+		}registryStats;
+
+		static map<uint64_t, weak_ptr<programRecord>> regProgram;
+		// Every window thread builds and reloads programs
+		static mutex registryLock;
+		static registryStats stats;
+
+		shared_ptr<programRecord> record;
+
+		// Vertex and fragment file names or code, compiled on first use
+		string vertexSource;
+		string fragmentSource;
+		string defineBlock;
+
+		// Specialized copies of this program, keyed by their define block
+		map<string, shared_ptr<shaderProgram>> variants;
+
+		void build();
 		void linkProgram(shader &vShader, shader &fShader);
+
+		// Relinks from the current files, false keeps the old program
+		static bool reload(programRecord &target);
+		static void copyUniforms(GLuint from, GLuint to);
 	public:
 		shaderProgram();
-		shaderProgram(const string &vShader, const string &fShader);
+		shaderProgram(const string &vShader, const string &fShader, const shaderDefines &defines = shaderDefines());
 		shaderProgram(const json &jsonFile);
 		~shaderProgram();
 
-		void useProgram() const;
-
-		GLuint getProgram() const
+		// Non-blocking build, submit() starts compile and link, poll() tells
+		// whether the driver has finished without waiting, resolve() reads the
+		// result and throws on errors. Using the program resolves it implicitly.
+		void submit();
+		bool poll();
+		void resolve();
+		// GL_KHR_parallel_shader_compile or the ARB variant is available
+		static bool parallelCompile();
+
+		// glUseProgram is skipped if the program is already bound
+		void useProgram();
+		// Forget the bound program, needed after switching contexts
+		static void resetBinding();
+		// Relinks every program whose shader files changed on disk, call on
+		// the GL thread between frames. Uniform values survive the relink.
+		static void reloadChanged();
+
+		GLuint getProgram()
 		{
-			return programId;
+			build();
+			return record->programId;
 		}
 
+		// Same sources compiled with the defines, built on first request and cached
+		shaderProgram& variant(const shaderDefines &defines);
+
+		static string toDefineBlock(const shaderDefines &defines);
+		// Live programs, links and skipped binds
+		static string report();
+
 		uniformSetter& operator[](const string &name);
 	};
 }
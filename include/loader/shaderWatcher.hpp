@@ -0,0 +1,40 @@
+#pragma once
+#include "gl.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <filesystem>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Reports shader files written since the last call, never blocks
+	// Linux uses inotify on the containing directories, so editors that save
+	// through a rename are seen too. Elsewhere modification times are polled.
+	class DLL_SIGN shaderWatcher
+	{
+	private:
+		set<string> files;
+#ifdef __linux__
+		int notifyFd;
+		map<int, string> directories;
+		set<string> watchedDirectories;
+#else
+		map<string, filesystem::file_time_type> modified;
+		chrono::steady_clock::time_point lastPoll;
+#endif
+		static string normalize(const string &file);
+	public:
+		shaderWatcher();
+		shaderWatcher(const shaderWatcher&) = delete;
+		~shaderWatcher();
+
+		// Watching the same file twice is a no-op
+		void watch(const string &file);
+		vector<string> changed();
+	};
+}
@@ -1,31 +1,215 @@
 #pragma once
 #include "gl.hpp"
+#include "loader/mappedFile.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 
 #include <string>
 #include <map>
+#include <memory>
+#include <future>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "glm/glm.hpp"
 
 namespace opengl
 {
 	using namespace std;
 
+	// Decoded mip chain waiting for the upload on the GL thread
+	typedef struct __texture_staging {
+		int width;
+		int height;
+		int channels;
+
+		// Block compressed format, 0 if levels hold RGBA8 pixels
+		GLenum compressedFormat;
+		vector<vector<unsigned char>> levels;
+
+		// Levels served straight from a mapped cache file, as offset and size
+		shared_ptr<mappedFile> mapping;
+		vector<pair<size_t, size_t>> mappedLevels;
+
+		__texture_staging():
+		width(0), height(0), channels(0), compressedFormat(0){}
+
+		size_t levelCount() const
+		{
+			return mapping ? mappedLevels.size() : levels.size();
+		}
+		const unsigned char* levelData(size_t level) const
+		{
+			return mapping ? mapping->data() + mappedLevels[level].first : levels[level].data();
+		}
+		size_t levelSize(size_t level) const
+		{
+			return mapping ? mappedLevels[level].second : levels[level].size();
+		}
+	}textureStaging;
+
+	// Texture array shared by the layers texturePacker assigned to it
+	typedef struct __packed_storage {
+		GLuint arrayId;
+		size_t bytes;
+
+		__packed_storage():
+		arrayId(0), bytes(0){}
+		~__packed_storage();
+	}packedStorage;
+
 	class DLL_SIGN texture
 	{
 	private:
-		static map<string, GLuint> regTexture;
+		// GL texture shared by every handle of one file, deleted with the last handle
+		typedef struct __texture_record {
+			GLuint textureId;
+			GLenum textureType;
+			string name;
+			// Decode running on the thread pool, invalid once storage exists
+			future<shared_ptr<textureStaging>> pending;
+			// Levels below baseLevel still to be streamed, released when done
+			shared_ptr<textureStaging> staging;
+			GLint baseLevel;
+			// Allocated by glTexStorage2D, levels are filled with SubImage
+			bool immutable;
+
+			// Set when the image lives in a layer of a texture array
+			shared_ptr<packedStorage> packed;
+			GLint layer;
+			// Offset and scale of the image inside the layer
+			glm::vec4 rect;
+
+			// Bytes allocated for every level and when the texture was last bound
+			size_t residentBytes;
+			double lastUsed;
+			// Loaded from a file, so it can be decoded again after a demote or evict
+			bool reloadable;
+			bool normalMap;
+			// Only the mip tail is resident, the full image reloads once it is bound
+			bool demoted;
+			// Created under holdUploads, left for texturePacker instead of uploaded
+			bool held;
+
+			__texture_record():
+			textureId(0), textureType(GL_TEXTURE_2D), baseLevel(0), immutable(false), layer(0), rect(0.0f, 0.0f, 1.0f, 1.0f),
+			residentBytes(0), lastUsed(0.0), reloadable(false), normalMap(false), demoted(false), held(false){}
+			~__texture_record();
+		}textureRecord;
+
+		static map<string, weak_ptr<textureRecord>> regTexture;
+		// Held by the loader and every window thread while they touch records,
+		// recursive as resolving a texture may finish and stream it
+		static recursive_mutex registryLock;
 		static map<string, GLenum> convertMap;
+		// Bound while the real image is still decoding
+		static GLuint placeholder;
+		// Loaders currently holding uploads
+		static GLuint holds;
+
+		shared_ptr<textureRecord> record;
+
+		// Pixel unpack buffers used round robin for streamed levels
+		static vector<GLuint> unpackBuffers;
+		static size_t nextUnpackBuffer;
+
+		// Allocates the texture and uploads the mip tail
+		static void upload(textureRecord &target, shared_ptr<textureStaging> staging);
+		// Uploads the next larger level through a pixel unpack buffer
+		static size_t streamLevel(textureRecord &target);
+		static void buildMips(textureStaging &staging, vector<unsigned char> &&rgba);
+		// Runs on the thread pool, transcodes to BCn through the cache when allowed
+		static shared_ptr<textureStaging> decode(const string &filename, bool s3tc, bool normalMap);
+		static bool readCache(const string &path, textureStaging &staging);
+		static void writeCache(const string &path, const textureStaging &staging);
+		// Page aligned RGBA8 mip chains, mapped instead of read
+		static shared_ptr<mappedFile> openDecoded(const string &path);
+		static shared_ptr<textureStaging> mapDecoded(shared_ptr<mappedFile> mapping);
+		static void writeDecoded(const string &path, const textureStaging &staging, int64_t modified, uint64_t sourceSize, uint64_t sourceHash);
 
-		GLuint textureId;
-		GLenum textureType;
+		// Updated from the decode workers
+		typedef struct __cache_stats {
+			atomic<GLuint> compressedHits;
+			atomic<GLuint> decodedHits;
+			atomic<GLuint> misses;
+			atomic<uint64_t> mappedBytes;
+			atomic<uint64_t> writtenBytes;
+		}cacheStats;
+		static cacheStats stats;
+		// Uploads if the decode is done, never waits
+		static bool finish(textureRecord &target);
+		// Starts decoding the source file on the thread pool
+		static void request(textureRecord &target);
 
-		texture(GLuint id);
+		// Seconds on a steady clock as of the last processUploads, on any
+		// window, for the least recently used order
+		static atomic<double> uploadTime;
+		// Stream bytes spent by the windows that uploaded since the budget
+		// refilled, it refills once one of them comes round again
+		static size_t streamSpent;
+		static set<thread::id> streamRound;
+		// Reads the mip tail back and replaces the texture with it
+		static void demote(textureRecord &target);
+		static void evict(textureRecord &target);
+		// Demotes, then evicts, textures idle for coldSeconds until under memoryBudget
+		static void enforceBudget();
 	public:
+		// Transcoded KTX files, named after a hash of the source file, and
+		// decoded mip chains, named after a hash of the source path
+		static string cacheDirectory;
+		static bool compress;
+		// Levels up to this size are uploaded at once, larger ones are streamed
+		static int tailSize;
+		// Bytes of streamed levels uploaded per frame, shared by every window,
+		// one level always goes through
+		static size_t streamBudget;
+		// Bytes of resident texture levels, 0 for no limit, packed arrays count
+		// against it but are never evicted
+		static size_t memoryBudget;
+		// Seconds a texture goes unbound before the budget may read it back and
+		// demote it, so culling it for a moment does not stall on a readback
+		static double coldSeconds;
+
 		texture() = delete;
+		// Type "normal" loads a tangent space normal map, stored as BC5
+		// Returns right away, the file decodes on the thread pool
 		texture(const string &filename, const string &type = "2d");
 		texture(const string &name, const unsigned char *data, int channels, int width, int height, const string &type);
 		~texture();
 
+		// Binds a placeholder until the image has been uploaded
 		void useTexture() const;
+		// Id and target useTexture would bind, lets callers skip redundant binds
+		GLuint resolve() const;
+		GLenum getTarget() const;
+
+		// Packed textures are sampled from a GL_TEXTURE_2D_ARRAY at getLayer(),
+		// with UVs mapped into getRect() (offset xy, scale zw)
+		bool isPacked() const;
+		GLint getLayer() const;
+		const glm::vec4& getRect() const;
+		bool operator<(const texture &other) const
+		{
+			return record < other.record;
+		}
+		bool ready() const;
+		// Waits for the decode and uploads every level, for callers that need the full image
+		void wait() const;
+
+		// Starts finished decodes, streams mip levels within streamBudget and
+		// keeps residency within memoryBudget, call on the GL thread between frames
+		static void processUploads();
+		// Textures created from files while any hold is active, on any thread,
+		// are not uploaded, so a loader can pack them once they have decoded
+		// Whatever it did not pack uploads as usual once the last hold is lifted.
+		static void holdUploads(bool hold);
+		// Resident bytes against the budget, detailed lists every texture
+		static string memoryReport(bool detailed = false);
+		static string cacheReport();
+
+		friend class texturePacker;
 	};
 }
@@ -0,0 +1,59 @@
+#pragma once
+#include "loader/textureLoader.hpp"
+
+#include <vector>
+#include <map>
+#include <string>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Moves textures into GL_TEXTURE_2D_ARRAY storage at scene load
+	// Textures of the same format, size and mip count become layers of one
+	// array. Small ones left over are packed into atlas pages, which are
+	// layers too, so meshes sharing an array also share the bind.
+	class DLL_SIGN texturePacker
+	{
+	private:
+		typedef texture::textureRecord textureRecord;
+
+		typedef struct __pack_entry {
+			shared_ptr<textureRecord> record;
+			shared_ptr<textureStaging> staging;
+			// Only images sampled within [0, 1] may go into an atlas, they cannot repeat
+			bool atlasAllowed;
+		}packEntry;
+
+		typedef struct __pack_stats {
+			GLuint arrays;
+			GLuint layers;
+			GLuint atlased;
+			GLuint unpacked;
+		}packStats;
+
+		vector<packEntry> entries;
+		map<textureRecord*, size_t> indexOf;
+		packStats stats;
+
+		// Uploads images that all share format and level sizes as layers
+		static shared_ptr<packedStorage> createArray(const vector<const textureStaging*> &layers, GLenum wrap);
+		// Places small images onto pages with a shelf packer, returns the ones that did not fit
+		void packAtlas(vector<packEntry*> &candidates);
+	public:
+		// Pages are square, images up to maxAtlasSize are considered
+		static int atlasPageSize;
+		static int maxAtlasSize;
+
+		texturePacker();
+
+		// Adding a texture twice keeps it atlas capable only if every use allows it
+		void add(const texture &target, bool atlasAllowed);
+		// Waits for pending decodes, textures that stay alone are uploaded as usual
+		// While uploads are held only held textures are packed, the arrays are
+		// built on the calling context, so fence them before lifting the hold
+		void pack();
+
+		string report() const;
+	};
+}
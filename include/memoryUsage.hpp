@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace opengl
+{
+	// Highest resident set of the process so far, in bytes
+	inline size_t peakMemory()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+		return counters.PeakWorkingSetSize;
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+			return 0;
+#ifdef __APPLE__
+		return usage.ru_maxrss;
+#else
+		// Reported in kilobytes on Linux
+		return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+	}
+}
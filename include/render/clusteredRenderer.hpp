@@ -0,0 +1,68 @@
+#pragma once
+
+#include "loader/arrayLoader.hpp"
+
+#include <string>
+#include <vector>
+
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_MAX_LIGHTS 128
+
+namespace opengl
+{
+	using namespace std;
+
+	// Clustered forward shading
+	// The view frustum is split into CLUSTER_X * CLUSTER_Y screen tiles and
+	// CLUSTER_Z exponential depth slices. Each frame the CPU assigns every
+	// light to the clusters its range (or spot cone) touches, depth slices are
+	// spread over the thread pool and clusters are tested four at a time with
+	// SSE. Light data and per-cluster lists reach the shader as texture buffers.
+	class DLL_SIGN clusteredRenderer
+	{
+	private:
+		typedef struct __culled_light {
+			glm::vec3 center;
+			float radius;
+			glm::vec3 axis;
+			float sinAngle;
+			float cosAngle;
+			bool spot;
+		}culledLight;
+
+		// View space cluster bounds, structure of arrays for SIMD
+		vector<float> boxMinX, boxMinY, boxMinZ;
+		vector<float> boxMaxX, boxMaxY, boxMaxZ;
+		glm::mat4 lastProjection;
+		float nearPlane;
+		float farPlane;
+
+		vector<GLuint> clusterCount;
+		vector<GLuint> clusterLights;
+		GLuint parallelCount;
+
+		GLuint lightBuffer, lightTexture;
+		GLuint gridBuffer, gridTexture;
+		GLuint indexBuffer, indexTexture;
+
+		shaderProgram *program;
+
+		void buildClusters(const glm::mat4 &projection);
+		void cullSlices(const vector<culledLight> &lights, GLuint firstLight, size_t begin, size_t end);
+		void upload(const vector<objectArray::lightUsage> &lights);
+	public:
+		bool flashlight;
+
+		clusteredRenderer(const string &shaderDirectory = "shader/");
+		clusteredRenderer(const clusteredRenderer&) = delete;
+		~clusteredRenderer();
+
+		// CPU light assignment, lights are in world space
+		void assign(const vector<objectArray::lightUsage> &lights, const glm::mat4 &view, const glm::mat4 &projection);
+
+		void render(objectArray &renderArray, const glm::mat4 &view, const glm::mat4 &projection,
+					const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo);
+	};
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "loader/arrayLoader.hpp"
+
+#include <string>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Deferred shading path
+	// A geometry pass fills the G-buffer (albedo, specular, normal, depth), then
+	// each light from objectArray is accumulated additively over a scissored
+	// screen-space triangle, so lighting cost follows the pixels a light reaches.
+	class DLL_SIGN deferredRenderer
+	{
+	private:
+		GLuint gBuffer;
+		GLuint albedoTexture;
+		GLuint specularTexture;
+		GLuint normalTexture;
+		GLuint depthTexture;
+
+		GLsizei capacityWidth;
+		GLsizei capacityHeight;
+
+		GLuint screenArray;
+
+		shaderProgram *geometryProgram;
+		shaderProgram *lightProgram;
+
+		void allocate(GLsizei w, GLsizei h);
+		void release();
+
+		void lightPass(const objectArray::lightUsage &light, const glm::mat4 &view, const glm::mat4 &projection, GLint viewport[4]);
+	public:
+		// Camera flashlight, as objectArray::getFlashlight describes it
+		bool flashlight;
+
+		deferredRenderer(const string &shaderDirectory = "shader/");
+		deferredRenderer(const deferredRenderer&) = delete;
+		~deferredRenderer();
+
+		// Renders into the framebuffer and viewport bound when called
+		void render(objectArray &renderArray, const glm::mat4 &view, const glm::mat4 &projection,
+					const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo);
+	};
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "gl.hpp"
+#include "threadPool.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Frame grabbing without stalling the pipeline
+	// Pixels are read into a ring of PBOs, mapped some frames later once
+	// their fence has signaled, and encoded to PNG on a worker thread.
+	class DLL_SIGN frameCapture
+	{
+	private:
+		typedef struct __capture_slot {
+			GLuint buffer;
+			GLsync fence;
+			GLsizei width;
+			GLsizei height;
+			unsigned long long frame;
+			string filename;
+
+			__capture_slot():
+			buffer(0), fence(NULL), width(0), height(0), frame(0) {}
+		}captureSlot;
+
+		vector<captureSlot> slots;
+		deque<string> requests;
+
+		GLuint slotCount;
+		GLuint latency;
+		unsigned long long frameIndex;
+
+		threadPool encoder;
+
+		void readback(captureSlot &slot, GLsizei width, GLsizei height);
+		bool collect(captureSlot &slot);
+	public:
+		frameCapture(GLuint slotCount = 3, GLuint latency = 2);
+		frameCapture(const frameCapture&) = delete;
+		~frameCapture();
+
+		// Queue a capture of the next finished frame
+		void request(const string &filename);
+		// Called once per frame after rendering, before the buffers swap
+		void process(GLsizei width, GLsizei height);
+
+		size_t pending() const;
+
+		static void writePNG(const string &filename, const unsigned char *rgba, int width, int height);
+	};
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "gl.hpp"
+
+namespace opengl
+{
+	// Offscreen color + depth target
+	// Storage is allocated for the largest size asked for, smaller frames
+	// render into the lower left corner so scaling never reallocates.
+	class DLL_SIGN renderTarget
+	{
+	private:
+		GLuint frameBuffer;
+		GLuint colorTexture;
+		GLuint depthBuffer;
+
+		GLsizei capacityWidth;
+		GLsizei capacityHeight;
+		GLsizei width;
+		GLsizei height;
+
+		void allocate(GLsizei w, GLsizei h);
+		void release();
+	public:
+		renderTarget();
+		renderTarget(const renderTarget&) = delete;
+		~renderTarget();
+
+		// Make sure storage can hold w * h, reallocates only on change of capacity
+		void reserve(GLsizei w, GLsizei h);
+		// Size of the region the next frame renders into
+		void resize(GLsizei w, GLsizei h);
+
+		void bind() const;
+		// Upscale the used region onto the default framebuffer
+		void blitToDefault(GLsizei w, GLsizei h) const;
+
+		GLuint getColor() const
+		{
+			return colorTexture;
+		}
+		GLsizei getWidth() const
+		{
+			return width;
+		}
+		GLsizei getHeight() const
+		{
+			return height;
+		}
+	};
+}
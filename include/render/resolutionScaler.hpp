@@ -0,0 +1,56 @@
+#pragma once
+
+#include "gl.hpp"
+
+#define SCALER_QUERY_COUNT 4
+
+namespace opengl
+{
+	// Feedback controller picking a render scale from measured GPU time
+	// Timer queries are read a few frames late so the CPU never waits on them.
+	// The dead band between lowerRatio and upperRatio of the budget, plus the
+	// settle counter, keeps the scale from oscillating around the budget.
+	class DLL_SIGN resolutionScaler
+	{
+	private:
+		GLuint queries[SCALER_QUERY_COUNT];
+		bool issued[SCALER_QUERY_COUNT];
+		GLuint current;
+		bool initialized;
+
+		float scale;
+		double gpuTime;
+
+		GLuint overCount;
+		GLuint underCount;
+
+		void feed(double milliseconds);
+	public:
+		float minScale;
+		float maxScale;
+		// Target GPU time in milliseconds
+		double budget;
+
+		float upperRatio;
+		float lowerRatio;
+		GLuint settleFrames;
+		float increaseStep;
+
+		resolutionScaler(float minScale = 0.5f, float maxScale = 1.0f, double budget = 16.0);
+		resolutionScaler(const resolutionScaler&) = delete;
+		~resolutionScaler();
+
+		void beginFrame();
+		void endFrame();
+
+		float getScale() const
+		{
+			return scale;
+		}
+		// Last measured GPU time of the scene in milliseconds
+		double getGpuTime() const
+		{
+			return gpuTime;
+		}
+	};
+}
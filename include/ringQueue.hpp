@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Lock free queue for exactly one producer and one consumer thread
+	// Capacity is a power of two, push fails instead of waiting when full.
+	template <typename T, size_t capacity>
+	class ringQueue
+	{
+	private:
+		static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "Ring capacity must be a power of two.");
+
+		T slots[capacity];
+		// Kept on lines of their own so the two threads do not fight over them
+		alignas(64) atomic<size_t> head;
+		alignas(64) atomic<size_t> tail;
+	public:
+		ringQueue():
+		head(0), tail(0) {}
+		ringQueue(const ringQueue&) = delete;
+
+		// Producer only
+		bool push(const T &value)
+		{
+			size_t next = head.load(memory_order_relaxed);
+			if (next - tail.load(memory_order_acquire) == capacity)
+				return false;
+			slots[next & (capacity - 1)] = value;
+			head.store(next + 1, memory_order_release);
+			return true;
+		}
+
+		// Consumer only
+		bool pop(T &value)
+		{
+			size_t next = tail.load(memory_order_relaxed);
+			if (next == head.load(memory_order_acquire))
+				return false;
+			value = slots[next & (capacity - 1)];
+			tail.store(next + 1, memory_order_release);
+			return true;
+		}
+	};
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "gl.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <queue>
+#include <vector>
+
+namespace opengl
+{
+	using namespace std;
+
+	// Fixed size worker pool, tasks are run in submission order
+	class DLL_SIGN threadPool
+	{
+	private:
+		vector<thread> workers;
+		queue<function<void ()>> tasks;
+
+		mutex taskLock;
+		condition_variable taskReady;
+		bool stopping;
+
+		void workerLoop();
+	public:
+		// 0 means one worker per hardware thread
+		threadPool(size_t count = 0);
+		threadPool(const threadPool&) = delete;
+		~threadPool();
+
+		template <typename F>
+		auto submit(F &&task) -> future<decltype(task())>
+		{
+			using result = decltype(task());
+			auto packed = make_shared<packaged_task<result ()>>(forward<F>(task));
+			future<result> ret = packed->get_future();
+			{
+				lock_guard<mutex> lock(taskLock);
+				tasks.emplace([packed]() { (*packed)(); });
+			}
+			taskReady.notify_one();
+			return ret;
+		}
+
+		// Split [begin, end) into one range per worker and wait for all of them
+		// The calling thread runs a range too, never call this from a pool task
+		void parallelFor(size_t begin, size_t end, const function<void (size_t, size_t)> &body);
+
+		size_t size() const;
+
+		// Shared pool for short CPU jobs
+		static threadPool& global();
+		// Kept free of loading work, for jobs a frame waits on
+		static threadPool& render();
+	};
+}
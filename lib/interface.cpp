@@ -1,4 +1,7 @@
 #include "interface.hpp"
+#include "loader/programCache.hpp"
+#include "loader/meshOptimizer.hpp"
+#include "memoryUsage.hpp"
 #include <iostream>
 
 namespace opengl
@@ -29,24 +32,37 @@ namespace opengl
 			{
 				if (action == GLFW_PRESS)
 				{
-					glfwSetInputMode(w->windowPtr, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+					w->captureCursor(false);
 					info->firstEnter = true;
 				}
 				if (action == GLFW_RELEASE)
-					glfwSetInputMode(w->windowPtr, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+					w->captureCursor(true);
+				break;
+			}
+			case GLFW_KEY_F2:
+			{
+				if (action == GLFW_PRESS)
+					info->path = (renderPath)((info->path + 1) % (CLUSTERED_RENDER + 1));
+				break;
+			}
+			case GLFW_KEY_F12:
+			{
+				if (action == GLFW_PRESS)
+					w->capture("capture_" + to_string((long long)(glfwGetTime() * 1000.0)) + ".png");
+				break;
 			}
 		}
 	}
 	void window::defaultMovement(window* w)
 	{
 		defaultWindowInfo *info = (defaultWindowInfo*)w->params;
-		if (glfwGetKey(w->windowPtr, GLFW_KEY_W))
+		if (w->keyDown(GLFW_KEY_W))
 			info->defaultCamera->move(FRONT, info->frameDelta);
-		if (glfwGetKey(w->windowPtr, GLFW_KEY_S))
+		if (w->keyDown(GLFW_KEY_S))
 			info->defaultCamera->move(BACK, info->frameDelta);
-		if (glfwGetKey(w->windowPtr, GLFW_KEY_A))
+		if (w->keyDown(GLFW_KEY_A))
 			info->defaultCamera->move(LEFT, info->frameDelta);
-		if (glfwGetKey(w->windowPtr, GLFW_KEY_D))
+		if (w->keyDown(GLFW_KEY_D))
 			info->defaultCamera->move(RIGHT, info->frameDelta);
 	}
 	void window::defaultScroll(window* w, double xOffset, double yOffset)
@@ -67,78 +83,213 @@ namespace opengl
 		info->lastX = xPos;
 		info->lastY = yPos;
 	}
+	// The context belongs to the render thread, so resizing waits for it too
 	void window::frameBufferCallback(GLFWwindow *window, int width, int height)
 	{
-		try
+		postEvent(window, {RESIZE_INPUT, 0, 0, 0, 0, (double)width, (double)height, 0.0});
+	}
+	void window::globalKeyboardCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
+	{
+		postEvent(window, {KEY_INPUT, key, scancode, action, mods, 0.0, 0.0, 0.0});
+	}
+	void window::globalScrollCallback(GLFWwindow *window, double xOffset, double yOffset)
+	{
+		postEvent(window, {SCROLL_INPUT, 0, 0, 0, 0, xOffset, yOffset, 0.0});
+	}
+	void window::globalMouseCallback(GLFWwindow *window, double xPos, double yPos)
+	{
+		postEvent(window, {MOUSE_INPUT, 0, 0, 0, 0, xPos, yPos, 0.0});
+	}
+	// Runs inside glfwPollEvents, the main thread is the only producer
+	void window::postEvent(GLFWwindow *window, inputEvent &&event)
+	{
+		auto target = (opengl::window*)glfwGetWindowUserPointer(window);
+		if (target == NULL)
+			return;
+		event.time = glfwGetTime();
+		target->flushEvents();
+		if (target->spilled.empty() && target->events.push(event))
+			return;
+		auto &spilled = target->spilled;
+		if (!spilled.empty() && spilled.back().kind == event.kind && (event.kind == SCROLL_INPUT || event.kind == MOUSE_INPUT))
 		{
-			glfwMakeContextCurrent(window);
-			glViewport(0, 0, width, height);
-			abstractWindowInfo *tempPtr = existingWindow.at(window)->params;
-			tempPtr->width = width;
-			tempPtr->height = height;
+			if (event.kind == SCROLL_INPUT)
+			{
+				event.x += spilled.back().x;
+				event.y += spilled.back().y;
+			}
+			spilled.back() = event;
+			return;
 		}
-		catch (std::out_of_range &e)
-		{}
+		spilled.push_back(event);
 	}
-	void window::globalKeyboardCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
+	void window::flushEvents()
 	{
-		try
+		while (!spilled.empty() && events.push(spilled.front()))
 		{
-			existingWindow.at(window)->runKeyboard(key, scancode, action, mods);
+			spilled.pop_front();
 		}
-		catch (std::out_of_range &e)
-		{}
 	}
-	void window::globalScrollCallback(GLFWwindow *window, double xOffset, double yOffset)
+	void window::dispatchEvents()
 	{
-		try
+		// Runs of motion fold into their last position and runs of scrolling
+		// into one offset, keys keep their order relative to both
+		inputEvent event = {}, pending = {};
+		bool held = false;
+		while (events.pop(event))
 		{
-			existingWindow.at(window)->runScroll(xOffset, yOffset);
+			if (held && event.kind == pending.kind && event.kind != KEY_INPUT)
+			{
+				if (event.kind == SCROLL_INPUT)
+				{
+					pending.x += event.x;
+					pending.y += event.y;
+				}
+				else
+				{
+					pending.x = event.x;
+					pending.y = event.y;
+				}
+				pending.time = event.time;
+				continue;
+			}
+			if (held)
+				handleEvent(pending);
+			pending = event;
+			held = true;
 		}
-		catch (std::out_of_range &e)
-		{}
+		if (held)
+			handleEvent(pending);
 	}
-	void window::globalMouseCallback(GLFWwindow *window, double xPos, double yPos)
+	void window::handleEvent(const inputEvent &event)
 	{
-		try
+		eventTime = event.time;
+		switch (event.kind)
 		{
-			existingWindow.at(window)->runMouse(xPos, yPos);
+			case KEY_INPUT:
+			{
+				if (event.key >= 0 && event.key <= GLFW_KEY_LAST)
+					keys[event.key] = event.action != GLFW_RELEASE;
+				runKeyboard(event.key, event.scancode, event.action, event.mods);
+				break;
+			}
+			case SCROLL_INPUT:
+			{
+				runScroll(event.x, event.y);
+				break;
+			}
+			case MOUSE_INPUT:
+			{
+				runMouse(event.x, event.y);
+				break;
+			}
+			case RESIZE_INPUT:
+			{
+				glViewport(0, 0, event.x, event.y);
+				params->width = event.x;
+				params->height = event.y;
+				break;
+			}
 		}
-		catch (std::out_of_range &e)
-		{}
+	}
+	bool window::keyDown(int key) const
+	{
+		return key >= 0 && key <= GLFW_KEY_LAST && keys[key];
+	}
+	double window::getEventTime() const
+	{
+		return eventTime;
+	}
+	void window::captureCursor(bool capture)
+	{
+		GLFWwindow *target = windowPtr;
+		bool raw = params->rawMouseMotion;
+		onMainThread([target, capture, raw]() {
+			glfwSetInputMode(target, GLFW_CURSOR, capture ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
+			// Raw motion only ever applies to a disabled cursor
+			if (glfwRawMouseMotionSupported())
+				glfwSetInputMode(target, GLFW_RAW_MOUSE_MOTION, capture && raw ? GLFW_TRUE : GLFW_FALSE);
+		});
+	}
+	// Once every definition is in, on the GL thread
+	static void sceneFinished(window::defaultWindowInfo *info)
+	{
+		cout << "Scene loaded in " << (glfwGetTime() - info->loadStart) * 1000.0 << " ms, peak memory " << peakMemory() / 1048576 << " MiB" << endl;
+		cout << meshOptimizer::report() << endl;
+		if (info->packTextures)
+			cout << info->renderArray->packTextures() << endl;
+		info->sceneLoaded = true;
 	}
 	void window::defaultPreRenderCallback(window *currentWindow)
 	{
 		try
 		{
 			defaultWindowInfo *info = (defaultWindowInfo*)currentWindow->params;
-			info->renderArray = new objectArray(info->jsonFileName);
+			info->loadStart = glfwGetTime();
+			if (info->asyncLoad)
+			{
+				// Usages are read here so callers can set their callbacks after init
+				info->renderArray = new objectArray();
+				info->renderArray->prepare(info->jsonFileName);
+				objectArray *target = info->renderArray;
+				bool pack = info->packTextures;
+				currentWindow->runLoader([target, pack]() {
+					target->load(pack);
+				});
+			}
+			else
+			{
+				info->renderArray = new objectArray(info->jsonFileName);
+				sceneFinished(info);
+			}
 			info->defaultCamera = new camera({0.0, 0.0, 0.0});
 		}
 		catch (json::parse_error &e)
 		{
 			throw error("Object reading failed.", e.what());
 		}
-		glfwSetInputMode(currentWindow->windowPtr, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		currentWindow->captureCursor(true);
 	}
 	void window::defaultRenderCallback(window *currentWindow)
 	{
 		defaultWindowInfo *info = (defaultWindowInfo*)currentWindow->params;
 		currentWindow->preRenderLoop();
-		for (auto &object : info->renderArray->getDefination())
+		// Definitions finished by the loader appear between frames
+		if (!info->sceneLoaded && info->renderArray->swapIn())
+			sceneFinished(info);
+		// Set on the variants that draw, not the base programs
+		info->renderArray->uniforms = info->uniform;
+		defaultMovement(currentWindow);
+		if (info->path == DEFERRED_RENDER)
 		{
-			shaderProgram &temp = object.second[0].getShaderProgram();
-			for (auto &uniformPair : info->uniform)
-			{
-				temp[uniformPair.first] = uniformPair.second;
-			}
+			if (currentWindow->deferred == NULL)
+				currentWindow->deferred = new deferredRenderer();
+			currentWindow->deferred->render(*info->renderArray,
+											info->defaultCamera->getLookAt(),
+											info->defaultCamera->getPerspective(info->width / info->height),
+											info->defaultCamera->getPosition(),
+											info->defaultCamera->getFacing(),
+											info);
+		}
+		else if (info->path == CLUSTERED_RENDER)
+		{
+			if (currentWindow->clustered == NULL)
+				currentWindow->clustered = new clusteredRenderer();
+			currentWindow->clustered->render(*info->renderArray,
+											 info->defaultCamera->getLookAt(),
+											 info->defaultCamera->getPerspective(info->width / info->height),
+											 info->defaultCamera->getPosition(),
+											 info->defaultCamera->getFacing(),
+											 info);
+		}
+		else
+		{
+			info->renderArray->draw(info->defaultCamera->getLookAt(),
+									info->defaultCamera->getPerspective(info->width / info->height),
+									info->defaultCamera->getPosition(),
+									info->defaultCamera->getFacing(),
+									info);
 		}
-		defaultMovement(currentWindow);
-		info->renderArray->draw(info->defaultCamera->getLookAt(),
-								info->defaultCamera->getPerspective(info->width / info->height),
-								info->defaultCamera->getPosition(),
-								info->defaultCamera->getFacing(),
-								info);
 		currentWindow->postRenderLoop();
 	}
 	window::window(
@@ -147,23 +298,39 @@ namespace opengl
 		const char *jsonName,
 		vector<float> backgroundColor
 	):
+	windowThread(NULL),
+	running(false),
+	detached(false),
+	eventTime(0.0),
+	loaderContext(NULL),
+	loaderThread(NULL),
 	model(model),
 	preRenderCallback(defaultPreRenderCallback),
 	renderCallback(defaultRenderCallback),
 	counterInitialized(false),
 	frameRate(0.0),
+	capturer(new frameCapture()),
+	sceneTarget(new renderTarget()),
+	scaler(new resolutionScaler()),
+	deferred(NULL),
+	clustered(NULL),
 	params(new defaultWindowInfo(title, jsonName, width, height, backgroundColor))
 	{
+		lock_guard<mutex> lock(windowLock);
 		// Init GLFW
 		if (!initialized)
 		{
 			glfwInit();
 			glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 			glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+			// Every context is made alike so they can share objects
+			glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+			mainThread = this_thread::get_id();
 			initialized = true;
 		}
-		// Create window
-		windowPtr = glfwCreateWindow(params->width, params->height, params->title, NULL, NULL);
+		// Create window, textures and programs are shared by name with the others
+		GLFWwindow *share = existingWindow.empty() ? NULL : existingWindow.begin()->first;
+		windowPtr = glfwCreateWindow(params->width, params->height, params->title, NULL, share);
 		if (windowPtr == NULL)
 		{
 			const char *desp;
@@ -171,7 +338,6 @@ namespace opengl
 			throw error("Window create failed.", desp);
 		}
 		glfwMakeContextCurrent(windowPtr);
-		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
 		{
 			const char *desp;
@@ -179,8 +345,10 @@ namespace opengl
 			glfwTerminate();
 			throw error("GLAD loader init failed.", desp);
 		}
+		glSetLoader((GLADloadproc)glfwGetProcAddress);
 		glViewport(0, 0, params->width, params->height);
-		// Set callback
+		// Set callback, they find this window through the user pointer
+		glfwSetWindowUserPointer(windowPtr, this);
 		glfwSetFramebufferSizeCallback(windowPtr, frameBufferCallback);
 		glfwSetCursorPosCallback(windowPtr, globalMouseCallback);
 		glfwSetScrollCallback(windowPtr, globalScrollCallback);
@@ -191,7 +359,29 @@ namespace opengl
 	}
 	window::~window()
 	{
+		if (windowThread != NULL)
+		{
+			glfwSetWindowShouldClose(windowPtr, true);
+			windowThread->join();
+			delete windowThread;
+		}
+		if (loaderThread != NULL)
+		{
+			loaderThread->join();
+			delete loaderThread;
+		}
+		if (loaderContext != NULL)
+			glfwDestroyWindow(loaderContext);
+		glfwMakeContextCurrent(windowPtr);
+		delete capturer;
+		delete sceneTarget;
+		delete scaler;
+		delete deferred;
+		delete clustered;
+		glfwMakeContextCurrent(NULL);
 		glfwSetWindowShouldClose(windowPtr, true);
+		glfwSetWindowUserPointer(windowPtr, NULL);
+		lock_guard<mutex> lock(windowLock);
 		existingWindow.erase(windowPtr);
 		if (existingWindow.empty())
 		{
@@ -213,10 +403,33 @@ namespace opengl
 		lastFrame = curTime;
 	}
 
+	float window::getResolutionScale() const
+	{
+		return params->enableDynamicResolution ? scaler->getScale() : 1.0f;
+	}
+
 	void window::preRenderLoop()
 	{
 		glfwSwapBuffers(windowPtr);
-		glfwPollEvents();
+		if (!detached)
+		{
+			glfwPollEvents();
+			flushEvents();
+			runMainTasks();
+		}
+		dispatchEvents();
+		if (params->enableDynamicResolution)
+		{
+			scaler->minScale = params->minResolutionScale;
+			scaler->maxScale = params->maxResolutionScale;
+			scaler->budget = params->gpuFrameBudget;
+			scaler->beginFrame();
+
+			float scale = scaler->getScale();
+			sceneTarget->reserve(params->width * params->maxResolutionScale, params->height * params->maxResolutionScale);
+			sceneTarget->resize(params->width * scale, params->height * scale);
+			sceneTarget->bind();
+		}
 		glClearColor(params->backgroundColor[0], params->backgroundColor[1], params->backgroundColor[2], params->backgroundColor[3]);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -241,22 +454,46 @@ namespace opengl
 	}
 	void window::postRenderLoop()
 	{
+		if (params->enableDynamicResolution)
+		{
+			scaler->endFrame();
+			sceneTarget->blitToDefault(params->width, params->height);
+		}
+		// Back buffer is complete here, read it before the next swap
+		capturer->process(params->width, params->height);
 		glFlush();
 	}
 
 	void window::init()
 	{
 		glfwMakeContextCurrent(windowPtr);
+		shaderProgram::resetBinding();
 		preRenderCallback(this);
 		glfwMakeContextCurrent(NULL);
 	}
 	void window::start()
 	{
 		glfwMakeContextCurrent(windowPtr);
+		shaderProgram::resetBinding();
+		// Programs build on first use, the first frame shows the shader startup cost
+		double startTime = glfwGetTime();
+		bool firstFrame = true;
 		while(!glfwWindowShouldClose(windowPtr))
 		{
 			renderCallback(this);
 			glErrorAssert();
+			if (firstFrame)
+			{
+				cout << "First frame in " << (glfwGetTime() - startTime) * 1000.0 << " ms. " << programCache::report() << endl;
+				cout << shaderProgram::report() << endl;
+				cout << texture::cacheReport() << endl;
+				cout << texture::memoryReport() << endl;
+				firstFrame = false;
+			}
+			// Between frames, nothing is bound for drawing
+			if (params->shaderHotReload)
+				shaderProgram::reloadChanged();
+			texture::processUploads();
 			frameCounter();
 			const char *ptr;
 			if (glfwGetError(&ptr) != GLFW_NO_ERROR)
@@ -267,7 +504,112 @@ namespace opengl
 		glfwMakeContextCurrent(NULL);
 	}
 	void window::startDetach()
-	{}
+	{
+		if (windowThread != NULL)
+			return;
+		detached = true;
+		running = true;
+		windowThread = new thread([this]() {
+			try
+			{
+				start();
+			}
+			catch (...)
+			{
+				failure = current_exception();
+				glfwMakeContextCurrent(NULL);
+			}
+			running = false;
+			// Wakes runDetached to notice
+			glfwPostEmptyEvent();
+		});
+	}
+	void window::runDetached()
+	{
+		while (true)
+		{
+			bool anyRunning = false;
+			{
+				lock_guard<mutex> lock(windowLock);
+				for (auto &entry : existingWindow)
+				{
+					anyRunning |= entry.second->running;
+					entry.second->flushEvents();
+				}
+			}
+			runMainTasks();
+			if (!anyRunning)
+				break;
+			glfwWaitEventsTimeout(0.01);
+		}
+		vector<window*> windows;
+		{
+			lock_guard<mutex> lock(windowLock);
+			for (auto &entry : existingWindow)
+			{
+				windows.push_back(entry.second);
+			}
+		}
+		exception_ptr first;
+		for (auto w : windows)
+		{
+			if (w->windowThread == NULL)
+				continue;
+			w->windowThread->join();
+			delete w->windowThread;
+			w->windowThread = NULL;
+			w->detached = false;
+			if (w->failure && !first)
+				first = w->failure;
+		}
+		if (first)
+			rethrow_exception(first);
+	}
+	void window::onMainThread(function<void ()> task)
+	{
+		if (this_thread::get_id() == mainThread)
+		{
+			task();
+			return;
+		}
+		lock_guard<mutex> lock(taskLock);
+		mainTasks.push_back(task);
+	}
+	void window::runMainTasks()
+	{
+		deque<function<void ()>> pending;
+		{
+			lock_guard<mutex> lock(taskLock);
+			pending.swap(mainTasks);
+		}
+		for (auto &task : pending)
+		{
+			task();
+		}
+	}
+
+	void window::runLoader(function<void ()> job)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		loaderContext = glfwCreateWindow(1, 1, "", NULL, windowPtr);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		if (loaderContext == NULL)
+		{
+			job();
+			return;
+		}
+		loaderThread = new thread([this, job]() {
+			glfwMakeContextCurrent(loaderContext);
+			// Element buffer binds need a vertex array on core profiles, this one is never drawn
+			GLuint vertexArray;
+			glGenVertexArrays(1, &vertexArray);
+			glBindVertexArray(vertexArray);
+			job();
+			glBindVertexArray(0);
+			glDeleteVertexArrays(1, &vertexArray);
+			glfwMakeContextCurrent(NULL);
+		});
+	}
 
 	void window::setPreRender(render preCallback)
 	{
@@ -278,6 +620,15 @@ namespace opengl
 		renderCallback = callback;
 	}
 
+	void window::capture(const string &filename)
+	{
+		capturer->request(filename);
+	}
+
 	bool window::initialized = false;
 	map<GLFWwindow*, window*> window::existingWindow = map<GLFWwindow*, window*>();
+	mutex window::windowLock;
+	thread::id window::mainThread;
+	deque<function<void ()>> window::mainTasks;
+	mutex window::taskLock;
 }
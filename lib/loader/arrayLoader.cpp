@@ -1,31 +1,121 @@
 #include "loader/arrayLoader.hpp"
 #include "loader/modelLoader.hpp"
+#include "loader/texturePacker.hpp"
+#include "loader/geometryParser.hpp"
+#include "loader/mappedFile.hpp"
+#include "threadPool.hpp"
 
 #include <iostream>
+#include <sstream>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <cstddef>
+
+#include "glm/gtc/packing.hpp"
+
+// Array samplers of drawGeometry count up from here, plain ones from unit 0,
+// so samplers of different types never share a unit
+#define TEXTURE_ARRAY_UNIT 6
+
 namespace opengl
 {
+	static_assert(TEXTURE_ARRAY_UNIT * 2 <= OBJECT_TEXTURE_UNITS, "Array samplers must stay below the renderer units.");
+
 	// baseArray
 	template <typename T>
 	baseArray<T>::baseArray(const vector<T> &data):
-	data(data){}
+	data(data), view(NULL), viewLength(0), releasedLength(0), released(false){}
+	template <typename T>
+	baseArray<T>::baseArray(vector<T> &&data):
+	data(move(data)), view(NULL), viewLength(0), releasedLength(0), released(false){}
+	template <typename T>
+	baseArray<T>::baseArray(const T *view, size_t length, shared_ptr<const void> owner):
+	view(view), viewLength(length), viewOwner(owner), releasedLength(0), released(false){}
 
 	template <typename T>
-	const T* baseArray<T>::getData()
+	void baseArray<T>::release()
 	{
-		return data.data();
+		releasedLength = getLength();
+		released = true;
+		vector<T>().swap(data);
+		view = NULL;
+		viewLength = 0;
+		viewOwner.reset();
+	}
+
+	template <typename T>
+	void baseArray<T>::adoptBuffer(json &arrayFile)
+	{
+		if (!(arrayFile.is_object() && arrayFile.contains("value") && arrayFile["value"].is_binary()))
+			return;
+		auto bytes = make_shared<vector<uint8_t>>(move(static_cast<vector<uint8_t>&>(arrayFile["value"].get_binary())));
+		if (bytes->size() % sizeof(T) != 0)
+			throw error("Value incomplete.");
+		view = (const T*)bytes->data();
+		viewLength = bytes->size() / sizeof(T);
+		viewOwner = bytes;
+	}
+
+	template <typename T>
+	bool baseArray<T>::loadBuffer(const json &value)
+	{
+		// Already taken over by adoptBuffer
+		if (view != NULL)
+			return true;
+		if (value.is_binary() || (value.is_string() && value.get_ref<const string&>().compare(0, 5, "data:") == 0))
+		{
+			vector<unsigned char> decoded;
+			const unsigned char *bytes;
+			size_t size;
+			if (value.is_binary())
+			{
+				bytes = value.get_binary().data();
+				size = value.get_binary().size();
+			}
+			else
+			{
+				decoded = geometryParser::decodeBase64(value.get_ref<const string&>());
+				bytes = decoded.data();
+				size = decoded.size();
+			}
+			if (size % sizeof(T) != 0)
+				throw error("Value incomplete.");
+			data.resize(size / sizeof(T));
+			memcpy(data.data(), bytes, size);
+			return true;
+		}
+		if (!value.is_string())
+			return false;
+		// Uploaded straight from the mapping
+		const string &path = value.get_ref<const string&>();
+		auto mapping = make_shared<mappedFile>(path);
+		if (mapping->size() % sizeof(T) != 0)
+			throw error("Value incomplete.", path);
+		view = (const T*)mapping->data();
+		viewLength = mapping->size() / sizeof(T);
+		viewOwner = mapping;
+		return true;
+	}
+
+	template <typename T>
+	const T* baseArray<T>::getData() const
+	{
+		return view != NULL ? view : data.data();
 	}
 	template <typename T>
 	GLuint baseArray<T>::getLength() const
 	{
-		return data.size();
+		if (released)
+			return releasedLength;
+		return view != NULL ? viewLength : data.size();
 	}
 	template <typename T>
 	GLuint baseArray<T>::getSize() const
 	{
-		return data.size() * sizeof(T);
+		return getLength() * sizeof(T);
 	}
 
 	template class baseArray<GLfloat>;
@@ -33,22 +123,30 @@ namespace opengl
 
 	// vertexArray
 	vertexArray::vertexArray(const string &filename):
-	verticeCount(0), lengthPerCount(0)
+	stride(0), verticeCount(0), quantized(false), positionOffset(0.0f), positionScale(1.0f)
 	{
 		ifstream file(filename);
-		json jsonFile = json::parse(file);
+		json jsonFile = geometryParser::parse(file, "vertex");
 		file.close();
+		adoptBuffer(jsonFile);
 		loadData(jsonFile);
 	}
 	vertexArray::vertexArray(ifstream &arrayFile):
-	verticeCount(0), lengthPerCount(0)
+	stride(0), verticeCount(0), quantized(false), positionOffset(0.0f), positionScale(1.0f)
 	{
-		json jsonFile = json::parse(arrayFile);
+		json jsonFile = geometryParser::parse(arrayFile, "vertex");
+		adoptBuffer(jsonFile);
 		loadData(jsonFile);
 	}
 	vertexArray::vertexArray(const json &arrayFile):
-	verticeCount(0), lengthPerCount(0)
+	stride(0), verticeCount(0), quantized(false), positionOffset(0.0f), positionScale(1.0f)
+	{
+		loadData(arrayFile);
+	}
+	vertexArray::vertexArray(json &&arrayFile):
+	stride(0), verticeCount(0), quantized(false), positionOffset(0.0f), positionScale(1.0f)
 	{
+		adoptBuffer(arrayFile);
 		loadData(arrayFile);
 	}
 
@@ -58,15 +156,77 @@ namespace opengl
 		glBindBuffer(GL_ARRAY_BUFFER, bufferObject);
 		const GLfloat *tempData = this->getData();
 		glBufferData(GL_ARRAY_BUFFER, this->getSize(), tempData, usage);
+
+		ranges.assign(layout.size(), make_pair(numeric_limits<GLfloat>::max(), numeric_limits<GLfloat>::lowest()));
+		const unsigned char *bytes = (const unsigned char*)tempData;
+		for (size_t base = 0; base + stride <= getSize(); base += stride)
+		{
+			for (GLuint index = 0; index < layout.size(); index++)
+			{
+				for (GLuint i = 0; i < layout[index].size; i++)
+				{
+					GLfloat value = readComponent(bytes + base, layout[index], i);
+					ranges[index].first = min(ranges[index].first, value);
+					ranges[index].second = max(ranges[index].second, value);
+				}
+			}
+		}
 	}
 	void vertexArray::setVertexPointer(GLenum normalize) const
 	{
-		GLuint offset = 0;
-		for (GLuint index = 0; index < depth.size(); index++)
+		for (GLuint index = 0; index < layout.size(); index++)
 		{
-			glVertexAttribPointer(index, depth[index], GL_FLOAT, normalize, lengthPerCount * sizeof(GLfloat), (void*)(offset * sizeof(GLfloat)));
+			const vertexAttribute &attribute = layout[index];
+			// Float attributes follow the caller, integer ones carry their own
+			GLboolean normalized = attribute.type == GL_FLOAT ? normalize : attribute.normalized;
+			glVertexAttribPointer(index, attribute.size, attribute.type, normalized, stride, (void*)(size_t)attribute.offset);
 			glEnableVertexAttribArray(index);
-			offset += depth[index];
+		}
+	}
+
+	void vertexArray::floatLayout(const vector<GLuint> &depth)
+	{
+		layout.clear();
+		GLuint offset = 0;
+		for (auto len : depth)
+		{
+			layout.push_back({len, GL_FLOAT, GL_FALSE, offset});
+			offset += len * sizeof(GLfloat);
+		}
+		stride = offset;
+		verticeCount = stride != 0 ? getSize() / stride : 0;
+	}
+	GLfloat vertexArray::readComponent(const unsigned char *vertex, const vertexAttribute &attribute, GLuint i)
+	{
+		const unsigned char *source = vertex + attribute.offset;
+		switch (attribute.type)
+		{
+		case GL_FLOAT:
+		{
+			GLfloat value;
+			memcpy(&value, source + i * sizeof(value), sizeof(value));
+			return value;
+		}
+		case GL_HALF_FLOAT:
+		{
+			GLushort value;
+			memcpy(&value, source + i * sizeof(value), sizeof(value));
+			return glm::unpackHalf1x16(value);
+		}
+		case GL_UNSIGNED_SHORT:
+		{
+			GLushort value;
+			memcpy(&value, source + i * sizeof(value), sizeof(value));
+			return attribute.normalized ? value / 65535.0f : value;
+		}
+		case GL_SHORT:
+		{
+			GLshort value;
+			memcpy(&value, source + i * sizeof(value), sizeof(value));
+			return attribute.normalized ? max(value / 32767.0f, -1.0f) : value;
+		}
+		default:
+			throw error("Vertex attribute type error.");
 		}
 	}
 
@@ -74,53 +234,102 @@ namespace opengl
 	{
 		if (!(arrayFile.is_object() && arrayFile.contains("value") && arrayFile.contains("structure")))
 			throw error("JSON format error.");
-		if (!arrayFile["value"][0].is_number_float())
-			throw error("Value type error.");
-
-		data = arrayFile["value"].get<vector<GLfloat>>();
-		depth = arrayFile["structure"].get<vector<GLuint>>();
-
-		for (auto i : depth)
+		const json &value = arrayFile["value"];
+		if (!loadBuffer(value))
 		{
-			lengthPerCount += i;
+			if (!value[0].is_number_float())
+				throw error("Value type error.");
+			data = value.get<vector<GLfloat>>();
 		}
+		floatLayout(arrayFile["structure"].get<vector<GLuint>>());
 
-		if (data.size() % lengthPerCount != 0)
+		if (stride == 0 || getSize() % stride != 0)
 			throw error("Value incomplete.");
 
-		verticeCount = data.size() / lengthPerCount;
-
 	}
 
 	void vertexArray::bindBuffer() const
 	{
 		glBindBuffer(GL_ARRAY_BUFFER, bufferObject);
 	}
+	bool vertexArray::attributeInRange(GLuint index, GLfloat low, GLfloat high) const
+	{
+		if (index >= layout.size())
+			return false;
+		if (!ranges.empty())
+			return ranges[index].first >= low && ranges[index].second <= high;
+		const unsigned char *bytes = (const unsigned char*)getData();
+		for (size_t base = 0; base + stride <= getSize(); base += stride)
+		{
+			for (GLuint i = 0; i < layout[index].size; i++)
+			{
+				GLfloat value = readComponent(bytes + base, layout[index], i);
+				if (value < low || value > high)
+					return false;
+			}
+		}
+		return true;
+	}
+	bool vertexArray::isQuantized() const
+	{
+		return quantized;
+	}
+	const glm::vec3& vertexArray::getPositionOffset() const
+	{
+		return positionOffset;
+	}
+	const glm::vec3& vertexArray::getPositionScale() const
+	{
+		return positionScale;
+	}
 
 	// indiceArray
-	indiceArray::indiceArray(const string &filename)
+	indiceArray::indiceArray(const string &filename):
+	indexType(GL_UNSIGNED_INT)
 	{
 		ifstream file(filename);
-		json jsonFile = json::parse(file);
+		json jsonFile = geometryParser::parse(file, "indice");
 		file.close();
+		adoptBuffer(jsonFile);
 		loadData(jsonFile);
 	}
-	indiceArray::indiceArray(ifstream &arrayFile)
+	indiceArray::indiceArray(ifstream &arrayFile):
+	indexType(GL_UNSIGNED_INT)
 	{
-		json jsonFile = json::parse(arrayFile);
+		json jsonFile = geometryParser::parse(arrayFile, "indice");
+		adoptBuffer(jsonFile);
 		loadData(jsonFile);
 	}
-	indiceArray::indiceArray(const json &arrayFile)
+	indiceArray::indiceArray(const json &arrayFile):
+	indexType(GL_UNSIGNED_INT)
 	{
 		loadData(arrayFile);
 	}
+	indiceArray::indiceArray(json &&arrayFile):
+	indexType(GL_UNSIGNED_INT)
+	{
+		adoptBuffer(arrayFile);
+		loadData(arrayFile);
+	}
 
 	void indiceArray::genBuffer(GLenum usage)
 	{
 		glGenBuffers(1, &bufferObject);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObject);
 		const GLuint *tempData = this->getData();
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->getSize(), tempData, usage);
+		GLuint length = this->getLength();
+		// Meshes under 65536 vertices go up as 16 bit indices, half the memory and bandwidth
+		if (length != 0 && *max_element(tempData, tempData + length) <= numeric_limits<GLushort>::max())
+		{
+			vector<GLushort> narrow(tempData, tempData + length);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, narrow.size() * sizeof(GLushort), narrow.data(), usage);
+			indexType = GL_UNSIGNED_SHORT;
+		}
+		else
+		{
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->getSize(), tempData, usage);
+			indexType = GL_UNSIGNED_INT;
+		}
 	}
 	void indiceArray::setVertexPointer(GLenum normalize) const
 	{
@@ -131,10 +340,13 @@ namespace opengl
 	{
 		if (!(arrayFile.is_object() && arrayFile.contains("value") && arrayFile.contains("primitive")))
 			throw error("JSON format error.");
-		if (!arrayFile["value"][0].is_number_unsigned())
-			throw error("Value type error.");
-
-		data = arrayFile["value"].get<vector<GLuint>>();
+		const json &value = arrayFile["value"];
+		if (!loadBuffer(value))
+		{
+			if (!value[0].is_number_unsigned())
+				throw error("Value type error.");
+			data = value.get<vector<GLuint>>();
+		}
 
 		string primitiveStr = arrayFile["primitive"];
 
@@ -151,6 +363,10 @@ namespace opengl
 	{
 		return primitive;
 	}
+	GLenum indiceArray::getIndexType() const
+	{
+		return indexType;
+	}
 
 	// singleObject
 	singleObject::singleObject()
@@ -158,16 +374,21 @@ namespace opengl
 	singleObject::singleObject(const string &filename)
 	{
 		ifstream file(filename);
-		json jsonFile = json::parse(file);
+		json jsonFile = geometryParser::parse(file);
 		file.close();
 		genObject(jsonFile);
 	}
 	singleObject::singleObject(ifstream &file)
 	{
-		json jsonFile = json::parse(file);
+		json jsonFile = geometryParser::parse(file);
 		genObject(jsonFile);
 	}
 	singleObject::singleObject(const json &jsonObject)
+	{
+		json copy = jsonObject;
+		genObject(copy);
+	}
+	singleObject::singleObject(json &&jsonObject)
 	{
 		genObject(jsonObject);
 	}
@@ -189,13 +410,26 @@ namespace opengl
 
 	void singleObject::genObjectBuffer(GLenum usage/* = GL_STATIC_DRAW*/, GLenum normalize/* = GL_FALSE*/)
 	{
-		// Gen VAO
-		glGenVertexArrays(1, &arrayObject);
-		glBindVertexArray(arrayObject);
+		genBuffers(usage);
+		genVertexArray(normalize);
+	}
+	void singleObject::genBuffers(GLenum usage/* = GL_STATIC_DRAW*/)
+	{
 		// Gen VBO
 		vArray->genBuffer(usage);
 		// Gen EBO
 		iArray->genBuffer(usage);
+		// The buffers hold the data now
+		vArray->release();
+		iArray->release();
+	}
+	void singleObject::genVertexArray(GLenum normalize/* = GL_FALSE*/)
+	{
+		// Gen VAO
+		glGenVertexArrays(1, &arrayObject);
+		glBindVertexArray(arrayObject);
+		vArray->bindBuffer();
+		iArray->bindBuffer();
 		// Set VP
 		vArray->setVertexPointer(normalize);
 		glBindVertexArray(0);
@@ -204,15 +438,33 @@ namespace opengl
 	void singleObject::draw() const
 	{
 		glBindVertexArray(arrayObject);
-		glDrawElements(iArray->getPrimitive(), iArray->getLength(), GL_UNSIGNED_INT, 0);
+		glDrawElements(iArray->getPrimitive(), iArray->getLength(), iArray->getIndexType(), 0);
 	}
 
-	void singleObject::genObject(const json &jsonObject)
+	size_t singleObject::draw(const glm::mat4 &transform, const glm::vec3 &eye, bool cones) const
+	{
+		if (!culler)
+		{
+			draw();
+			return 0;
+		}
+		thread_local vector<GLsizei> counts;
+		thread_local vector<const void*> offsets;
+		GLuint indexBytes = iArray->getIndexType() == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		size_t kept = culler->cull(transform, eye, cones, indexBytes, counts, offsets);
+		if (counts.empty())
+			return 0;
+		glBindVertexArray(arrayObject);
+		glMultiDrawElements(iArray->getPrimitive(), counts.data(), iArray->getIndexType(), offsets.data(), counts.size());
+		return kept;
+	}
+
+	void singleObject::genObject(json &jsonObject)
 	{
 		if (!(jsonObject.is_object() && jsonObject.contains("vertex") && jsonObject.contains("indice") && jsonObject.contains("shader")))
 			throw error("JSON format error.");
-		vArray = new vertexArray(jsonObject["vertex"]);
-		iArray = new indiceArray(jsonObject["indice"]);
+		vArray = new vertexArray(move(jsonObject["vertex"]));
+		iArray = new indiceArray(move(jsonObject["indice"]));
 		sProgram = new shaderProgram(jsonObject["shader"]);
 		textureList = new map<string, texture>();
 
@@ -235,7 +487,8 @@ namespace opengl
 	}
 
 	// objectArray
-	objectArray::objectArray(const char *filename, bool gen/* = true*/)
+	objectArray::objectArray(const char *filename, bool gen/* = true*/):
+	meshletsDrawn(0), meshletsTested(0), loadDone(true), flashlight(true), meshletCulling(true)
 	{
 		// This function encounters problems, probably because of a relative path
 		// Judge file type
@@ -244,12 +497,13 @@ namespace opengl
 		if (postfix.compare("json") == 0)
 		{
 			ifstream file(filename);
-			json jsonFile = json::parse(file);
+			json jsonFile = geometryParser::parse(file);
 			file.close();
 			genArray(jsonFile, gen);
 		}
 	}
-	objectArray::objectArray(const string &filename, bool gen/* = true*/)
+	objectArray::objectArray(const string &filename, bool gen/* = true*/):
+	meshletsDrawn(0), meshletsTested(0), loadDone(true), flashlight(true), meshletCulling(true)
 	{
 		// Judge file type
 		string fn = filename;
@@ -257,72 +511,115 @@ namespace opengl
 		if (postfix.compare("json") == 0)
 		{
 			ifstream file(filename);
-			json jsonFile = json::parse(file);
+			json jsonFile = geometryParser::parse(file);
 			file.close();
 			genArray(jsonFile, gen);
 		}
 	}
-	objectArray::objectArray(ifstream &file, bool gen/* = true*/)
+	objectArray::objectArray(ifstream &file, bool gen/* = true*/):
+	meshletsDrawn(0), meshletsTested(0), loadDone(true), flashlight(true), meshletCulling(true)
 	{
-		json jsonFile = json::parse(file);
+		json jsonFile = geometryParser::parse(file);
 		genArray(jsonFile, gen);
 	}
-	objectArray::objectArray(const json &jsonObject, bool gen/* = true*/)
+	objectArray::objectArray(const json &jsonObject, bool gen/* = true*/):
+	meshletsDrawn(0), meshletsTested(0), loadDone(true), flashlight(true), meshletCulling(true)
 	{
-		genArray(jsonObject, gen);
+		json copy = jsonObject;
+		genArray(copy, gen);
 	}
+	objectArray::objectArray():
+	meshletsDrawn(0), meshletsTested(0), loadDone(true), flashlight(true), meshletCulling(true)
+	{}
 	objectArray::~objectArray()
 	{
-		for (auto i : defination)
+		auto destroy = [](singleObject &j) {
+			delete j.vArray;
+			delete j.iArray;
+			delete j.sProgram;
+			delete j.textureList;
+		};
+		for (auto &i : defination)
+		{
+			for (auto &j : i.second)
+			{
+				destroy(j);
+			}
+		}
+		// Loaded but never swapped in
+		for (auto &pending : pendingQueue)
 		{
-			for (auto j : i.second)
+			glDeleteSync(pending.fence);
+			for (auto &j : pending.objects)
 			{
-				delete j.vArray;
-				delete j.iArray;
-				delete j.textureList;
+				destroy(j);
 			}
 		}
 	}
 
-	void objectArray::genArray(const json &jsonObject, bool gen)
+	void objectArray::eachEntry(json &jsonObject, const string &kind, const function<void (json&, const string&, GLuint)> &body)
 	{
 		if (!jsonObject.is_array())
 			throw error("JSON format error.", "JSON root node is not array.");
-
 		for (GLuint i = 0; i < jsonObject.size(); i++)
 		{
 			// Basic confirm, json object with "type" and "name"
 			// "type" is string and "name" is string
-			if (jsonObject[i].contains("type") && jsonObject[i].contains("name") &&
-				jsonObject[i]["type"].is_string() && jsonObject[i]["name"].is_string())
+			if (!(jsonObject[i].contains("type") && jsonObject[i].contains("name") &&
+				jsonObject[i]["type"].is_string() && jsonObject[i]["name"].is_string()))
+				throw error("JSON format error.", "Encountered undefined object.");
+			string type = jsonObject[i]["type"].get<string>();
+			// "defination" defines the vertices of an object, VBO and EBO,
+			// "usage" the coordinates to transform it to
+			if (type.compare("defination") != 0 && type.compare("usage") != 0)
+				throw error("JSON format error.", "Encountered unfamiliar object.");
+			if (type.compare(kind) == 0)
+				body(jsonObject[i], jsonObject[i]["name"].get<string>(), i);
+		}
+	}
+	map<GLuint, future<shared_ptr<scene>>> objectArray::submitImports(const json &jsonObject)
+	{
+		// Model imports run on the pool, each worker with its own importer
+		map<GLuint, future<shared_ptr<scene>>> imports;
+		for (GLuint i = 0; i < jsonObject.size(); i++)
+		{
+			const json &single = jsonObject[i];
+			if (single.contains("type") && single["type"] == "defination" && single.contains("model") &&
+				single["model"].is_object() && single["model"].contains("name") && single["model"]["name"].is_string())
 			{
-				string type = jsonObject[i]["type"].get<string>();
-				string name = jsonObject[i]["name"].get<string>();
-				// This is a defination to a object
-				// Defines the vertices of object
-				// Contains value of VBO and EBO
-				if (type.compare("defination") == 0)
-				{
-					// Create a singleObject for further resolve
-					genDefination(jsonObject[i], name);
-				}
-				// This is a usage to a object
-				// Contains coordinates to transform object to
-				else if (type.compare("usage") == 0)
-				{
-					genUsage(jsonObject[i], name);
-				}
-				else
-					throw error("JSON format error.", "Encountered unfamiliar object.");
+				string file = single["model"]["name"].get<string>();
+				imports[i] = threadPool::global().submit([file]() {
+					return make_shared<scene>(file, false);
+				});
 			}
-			else
-				throw error("JSON format error.", "Encountered undefined object.");
 		}
+		return imports;
+	}
+
+	void objectArray::genArray(json &jsonObject, bool gen)
+	{
+		if (!jsonObject.is_array())
+			throw error("JSON format error.", "JSON root node is not array.");
+
+		// Everything touching GL stays on this thread
+		auto imports = submitImports(jsonObject);
+
+		// Usages go first, the light counts pick the shader variants, so each
+		// definition's programs can compile while the next one is loading
+		eachEntry(jsonObject, "usage", [&](json &entry, const string &name, GLuint) {
+			genUsage(entry, name);
+		});
+		eachEntry(jsonObject, "defination", [&](json &entry, const string &name, GLuint i) {
+			// Rethrows a failed import
+			defination[name] = genDefination(entry, imports.count(i) ? imports[i].get() : NULL);
+			submitPrograms(name);
+		});
+		// Buffers for every definition are created together at the end
 		if (gen)
 		{
 			for (auto &i : defination)
 			{
-				for (auto j : i.second)
+				for (auto &j : i.second)
 				{
 					j.genObjectBuffer();
 				}
@@ -330,19 +627,122 @@ namespace opengl
 		}
 	}
 
-	void objectArray::genDefination(const json &jsonObject, const string &name)
+	void objectArray::prepare(const string &filename)
+	{
+		ifstream file(filename);
+		deferred = geometryParser::parse(file);
+		file.close();
+		eachEntry(deferred, "usage", [&](json &entry, const string &name, GLuint) {
+			genUsage(entry, name);
+		});
+		loadDone = false;
+	}
+	void objectArray::load(bool pack)
+	{
+		// Packing needs the decodes before the windows upload them
+		if (pack)
+			texture::holdUploads(true);
+		try
+		{
+			auto imports = submitImports(deferred);
+			vector<pendingDefinition> built;
+			eachEntry(deferred, "defination", [&](json &entry, const string &name, GLuint i) {
+				pendingDefinition ready;
+				ready.name = name;
+				ready.objects = genDefination(entry, imports.count(i) ? imports[i].get() : NULL);
+				for (auto &single : ready.objects)
+				{
+					single.genBuffers();
+				}
+				if (pack)
+				{
+					// Published together once packed, arrays may span definitions
+					built.push_back(move(ready));
+					return;
+				}
+				publish(move(ready));
+			});
+			if (pack)
+			{
+				texturePacker packer;
+				for (auto &ready : built)
+				{
+					addTextures(packer, ready.objects);
+				}
+				packer.pack();
+				// The arrays must be complete before a drawing context sees the records
+				GLsync packed = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+				GLenum state;
+				do
+				{
+					state = glClientWaitSync(packed, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+				} while (state == GL_TIMEOUT_EXPIRED);
+				glDeleteSync(packed);
+				texture::holdUploads(false);
+				packReport = packer.report();
+				for (auto &ready : built)
+				{
+					publish(move(ready));
+				}
+			}
+		}
+		catch (...)
+		{
+			if (pack)
+				texture::holdUploads(false);
+			lock_guard<mutex> lock(pendingLock);
+			loadError = current_exception();
+		}
+		// What is left of the scene file is not read again
+		deferred = json();
+		loadDone = true;
+	}
+	void objectArray::publish(pendingDefinition &&ready)
+	{
+		// Other contexts may only use the buffers once the fence has passed
+		ready.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush();
+		lock_guard<mutex> lock(pendingLock);
+		pendingQueue.push_back(move(ready));
+	}
+	bool objectArray::swapIn()
+	{
+		// Read before the queue, whatever load pushed before finishing is then in it
+		bool done = loadDone;
+		lock_guard<mutex> lock(pendingLock);
+		if (loadError)
+			rethrow_exception(exchange(loadError, nullptr));
+		while (!pendingQueue.empty())
+		{
+			pendingDefinition &front = pendingQueue.front();
+			if (glClientWaitSync(front.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				return false;
+			glDeleteSync(front.fence);
+			for (auto &single : front.objects)
+			{
+				single.genVertexArray();
+			}
+			defination[front.name] = move(front.objects);
+			submitPrograms(front.name);
+			pendingQueue.pop_front();
+		}
+		return done;
+	}
+
+	vector<singleObject> objectArray::genDefination(json &jsonObject, shared_ptr<scene> imported)
 	{
+		vector<singleObject> ret;
 		if (jsonObject.contains("model") && jsonObject["model"].is_object())
 		{
-			if (jsonObject["model"].contains("name") && jsonObject["model"]["name"].is_string())
+			if (imported)
 			{
-				scene raw(jsonObject["model"]["name"].get<string>());
-				function<singleObject&& (const plainModel&)> func = &genObject;
-				defination[name] = raw.map(func);
+				imported->loadTextures();
+				function<singleObject (plainModel&&)> func = &genObject;
+				ret = imported->map(func);
 			}
 			if (jsonObject.contains("shader") && jsonObject["shader"].is_object())
 			{
-				for (auto &obj : defination[name])
+				for (auto &obj : ret)
 				{
 					obj.sProgram = new shaderProgram(jsonObject["shader"]);
 				}
@@ -350,26 +750,69 @@ namespace opengl
 		}
 		else
 		{
-			defination[name] = vector<singleObject>({singleObject(jsonObject)});
-			defination[name][0].genObjectBuffer();
+			ret.push_back(singleObject(move(jsonObject)));
 		}
+		return ret;
 	}
 
-	singleObject&& objectArray::genObject(const plainModel &model)
+	singleObject objectArray::genObject(plainModel &&model)
 	{
-		singleObject *obj = new singleObject();
+		singleObject obj;
 
 		auto vRaw = model.rawVertex();
 		auto vSize = model.rawVertexSize();
 		auto iRaw = model.rawIndice();
 		auto iSize = model.rawIndiceSize();
-		obj->vArray = new vertexArray(vector<GLfloat>(vRaw, vRaw + vSize));
-		obj->iArray = new indiceArray(vector<GLuint>(iRaw, iRaw + iSize));
-		obj->sProgram = NULL;
-		obj->textureList = new map<string, texture>(model.textures);
-		obj->genObjectBuffer();
+		// Mapped cache ranges go to glBufferData as they are, imported vectors move in
+		shared_ptr<const void> owner = model.mapping;
+		if (!model.mapping)
+		{
+			if (model.quantized)
+				owner = make_shared<vector<packedVertex>>(move(model.packedVertices));
+			else
+				owner = make_shared<vector<vertexData>>(move(model.vertices));
+		}
+		if (model.quantized)
+		{
+			vector<vertexAttribute> layout = {
+				{3, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(packedVertex, vertex)},
+				{2, GL_SHORT, GL_TRUE, offsetof(packedVertex, normal)},
+				{2, GL_HALF_FLOAT, GL_FALSE, offsetof(packedVertex, texture)}
+			};
+			obj.vArray = new vertexArray(vRaw, vSize, owner, layout, sizeof(packedVertex), model.boundsMin, model.boundsMax - model.boundsMin);
+		}
+		else
+		{
+			obj.vArray = new vertexArray(vRaw, vSize, owner);
+		}
+		if (model.mapping)
+			obj.iArray = new indiceArray(iRaw, iSize, model.mapping);
+		else
+			obj.iArray = new indiceArray(move(model.indices));
+		obj.sProgram = NULL;
+		obj.textureList = new map<string, texture>(move(model.textures));
+		if (!model.meshlets.empty())
+			obj.culler = make_shared<meshletCuller>(model.meshlets);
 
-		return move(*obj);
+		return obj;
+	}
+
+	void objectArray::drawUsage(const singleObject &single, const glm::mat4 &viewProjection, const glm::mat4 &model, const glm::vec3 &eye, bool cones)
+	{
+		if (!meshletCulling || !single.culler)
+		{
+			single.draw();
+			return;
+		}
+		glm::vec3 localEye(glm::inverse(model) * glm::vec4(eye, 1.0f));
+		meshletsDrawn += single.draw(viewProjection * model, localEye, cones);
+		meshletsTested += single.culler->size();
+	}
+	string objectArray::cullingReport() const
+	{
+		stringstream ret;
+		ret << "Meshlet culling: " << meshletsDrawn << " of " << meshletsTested << " meshlets drawn";
+		return ret.str();
 	}
 
 	void objectArray::genUsage(const json &jsonObject, const string &name)
@@ -478,16 +921,24 @@ namespace opengl
 					{
 						temp = jsonObject["light"]["direction"].get<vector<GLfloat>>();
 						usage.direction = glm::vec3(temp[0], temp[1], temp[2]);
+						usage.type = PARALLEL_LIGHT;
 					}
 					if (jsonObject["light"].contains("cutoff") && jsonObject["light"]["cutoff"].is_number())
 					{
 						usage.cutoff = glm::cos(glm::radians(jsonObject["light"]["cutoff"].get<GLfloat>()));
+						usage.type = SPOT_LIGHT;
 					}
 					if (jsonObject["light"].contains("outerCutoff") && jsonObject["light"]["outerCutoff"].is_number())
 					{
 						usage.outerCutoff = glm::cos(glm::radians(jsonObject["light"]["outerCutoff"].get<GLfloat>()));
 					}
-					lightSource.emplace(make_pair(jsonObject["light"]["source"].get<string>(), usage));
+					string source = jsonObject["light"]["source"].get<string>();
+					// The camera flashlight takes its strength and attenuation from this one
+					if (jsonObject["light"].contains("flashlight") && jsonObject["light"]["flashlight"].is_boolean() && jsonObject["light"]["flashlight"].get<bool>())
+						flashlightSource = source;
+					// Disabled lights keep their model but light nothing
+					if (!jsonObject["light"].contains("enabled") || !jsonObject["light"]["enabled"].is_boolean() || jsonObject["light"]["enabled"].get<bool>())
+						lightSource.emplace(make_pair(source, usage));
 				}
 			}
 			else
@@ -504,47 +955,105 @@ namespace opengl
 		return ret;
 	}
 
+	// Skips the bind if the unit still holds the texture, meshes sharing an array mostly do
+	static void bindTexture(GLuint unit, const texture &target, GLuint *bound)
+	{
+		// Finishing an upload in resolve binds on the active unit, keep that one
+		glActiveTexture(GL_TEXTURE0 + unit);
+		GLuint id = target.resolve();
+		if (bound[unit] == id)
+			return;
+		glBindTexture(target.getTarget(), id);
+		bound[unit] = id;
+	}
+
+	static void setLight(shaderProgram &program, const string &prefix, const objectArray::lightUsage &light)
+	{
+		program[prefix + ".pos"] = light.pos;
+		program[prefix + ".color"] = light.color;
+		program[prefix + ".strength"] = light.strength;
+		program[prefix + ".attenuation"] = light.attenuation;
+		program[prefix + ".direction"] = light.direction;
+		const auto &cutoff = program[prefix + ".cutoff"];
+		cutoff = {light.cutoff};
+		const auto &outerCutoff = program[prefix + ".outerCutoff"];
+		outerCutoff = {light.outerCutoff};
+	}
+
 	void objectArray::draw(const glm::mat4 &view, const glm::mat4 &projection, const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo)
 	{
-		GLenum textureUnit = GL_TEXTURE0;
-		for (auto def: defination)
+		// Lights are grouped by type, the counts select the shader variant
+		auto lights = getLights(globalInfo);
+		vector<const lightUsage*> byType[3];
+		for (auto &light : lights)
 		{
-			for (auto single: def.second)
+			byType[light.second.type].push_back(&light.second);
+		}
+		const char *arrayName[3] = {"pointLights", "parallelLights", "spotLights"};
+		lightUsage cameraLight = getFlashlight(viewPos, viewFacing);
+		shaderDefines scene = sceneDefines();
+		GLuint bound[32] = {0};
+		// Meshlets facing away only go when face culling would drop them anyway
+		glm::mat4 viewProjection = projection * view;
+		bool cones = glIsEnabled(GL_CULL_FACE);
+		meshletsDrawn = meshletsTested = 0;
+
+		for (auto &def : defination)
+		{
+			for (auto &single : def.second)
 			{
-				auto &sProgram = single.getShaderProgram();
+				auto &sProgram = programFor(single, scene);
+				// Objects appear once their program has linked instead of stalling
+				// the frame, drivers that cannot tell block on first use
+				sProgram.submit();
+				if (shaderProgram::parallelCompile() && !sProgram.poll())
+					continue;
 				sProgram.useProgram();
 				sProgram["viewPos"] = viewPos;
 				sProgram["viewFacing"] = viewFacing;
 				sProgram["view"] = view;
 				sProgram["projection"] = projection;
+				for (auto &uniformPair : uniforms)
+				{
+					sProgram[uniformPair.first] = uniformPair.second;
+				}
+				if (single.vArray->isQuantized())
+				{
+					sProgram["positionOffset"] = single.vArray->getPositionOffset();
+					sProgram["positionScale"] = single.vArray->getPositionScale();
+				}
+				// Units restart per object, only one object is bound at a time
+				GLuint textureUnit = 0;
 				for (auto &singleTexture : single.getTextureList())
 				{
-					if (textureUnit > GL_TEXTURE16)
+					if (textureUnit >= OBJECT_TEXTURE_UNITS)
 						throw error("Too many texture unit.");
-					glActiveTexture(textureUnit);
-					singleTexture.second.useTexture();
+					const texture &target = singleTexture.second;
+					bindTexture(textureUnit, target, bound);
 					const uniformSetter &setter = sProgram[singleTexture.first];
-					setter = {(int)(textureUnit - GL_TEXTURE0)};
+					setter = {(int)textureUnit};
+					if (target.isPacked())
+					{
+						const glm::vec4 &rect = target.getRect();
+						const auto &layer = sProgram[singleTexture.first + "_layer"];
+						layer = {(float)target.getLayer()};
+						const auto &rectSetter = sProgram[singleTexture.first + "_rect"];
+						rectSetter = {rect.x, rect.y, rect.z, rect.w};
+					}
 					textureUnit++;
 				}
 				if (usage.count(def.first) == 0)
 					continue;
-				for (auto light : lightSource)
+				for (int type = 0; type < 3; type++)
 				{
-					glm::vec4 pos = glm::vec4(light.second.pos, 1.0f);
-					if (usage[light.second.name][light.second.id].callback != NULL)
-						pos = usage[light.second.name][light.second.id].callback(globalInfo) * pos;
-					sProgram[light.first + ".pos"] = pos;
-					sProgram[light.first + ".color"] = light.second.color;
-					sProgram[light.first + ".strength"] = light.second.strength;
-					sProgram[light.first + ".attenuation"] = light.second.attenuation;
-					sProgram[light.first + ".direction"] = light.second.direction;
-					const auto &tempA = sProgram[light.first + ".cutoff"];
-					tempA = {light.second.cutoff};
-					const auto &tempB = sProgram[light.first + ".outerCutoff"];
-					tempB = {light.second.outerCutoff};
+					for (size_t i = 0; i < byType[type].size(); i++)
+					{
+						setLight(sProgram, string(arrayName[type]) + "[" + to_string(i) + "]", *byType[type][i]);
+					}
 				}
-				for (auto singleUsage: usage[def.first])
+				if (flashlight)
+					setLight(sProgram, "flashlight", cameraLight);
+				for (auto &singleUsage: usage[def.first])
 				{
 					glm::mat4 model(1.0f);
 					model = glm::translate(model, singleUsage.model);
@@ -566,12 +1075,221 @@ namespace opengl
 					{
 						sProgram["color"] = *singleUsage.color;
 					}
-					single.draw();
+					drawUsage(single, viewProjection, model, viewPos, cones);
 				}
 			}
 		}
 	}
 
+	void objectArray::drawGeometry(const glm::mat4 &view, const glm::mat4 &projection, shaderProgram &program, void *globalInfo)
+	{
+		program.useProgram();
+		program["view"] = view;
+		program["projection"] = projection;
+		// Samplers start at unit 0, keep the unused array twins off it
+		for (auto name : {"diffuseTexture_0_array", "specularTexture_0_array"})
+		{
+			const auto &setter = program[name];
+			setter = {TEXTURE_ARRAY_UNIT};
+		}
+		GLuint bound[32] = {0};
+		glm::mat4 viewProjection = projection * view;
+		glm::vec3 eye(glm::inverse(view)[3]);
+		bool cones = glIsEnabled(GL_CULL_FACE);
+		meshletsDrawn = meshletsTested = 0;
+		for (auto &def : defination)
+		{
+			if (usage.count(def.first) == 0)
+				continue;
+			for (auto &single : def.second)
+			{
+				// Units restart per object, only one object is bound at a time
+				// Each texture has a sampler2D and a sampler2DArray twin, a layer below 0 picks the plain one
+				GLuint textureUnit = 0;
+				for (auto &singleTexture : single.getTextureList())
+				{
+					if (textureUnit >= TEXTURE_ARRAY_UNIT)
+						throw error("Too many texture unit.");
+					const texture &target = singleTexture.second;
+					GLuint arrayUnit = TEXTURE_ARRAY_UNIT + textureUnit;
+					bindTexture(target.isPacked() ? arrayUnit : textureUnit, target, bound);
+					const uniformSetter &setter = program[singleTexture.first];
+					setter = {(int)textureUnit};
+					const uniformSetter &arraySetter = program[singleTexture.first + "_array"];
+					arraySetter = {(int)arrayUnit};
+					const glm::vec4 &rect = target.getRect();
+					const auto &layer = program[singleTexture.first + "_layer"];
+					layer = {target.isPacked() ? (float)target.getLayer() : -1.0f};
+					const auto &rectSetter = program[singleTexture.first + "_rect"];
+					rectSetter = {rect.x, rect.y, rect.z, rect.w};
+					textureUnit++;
+				}
+				const auto &quantized = program["quantized"];
+				quantized = {(int)single.vArray->isQuantized()};
+				program["positionOffset"] = single.vArray->getPositionOffset();
+				program["positionScale"] = single.vArray->getPositionScale();
+				const auto &hasDiffuse = program["hasDiffuseTexture"];
+				hasDiffuse = {(int)single.getTextureList().count("diffuseTexture_0")};
+				const auto &hasSpecular = program["hasSpecularTexture"];
+				hasSpecular = {(int)single.getTextureList().count("specularTexture_0")};
+				for (auto &singleUsage : usage[def.first])
+				{
+					glm::mat4 model(1.0f);
+					model = glm::translate(model, singleUsage.model);
+					model = glm::rotate(model, glm::degrees(singleUsage.rotateDegree), singleUsage.rotateAxis);
+					if (singleUsage.callback != NULL)
+						model *= singleUsage.callback(globalInfo);
+					program["model"] = model;
+					program["normalMat"] = glm::transpose(glm::inverse(glm::mat3(model)));
+					// Objects with a plain color are light sources, written as unlit
+					const auto &emissive = program["emissive"];
+					emissive = {(int)(singleUsage.color != NULL)};
+					if (singleUsage.color == NULL)
+					{
+						program["material.diffuse"] = singleUsage.material.diffuse;
+						program["material.specular"] = singleUsage.material.specular;
+						const auto &temp = program["material.shininess"];
+						temp = {singleUsage.material.shininess};
+					}
+					else
+					{
+						program["color"] = *singleUsage.color;
+					}
+					drawUsage(single, viewProjection, model, eye, cones);
+				}
+			}
+		}
+	}
+
+	shaderDefines objectArray::sceneDefines() const
+	{
+		GLuint count[3] = {0, 0, 0};
+		for (auto &light : lightSource)
+		{
+			count[light.second.type]++;
+		}
+		shaderDefines ret = {
+			{"NUM_POINT_LIGHTS", to_string(count[POINT_LIGHT])},
+			{"NUM_PARALLEL_LIGHTS", to_string(count[PARALLEL_LIGHT])},
+			{"NUM_SPOT_LIGHTS", to_string(count[SPOT_LIGHT])}
+		};
+		if (flashlight)
+			ret["FLASHLIGHT"] = "1";
+		return ret;
+	}
+	shaderProgram& objectArray::programFor(singleObject &single, const shaderDefines &scene)
+	{
+		shaderDefines defines(scene);
+		if (single.getTextureList().count("diffuseTexture_0"))
+			defines["HAS_DIFFUSE_TEXTURE"] = "1";
+		if (single.getTextureList().count("specularTexture_0"))
+			defines["HAS_SPECULAR_TEXTURE"] = "1";
+		// Packed textures are sampled from an array layer
+		auto diffuse = single.getTextureList().find("diffuseTexture_0");
+		if (diffuse != single.getTextureList().end() && diffuse->second.isPacked())
+			defines["DIFFUSE_ARRAY"] = "1";
+		auto specular = single.getTextureList().find("specularTexture_0");
+		if (specular != single.getTextureList().end() && specular->second.isPacked())
+			defines["SPECULAR_ARRAY"] = "1";
+		if (single.vArray->isQuantized())
+			defines["QUANTIZED"] = "1";
+		return single.sProgram->variant(defines);
+	}
+	void objectArray::submitPrograms(const string &name)
+	{
+		shaderDefines scene = sceneDefines();
+		for (auto &single : defination[name])
+		{
+			if (single.sProgram != NULL)
+				programFor(single, scene).submit();
+		}
+	}
+	void objectArray::addTextures(texturePacker &packer, vector<singleObject> &objects)
+	{
+		for (auto &single : objects)
+		{
+			// Atlas rects cannot repeat, wrapped UVs keep a texture out of the atlas
+			bool inRange = single.vArray->attributeInRange(2, 0.0f, 1.0f);
+			for (auto &singleTexture : single.getTextureList())
+			{
+				packer.add(singleTexture.second, inRange);
+			}
+		}
+	}
+	string objectArray::packTextures()
+	{
+		// load(true) packed before any of them could upload
+		if (!packReport.empty())
+			return packReport;
+		texturePacker packer;
+		for (auto &def : defination)
+		{
+			addTextures(packer, def.second);
+		}
+		packer.pack();
+		// Packed textures select other forward variants
+		for (auto &def : defination)
+		{
+			submitPrograms(def.first);
+		}
+		return packer.report();
+	}
+
+	map<string, objectArray::lightUsage> objectArray::getLights(void *globalInfo)
+	{
+		map<string, lightUsage> ret(lightSource);
+		for (auto &light : ret)
+		{
+			auto &source = usage[light.second.name][light.second.id];
+			if (source.callback != NULL)
+				light.second.pos = glm::vec3(source.callback(globalInfo) * glm::vec4(light.second.pos, 1.0f));
+		}
+		return ret;
+	}
+
+	float objectArray::lightUsage::radius(float threshold) const
+	{
+		if (type == PARALLEL_LIGHT)
+			return numeric_limits<float>::infinity();
+		// Solve peak / (c + l * d + q * d^2) = threshold for d
+		float terms = type == SPOT_LIGHT ? glm::max(strength[1], strength[2]) : glm::max(glm::max(strength[0], strength[1]), strength[2]);
+		float peak = glm::max(glm::max(color.r, color.g), color.b) * terms;
+		float c = attenuation[0] - peak / threshold;
+		float l = attenuation[1];
+		float q = attenuation[2];
+		if (q > 0.0f)
+			return (-l + glm::sqrt(l * l - 4.0f * q * c)) / (2.0f * q);
+		if (l > 0.0f)
+			return -c / l;
+		return numeric_limits<float>::infinity();
+	}
+	objectArray::lightUsage objectArray::getFlashlight(const glm::vec3 &pos, const glm::vec3 &direction) const
+	{
+		lightUsage ret("flashlight", 0, pos);
+		ret.type = SPOT_LIGHT;
+		ret.color = glm::vec3(1.0f);
+		ret.strength = glm::vec3(0.2f, 1.0f, 1.0f);
+		ret.attenuation = glm::vec3(1.0f, 0.045f, 0.0075f);
+		ret.direction = direction;
+		ret.cutoff = glm::cos(glm::radians(5.0f));
+		ret.outerCutoff = glm::cos(glm::radians(10.0f));
+		auto source = lightSource.find(flashlightSource);
+		if (source != lightSource.end())
+		{
+			ret.strength = source->second.strength;
+			ret.attenuation = source->second.attenuation;
+		}
+		return ret;
+	}
+	bool objectArray::lightUsage::unbounded() const
+	{
+		return type == PARALLEL_LIGHT;
+	}
+	glm::vec3 objectArray::lightUsage::ambient() const
+	{
+		return type == SPOT_LIGHT ? color * strength[0] : glm::vec3(0.0f);
+	}
+
 	auto& objectArray::operator[](const string &str)
 	{
 		return defination[str];
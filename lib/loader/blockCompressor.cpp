@@ -0,0 +1,232 @@
+#include "loader/blockCompressor.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BLOCK_SIMD
+#endif
+
+namespace opengl
+{
+	static inline uint16_t packColor(const float *color)
+	{
+		int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+		int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+		int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+		return (uint16_t)((r << 11) | (g << 5) | b);
+	}
+	static inline void unpackColor(uint16_t packed, float *color)
+	{
+		int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+		color[0] = (float)((r << 3) | (r >> 2));
+		color[1] = (float)((g << 2) | (g >> 4));
+		color[2] = (float)((b << 3) | (b >> 2));
+	}
+
+	// Position of each pixel along the line from low to high, rounded to 0..steps
+	static void project(const float *r, const float *g, const float *b, const float *low, const float *high, float steps, int *out)
+	{
+		float dir[3] = {high[0] - low[0], high[1] - low[1], high[2] - low[2]};
+		float length = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+		float scale = length > 0.0f ? steps / length : 0.0f;
+		float base = low[0] * dir[0] + low[1] * dir[1] + low[2] * dir[2];
+#ifdef BLOCK_SIMD
+		__m128 dr = _mm_set1_ps(dir[0]), dg = _mm_set1_ps(dir[1]), db = _mm_set1_ps(dir[2]);
+		__m128 vbase = _mm_set1_ps(base), vscale = _mm_set1_ps(scale);
+		__m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(steps);
+		for (int i = 0; i < 16; i += 4)
+		{
+			__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r + i), dr), _mm_mul_ps(_mm_loadu_ps(g + i), dg)), _mm_mul_ps(_mm_loadu_ps(b + i), db));
+			__m128 t = _mm_mul_ps(_mm_sub_ps(dot, vbase), vscale);
+			t = _mm_min_ps(_mm_max_ps(t, zero), top);
+			_mm_storeu_si128((__m128i*)(out + i), _mm_cvtps_epi32(t));
+		}
+#else
+		for (int i = 0; i < 16; i++)
+		{
+			float t = (r[i] * dir[0] + g[i] * dir[1] + b[i] * dir[2] - base) * scale;
+			out[i] = (int)(min(max(t, 0.0f), steps) + 0.5f);
+		}
+#endif
+	}
+
+	void blockCompressor::encodeColor(const unsigned char *block, unsigned char *out)
+	{
+		float r[16], g[16], b[16];
+		float low[3] = {255.0f, 255.0f, 255.0f}, high[3] = {0.0f, 0.0f, 0.0f};
+		float mean[3] = {0.0f, 0.0f, 0.0f};
+		for (int i = 0; i < 16; i++)
+		{
+			r[i] = block[i * 4];
+			g[i] = block[i * 4 + 1];
+			b[i] = block[i * 4 + 2];
+			float pixel[3] = {r[i], g[i], b[i]};
+			for (int c = 0; c < 3; c++)
+			{
+				low[c] = min(low[c], pixel[c]);
+				high[c] = max(high[c], pixel[c]);
+				mean[c] += pixel[c] / 16.0f;
+			}
+		}
+		// Pick the box diagonal that follows the colors, green is the reference axis
+		float covRG = 0.0f, covBG = 0.0f;
+		for (int i = 0; i < 16; i++)
+		{
+			covRG += (r[i] - mean[0]) * (g[i] - mean[1]);
+			covBG += (b[i] - mean[2]) * (g[i] - mean[1]);
+		}
+		if (covRG < 0.0f)
+			swap(low[0], high[0]);
+		if (covBG < 0.0f)
+			swap(low[2], high[2]);
+		// Inset by 1/16 of the range, the extremes are rarely hit exactly
+		for (int c = 0; c < 3; c++)
+		{
+			float inset = (high[c] - low[c]) / 16.0f;
+			high[c] -= inset;
+			low[c] += inset;
+		}
+
+		uint16_t c0 = packColor(high), c1 = packColor(low);
+		uint32_t indices = 0;
+		if (c0 < c1)
+			swap(c0, c1);
+		if (c0 != c1)
+		{
+			float end0[3], end1[3];
+			unpackColor(c0, end0);
+			unpackColor(c1, end1);
+			int t[16];
+			project(r, g, b, end1, end0, 3.0f, t);
+			// 0 lands on c1, 3 on c0, the thirds sit in between
+			const uint32_t remap[4] = {1, 3, 2, 0};
+			for (int i = 0; i < 16; i++)
+			{
+				indices |= remap[t[i]] << (i * 2);
+			}
+		}
+		out[0] = c0 & 0xFF;
+		out[1] = c0 >> 8;
+		out[2] = c1 & 0xFF;
+		out[3] = c1 >> 8;
+		for (int i = 0; i < 4; i++)
+		{
+			out[4 + i] = (indices >> (i * 8)) & 0xFF;
+		}
+	}
+	void blockCompressor::encodeChannel(const unsigned char *block, int channel, unsigned char *out)
+	{
+		float value[16], zero[16] = {};
+		float low = 255.0f, high = 0.0f;
+		for (int i = 0; i < 16; i++)
+		{
+			value[i] = block[i * 4 + channel];
+			low = min(low, value[i]);
+			high = max(high, value[i]);
+		}
+		unsigned char a0 = (unsigned char)high, a1 = (unsigned char)low;
+		uint64_t indices = 0;
+		if (a0 != a1)
+		{
+			int t[16];
+			float lowVec[3] = {low, 0.0f, 0.0f}, highVec[3] = {high, 0.0f, 0.0f};
+			project(value, zero, zero, lowVec, highVec, 7.0f, t);
+			for (int i = 0; i < 16; i++)
+			{
+				// 7 is a0, 0 is a1, index i in 2..7 weighs a1 by (i - 1) / 7
+				uint64_t index = t[i] == 7 ? 0 : (t[i] == 0 ? 1 : 8 - t[i]);
+				indices |= index << (i * 3);
+			}
+		}
+		out[0] = a0;
+		out[1] = a1;
+		for (int i = 0; i < 6; i++)
+		{
+			out[2 + i] = (indices >> (i * 8)) & 0xFF;
+		}
+	}
+
+	GLenum blockCompressor::glFormat(blockFormat format)
+	{
+		switch (format)
+		{
+			case BC1_FORMAT:
+			return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+			case BC3_FORMAT:
+			return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			default:
+			return GL_COMPRESSED_RG_RGTC2;
+		}
+	}
+	size_t blockCompressor::blockBytes(GLenum glFormat)
+	{
+		return glFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+	}
+	size_t blockCompressor::compressedSize(blockFormat format, int width, int height)
+	{
+		size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+		return blocks * (format == BC1_FORMAT ? 8 : 16);
+	}
+
+	vector<unsigned char> blockCompressor::compress(const unsigned char *rgba, int width, int height, blockFormat format)
+	{
+		vector<unsigned char> ret(compressedSize(format, width, height));
+		unsigned char *out = ret.data();
+		unsigned char block[64];
+		for (int by = 0; by < height; by += 4)
+		{
+			for (int bx = 0; bx < width; bx += 4)
+			{
+				for (int y = 0; y < 4; y++)
+				{
+					int sy = min(by + y, height - 1);
+					for (int x = 0; x < 4; x++)
+					{
+						int sx = min(bx + x, width - 1);
+						memcpy(block + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+					}
+				}
+				switch (format)
+				{
+					case BC1_FORMAT:
+					encodeColor(block, out);
+					out += 8;
+					break;
+					case BC3_FORMAT:
+					encodeChannel(block, 3, out);
+					encodeColor(block, out + 8);
+					out += 16;
+					break;
+					case BC5_FORMAT:
+					encodeChannel(block, 0, out);
+					encodeChannel(block, 1, out + 8);
+					out += 16;
+					break;
+				}
+			}
+		}
+		return ret;
+	}
+	vector<unsigned char> blockCompressor::downsample(const unsigned char *rgba, int width, int height)
+	{
+		int w = max(width / 2, 1), h = max(height / 2, 1);
+		vector<unsigned char> ret((size_t)w * h * 4);
+		for (int y = 0; y < h; y++)
+		{
+			int y0 = min(y * 2, height - 1), y1 = min(y * 2 + 1, height - 1);
+			for (int x = 0; x < w; x++)
+			{
+				int x0 = min(x * 2, width - 1), x1 = min(x * 2 + 1, width - 1);
+				for (int c = 0; c < 4; c++)
+				{
+					int sum = rgba[((size_t)y0 * width + x0) * 4 + c] + rgba[((size_t)y0 * width + x1) * 4 + c] +
+							  rgba[((size_t)y1 * width + x0) * 4 + c] + rgba[((size_t)y1 * width + x1) * 4 + c];
+					ret[((size_t)y * w + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		return ret;
+	}
+}
@@ -0,0 +1,205 @@
+#include "loader/geometryParser.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <utility>
+
+namespace opengl
+{
+	// json_sax_dom_parser is internal to nlohmann, and may change between releases
+	static_assert(NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR == 11 && NLOHMANN_JSON_VERSION_PATCH == 2,
+		"geometrySax is written against the vendored nlohmann json 3.11.2, check json_sax_dom_parser before updating");
+
+	// Builds the document like json::parse, except for the geometry value arrays
+	// The value arrays end up as binary values, which the arrays loaded from an
+	// owned document move out rather than copy
+	class geometrySax
+	{
+	private:
+		nlohmann::detail::json_sax_dom_parser<json> builder;
+		// Key each open container sits under, and whether it is an object
+		vector<pair<std::string, bool>> containers;
+		std::string lastKey;
+		// GL_FLOAT or GL_UNSIGNED_INT while a value array is read, 0 otherwise
+		GLenum capture;
+		vector<uint8_t> bytes;
+		bool typeError;
+
+		template <typename V>
+		bool store(V value)
+		{
+			size_t at = bytes.size();
+			bytes.resize(at + sizeof(value));
+			memcpy(&bytes[at], &value, sizeof(value));
+			return true;
+		}
+		bool fail()
+		{
+			typeError = true;
+			return false;
+		}
+		std::string nextName() const
+		{
+			return !containers.empty() && containers.back().second ? lastKey : std::string();
+		}
+	public:
+		geometrySax(json &result, const std::string &root):
+		builder(result, true), capture(0), typeError(false)
+		{
+			// The top level container finds root as its key
+			containers.push_back(make_pair(std::string(), true));
+			lastKey = root;
+		}
+
+		bool null()
+		{
+			return capture ? fail() : builder.null();
+		}
+		bool boolean(bool value)
+		{
+			return capture ? fail() : builder.boolean(value);
+		}
+		bool number_integer(json::number_integer_t value)
+		{
+			if (capture == GL_FLOAT)
+				return store((GLfloat)value);
+			if (capture == GL_UNSIGNED_INT)
+				return value < 0 ? fail() : store((GLuint)value);
+			return builder.number_integer(value);
+		}
+		bool number_unsigned(json::number_unsigned_t value)
+		{
+			if (capture == GL_FLOAT)
+				return store((GLfloat)value);
+			if (capture == GL_UNSIGNED_INT)
+				return store((GLuint)value);
+			return builder.number_unsigned(value);
+		}
+		bool number_float(json::number_float_t value, const std::string &text)
+		{
+			if (capture == GL_FLOAT)
+				return store((GLfloat)value);
+			if (capture == GL_UNSIGNED_INT)
+				return fail();
+			return builder.number_float(value, text);
+		}
+		bool string(std::string &value)
+		{
+			return capture ? fail() : builder.string(value);
+		}
+		bool binary(json::binary_t &value)
+		{
+			return capture ? fail() : builder.binary(value);
+		}
+		bool start_object(size_t elements)
+		{
+			if (capture)
+				return fail();
+			containers.push_back(make_pair(nextName(), true));
+			return builder.start_object(elements);
+		}
+		bool key(std::string &value)
+		{
+			lastKey = value;
+			return builder.key(value);
+		}
+		bool end_object()
+		{
+			containers.pop_back();
+			return builder.end_object();
+		}
+		bool start_array(size_t elements)
+		{
+			if (capture)
+				return fail();
+			std::string name = nextName();
+			if (name == "value")
+			{
+				const std::string &parent = containers.back().first;
+				capture = parent == "vertex" ? GL_FLOAT : parent == "indice" ? GL_UNSIGNED_INT : 0;
+				if (capture)
+				{
+					bytes.clear();
+					return true;
+				}
+			}
+			containers.push_back(make_pair(name, false));
+			return builder.start_array(elements);
+		}
+		bool end_array()
+		{
+			if (capture)
+			{
+				capture = 0;
+				json::binary_t value(move(bytes));
+				bytes = vector<uint8_t>();
+				return builder.binary(value);
+			}
+			containers.pop_back();
+			return builder.end_array();
+		}
+		template <class Exception>
+		bool parse_error(size_t position, const std::string &last, const Exception &e)
+		{
+			return builder.parse_error(position, last, e);
+		}
+
+		bool failed() const
+		{
+			return typeError;
+		}
+	};
+
+	json geometryParser::parse(istream &input, const string &root)
+	{
+		json ret;
+		geometrySax handler(ret, root);
+		bool parsed = json::sax_parse(input, &handler);
+		if (handler.failed())
+			throw error("Value type error.");
+		if (!parsed)
+			throw error("JSON format error.");
+		return ret;
+	}
+
+	vector<unsigned char> geometryParser::decodeBase64(const string &text)
+	{
+		static const signed char *digits = []() {
+			static signed char table[256];
+			memset(table, -1, sizeof(table));
+			const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			for (int i = 0; i < 64; i++)
+			{
+				table[(unsigned char)alphabet[i]] = i;
+			}
+			return table;
+		}();
+
+		size_t start = 0;
+		if (text.compare(0, 5, "data:") == 0)
+		{
+			start = text.find("base64,");
+			if (start == string::npos)
+				throw error("Value type error.", "Only base64 data URIs are supported.");
+			start += 7;
+		}
+		vector<unsigned char> ret;
+		ret.reserve((text.size() - start) / 4 * 3);
+		uint32_t bits = 0;
+		int pending = 0;
+		for (size_t i = start; i < text.size() && text[i] != '='; i++)
+		{
+			signed char digit = digits[(unsigned char)text[i]];
+			if (digit < 0)
+				throw error("Value type error.", "Invalid base64.");
+			bits = bits << 6 | digit;
+			pending += 6;
+			if (pending >= 8)
+			{
+				pending -= 8;
+				ret.push_back((bits >> pending) & 0xff);
+			}
+		}
+		return ret;
+	}
+}
@@ -1,8 +1,12 @@
 #include "gl.hpp"
 
+#include <cstring>
+
 namespace opengl
 {
     using namespace std;
+    static GLADloadproc procLoader = NULL;
+
     void glErrorAssert()
     {
         int errorCode = glGetError();
@@ -11,4 +15,34 @@ namespace opengl
             throw error(to_string(errorCode));
         }
     }
+
+    void glSetLoader(GLADloadproc loader)
+    {
+        procLoader = loader;
+    }
+    void* glGetProc(const char *name)
+    {
+        if (procLoader == NULL)
+            return NULL;
+        return procLoader(name);
+    }
+    bool glExtensionSupported(const char *name)
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++)
+        {
+            const char *ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+            if (ext != NULL && strcmp(ext, name) == 0)
+                return true;
+        }
+        return false;
+    }
+    bool glVersionAtLeast(int major, int minor)
+    {
+        GLint curMajor = 0, curMinor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &curMajor);
+        glGetIntegerv(GL_MINOR_VERSION, &curMinor);
+        return curMajor > major || (curMajor == major && curMinor >= minor);
+    }
 }
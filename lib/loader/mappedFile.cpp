@@ -0,0 +1,76 @@
+#include "loader/mappedFile.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace opengl
+{
+	mappedFile::mappedFile(const string &path):
+	address(NULL), length(0)
+	{
+#ifdef _WIN32
+		fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE)
+			throw error("File open failed.", path);
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(fileHandle, &fileSize);
+		length = fileSize.QuadPart;
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle != NULL)
+			address = (const unsigned char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		if (address == NULL)
+		{
+			if (mappingHandle != NULL)
+				CloseHandle(mappingHandle);
+			CloseHandle(fileHandle);
+			throw error("File map failed.", path);
+		}
+#else
+		int descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (descriptor < 0)
+			throw error("File open failed.", path);
+		struct stat info;
+		if (fstat(descriptor, &info) != 0 || info.st_size == 0)
+		{
+			close(descriptor);
+			throw error("File map failed.", path);
+		}
+		length = info.st_size;
+		void *mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		// The mapping keeps its own reference to the file
+		close(descriptor);
+		if (mapped == MAP_FAILED)
+			throw error("File map failed.", path + " " + to_string(errno));
+		address = (const unsigned char*)mapped;
+#endif
+	}
+	mappedFile::~mappedFile()
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(address);
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+#else
+		munmap((void*)address, length);
+#endif
+	}
+
+	const unsigned char* mappedFile::data() const
+	{
+		return address;
+	}
+	size_t mappedFile::size() const
+	{
+		return length;
+	}
+}
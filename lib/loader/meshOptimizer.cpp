@@ -0,0 +1,445 @@
+#include "loader/meshOptimizer.hpp"
+#include "hash.hpp"
+
+#include "glm/gtc/packing.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+// Cache Forsyth's scores assume, larger than the real one so it degrades gently
+#define FORSYTH_CACHE_SIZE 32
+// A run ends once its cache misses come within this factor of the whole run
+#define CLUSTER_THRESHOLD 1.05f
+
+namespace opengl
+{
+	static float vertexScore(int cachePos, GLuint valence)
+	{
+		if (valence == 0)
+			return -1.0f;
+		float score = 0.0f;
+		if (cachePos >= 0)
+		{
+			// The last triangle's vertices score alike, whichever order they went in
+			if (cachePos < 3)
+				score = 0.75f;
+			else
+				score = pow(1.0f - (cachePos - 3) / (float)(FORSYTH_CACHE_SIZE - 3), 1.5f);
+		}
+		// Vertices with few triangles left are finished off first
+		return score + 2.0f * pow((float)valence, -0.5f);
+	}
+
+	// Merges byte identical vertices, the first of each stays
+	template <class V>
+	static void weld(vector<V> &vertices, vector<indiceData> &indices)
+	{
+		size_t tableSize = 1;
+		while (tableSize < vertices.size() * 2)
+		{
+			tableSize <<= 1;
+		}
+		const GLuint empty = numeric_limits<GLuint>::max();
+		vector<GLuint> table(tableSize, empty);
+		vector<GLuint> remap(vertices.size());
+		GLuint unique = 0;
+		for (size_t i = 0; i < vertices.size(); i++)
+		{
+			size_t slot = fnv1a(&vertices[i], sizeof(V)) & (tableSize - 1);
+			while (table[slot] != empty && memcmp(&vertices[table[slot]], &vertices[i], sizeof(V)) != 0)
+			{
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			if (table[slot] == empty)
+			{
+				table[slot] = unique;
+				vertices[unique] = vertices[i];
+				unique++;
+			}
+			remap[i] = table[slot];
+		}
+		vertices.resize(unique);
+		for (auto &index : indices)
+		{
+			index = remap[index];
+		}
+	}
+
+	// Numbers vertices in the order the indices first reach them, unused ones are dropped
+	template <class V>
+	static void fetchOrder(vector<V> &vertices, vector<indiceData> &indices)
+	{
+		const GLuint unused = numeric_limits<GLuint>::max();
+		vector<GLuint> remap(vertices.size(), unused);
+		GLuint next = 0;
+		for (auto &index : indices)
+		{
+			if (remap[index] == unused)
+				remap[index] = next++;
+			index = remap[index];
+		}
+		vector<V> ordered(next);
+		for (size_t i = 0; i < vertices.size(); i++)
+		{
+			if (remap[i] != unused)
+				ordered[remap[i]] = vertices[i];
+		}
+		vertices.swap(ordered);
+	}
+
+	glm::vec3 meshOptimizer::position(const plainModel &model, size_t vertex)
+	{
+		if (!model.quantized)
+			return model.vertices[vertex].vertex;
+		const packedVertex &packed = model.packedVertices[vertex];
+		glm::vec3 unit(glm::unpackUnorm1x16(packed.vertex[0]), glm::unpackUnorm1x16(packed.vertex[1]), glm::unpackUnorm1x16(packed.vertex[2]));
+		return model.boundsMin + unit * (model.boundsMax - model.boundsMin);
+	}
+
+	vector<indiceData> meshOptimizer::cacheOrder(const vector<indiceData> &indices, size_t vertexCount)
+	{
+		size_t triangleCount = indices.size() / 3;
+		// Triangles of each vertex, the first live[v] of them not emitted yet
+		vector<GLuint> live(vertexCount, 0);
+		for (auto index : indices)
+		{
+			live[index]++;
+		}
+		vector<GLuint> offsets(vertexCount + 1, 0);
+		partial_sum(live.begin(), live.end(), offsets.begin() + 1);
+		vector<GLuint> adjacency(indices.size());
+		{
+			vector<GLuint> cursor(offsets.begin(), offsets.end() - 1);
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				adjacency[cursor[indices[i]]++] = i / 3;
+			}
+		}
+
+		vector<int> cachePos(vertexCount, -1);
+		vector<float> score(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			score[v] = vertexScore(-1, live[v]);
+		}
+		vector<float> triangleScore(triangleCount);
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+		}
+		vector<bool> emitted(triangleCount, false);
+		vector<GLuint> cache, nextCache;
+		cache.reserve(FORSYTH_CACHE_SIZE + 3);
+		nextCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+		vector<indiceData> ret;
+		ret.reserve(indices.size());
+		size_t cursor = 0;
+		long best = max_element(triangleScore.begin(), triangleScore.end()) - triangleScore.begin();
+		while (ret.size() < triangleCount * 3)
+		{
+			if (best < 0)
+			{
+				// Nothing left around the cache, carry on from the first triangle left
+				while (emitted[cursor])
+				{
+					cursor++;
+				}
+				best = cursor;
+			}
+			emitted[best] = true;
+			nextCache.clear();
+			for (int i = 0; i < 3; i++)
+			{
+				GLuint v = indices[best * 3 + i];
+				ret.push_back(v);
+				nextCache.push_back(v);
+				GLuint *begin = adjacency.data() + offsets[v];
+				GLuint *last = begin + live[v] - 1;
+				swap(*find(begin, last + 1, (GLuint)best), *last);
+				live[v]--;
+			}
+			for (auto v : cache)
+			{
+				if (find(nextCache.begin(), nextCache.begin() + 3, v) == nextCache.begin() + 3)
+					nextCache.push_back(v);
+			}
+			for (size_t i = 0; i < nextCache.size(); i++)
+			{
+				GLuint v = nextCache[i];
+				cachePos[v] = i < FORSYTH_CACHE_SIZE ? (int)i : -1;
+				score[v] = vertexScore(cachePos[v], live[v]);
+			}
+			// Only triangles around the touched vertices changed score
+			best = -1;
+			float bestScore = -numeric_limits<float>::max();
+			for (auto v : nextCache)
+			{
+				for (GLuint i = offsets[v]; i < offsets[v] + live[v]; i++)
+				{
+					GLuint t = adjacency[i];
+					triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+					if (cachePos[v] >= 0 && triangleScore[t] > bestScore)
+					{
+						bestScore = triangleScore[t];
+						best = t;
+					}
+				}
+			}
+			if (nextCache.size() > FORSYTH_CACHE_SIZE)
+				nextCache.resize(FORSYTH_CACHE_SIZE);
+			cache.swap(nextCache);
+		}
+		return ret;
+	}
+
+	void meshOptimizer::sortClusters(const plainModel &model, vector<indiceData> &indices)
+	{
+		size_t triangleCount = indices.size() / 3;
+		if (triangleCount == 0)
+			return;
+		// A vertex is cached while fewer than cacheSize others went in after it,
+		// moving time on by cacheSize empties the cache
+		vector<size_t> stamp(model.vertexSize(), 0);
+		size_t time = cacheSize;
+		auto misses = [&](size_t t) {
+			int ret = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				GLuint v = indices[t * 3 + i];
+				if (time - stamp[v] >= cacheSize)
+				{
+					stamp[v] = ++time;
+					ret++;
+				}
+			}
+			return ret;
+		};
+
+		// Hard boundaries where a triangle misses the cache on all three vertices,
+		// the first run starts at triangle 0 even if it repeats a vertex
+		vector<size_t> starts;
+		vector<size_t> runMisses;
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			int count = misses(t);
+			if (count == 3 || t == 0)
+			{
+				starts.push_back(t);
+				runMisses.push_back(0);
+			}
+			runMisses.back() += count;
+		}
+		starts.push_back(triangleCount);
+
+		// Soft boundaries inside each, restarting the cache costs little once a run settles
+		vector<pair<size_t, size_t>> clusters;
+		for (size_t c = 0; c + 1 < starts.size(); c++)
+		{
+			size_t begin = starts[c], end = starts[c + 1];
+			float target = (float)runMisses[c] / (end - begin) * CLUSTER_THRESHOLD;
+			size_t count = 0, start = begin;
+			time += cacheSize;
+			for (size_t t = begin; t < end; t++)
+			{
+				count += misses(t);
+				if (t + 1 < end && (float)count / (t + 1 - start) <= target)
+				{
+					clusters.emplace_back(start, t + 1);
+					start = t + 1;
+					count = 0;
+					time += cacheSize;
+				}
+			}
+			clusters.emplace_back(start, end);
+		}
+		if (clusters.size() < 2)
+			return;
+
+		// Clusters facing away from the centre go first, they tend to occlude the rest
+		vector<glm::vec3> centroid(clusters.size(), glm::vec3(0.0f)), normal(clusters.size(), glm::vec3(0.0f));
+		vector<float> area(clusters.size(), 0.0f);
+		glm::vec3 meshCentroid(0.0f);
+		float meshArea = 0.0f;
+		for (size_t c = 0; c < clusters.size(); c++)
+		{
+			for (size_t t = clusters[c].first; t < clusters[c].second; t++)
+			{
+				glm::vec3 p0 = position(model, indices[t * 3]), p1 = position(model, indices[t * 3 + 1]), p2 = position(model, indices[t * 3 + 2]);
+				glm::vec3 cross = glm::cross(p1 - p0, p2 - p0);
+				float weight = glm::length(cross);
+				centroid[c] += (p0 + p1 + p2) * (weight / 3.0f);
+				normal[c] += cross;
+				area[c] += weight;
+			}
+			meshCentroid += centroid[c];
+			meshArea += area[c];
+			if (area[c] > 0.0f)
+				centroid[c] /= area[c];
+		}
+		if (meshArea > 0.0f)
+			meshCentroid /= meshArea;
+		vector<float> key(clusters.size());
+		for (size_t c = 0; c < clusters.size(); c++)
+		{
+			float length = glm::length(normal[c]);
+			key[c] = length > 0.0f ? glm::dot(centroid[c] - meshCentroid, normal[c] / length) : 0.0f;
+		}
+		vector<size_t> order(clusters.size());
+		iota(order.begin(), order.end(), 0);
+		stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return key[a] > key[b];
+		});
+
+		vector<indiceData> sorted;
+		sorted.reserve(indices.size());
+		for (auto c : order)
+		{
+			sorted.insert(sorted.end(), indices.begin() + clusters[c].first * 3, indices.begin() + clusters[c].second * 3);
+		}
+		indices.swap(sorted);
+	}
+
+	void meshOptimizer::optimize(plainModel &model)
+	{
+		// Lines and points left by triangulation are not reordered
+		if (model.mapping || model.indices.empty() || model.indices.size() % 3 != 0)
+			return;
+		size_t before = model.vertexSize();
+		size_t missesBefore = cacheMisses(model.indices, before);
+
+		if (model.quantized)
+			weld(model.packedVertices, model.indices);
+		else
+			weld(model.vertices, model.indices);
+		model.indices = cacheOrder(model.indices, model.vertexSize());
+		sortClusters(model, model.indices);
+		if (model.quantized)
+			fetchOrder(model.packedVertices, model.indices);
+		else
+			fetchOrder(model.vertices, model.indices);
+
+		stats.meshes++;
+		stats.triangles += model.indices.size() / 3;
+		stats.verticesBefore += before;
+		stats.verticesAfter += model.vertexSize();
+		stats.missesBefore += missesBefore;
+		stats.missesAfter += cacheMisses(model.indices, model.vertexSize());
+	}
+
+	void meshOptimizer::buildMeshlets(plainModel &model)
+	{
+		model.meshlets.clear();
+		if (model.mapping || model.indices.size() % 3 != 0)
+			return;
+		size_t triangleCount = model.indices.size() / 3;
+		// Meshlet a vertex was last counted in, plus one
+		vector<GLuint> owner(model.vertexSize(), 0);
+		vector<GLuint> used;
+		size_t start = 0;
+		auto close = [&](size_t end) {
+			meshlet entry;
+			entry.indiceOffset = start * 3;
+			entry.indiceCount = (end - start) * 3;
+
+			glm::vec3 low(numeric_limits<float>::max()), high(-numeric_limits<float>::max());
+			for (auto v : used)
+			{
+				glm::vec3 pos = position(model, v);
+				low = glm::min(low, pos);
+				high = glm::max(high, pos);
+			}
+			entry.center = (low + high) * 0.5f;
+			entry.radius = 0.0f;
+			for (auto v : used)
+			{
+				entry.radius = max(entry.radius, glm::length(position(model, v) - entry.center));
+			}
+
+			vector<glm::vec3> normals;
+			glm::vec3 sum(0.0f);
+			for (size_t t = start; t < end; t++)
+			{
+				glm::vec3 p0 = position(model, model.indices[t * 3]), p1 = position(model, model.indices[t * 3 + 1]), p2 = position(model, model.indices[t * 3 + 2]);
+				glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+				float length = glm::length(normal);
+				if (length == 0.0f)
+					continue;
+				normals.push_back(normal / length);
+				sum += normals.back();
+			}
+			float sumLength = glm::length(sum);
+			entry.coneAxis = sumLength > 0.0f ? sum / sumLength : glm::vec3(0.0f, 0.0f, 1.0f);
+			float minDot = sumLength > 0.0f ? 1.0f : -1.0f;
+			for (auto &normal : normals)
+			{
+				minDot = min(minDot, glm::dot(normal, entry.coneAxis));
+			}
+			// Wider than about 84 degrees the cone rejects too little to be worth it
+			entry.coneCutoff = minDot <= 0.1f ? 1.0f : sqrt(1.0f - minDot * minDot);
+			model.meshlets.push_back(entry);
+
+			start = end;
+			used.clear();
+		};
+
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			size_t added = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				if (owner[model.indices[t * 3 + i]] != model.meshlets.size() + 1)
+					added++;
+			}
+			if (used.size() + added > meshletVertices || t - start >= meshletTriangles)
+				close(t);
+			for (int i = 0; i < 3; i++)
+			{
+				GLuint v = model.indices[t * 3 + i];
+				if (owner[v] != model.meshlets.size() + 1)
+				{
+					owner[v] = model.meshlets.size() + 1;
+					used.push_back(v);
+				}
+			}
+		}
+		if (start < triangleCount)
+			close(triangleCount);
+	}
+
+	size_t meshOptimizer::cacheMisses(const vector<indiceData> &indices, size_t vertexCount)
+	{
+		// A vertex is cached while fewer than cacheSize others went in after it
+		vector<size_t> stamp(vertexCount, 0);
+		size_t time = cacheSize, misses = 0;
+		for (auto index : indices)
+		{
+			if (time - stamp[index] >= cacheSize)
+			{
+				stamp[index] = ++time;
+				misses++;
+			}
+		}
+		return misses;
+	}
+
+	string meshOptimizer::report()
+	{
+		stringstream ret;
+		double triangles = max<uint64_t>(stats.triangles, 1);
+		ret << fixed << setprecision(3) << "Mesh optimizer: " << stats.meshes << " meshes, "
+			<< stats.verticesBefore << " -> " << stats.verticesAfter << " vertices, ACMR "
+			<< stats.missesBefore / triangles << " -> " << stats.missesAfter / triangles << " at cache size " << cacheSize;
+		return ret.str();
+	}
+
+	size_t meshOptimizer::cacheSize = 16;
+	size_t meshOptimizer::meshletVertices = 64;
+	size_t meshOptimizer::meshletTriangles = 124;
+	meshOptimizer::optimizeStats meshOptimizer::stats;
+}
@@ -0,0 +1,153 @@
+#include "loader/meshletCuller.hpp"
+#include "threadPool.hpp"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MESHLET_SIMD
+#endif
+
+namespace opengl
+{
+	meshletCuller::meshletCuller(const vector<meshlet> &meshlets):
+	count(meshlets.size())
+	{
+		size_t padded = (count + 3) / 4 * 4;
+		for (auto array : {&centerX, &centerY, &centerZ, &radius, &axisX, &axisY, &axisZ, &cutoff})
+		{
+			array->assign(padded, 0.0f);
+		}
+		first.reserve(count);
+		length.reserve(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const meshlet &entry = meshlets[i];
+			centerX[i] = entry.center.x;
+			centerY[i] = entry.center.y;
+			centerZ[i] = entry.center.z;
+			radius[i] = entry.radius;
+			axisX[i] = entry.coneAxis.x;
+			axisY[i] = entry.coneAxis.y;
+			axisZ[i] = entry.coneAxis.z;
+			cutoff[i] = entry.coneCutoff;
+			first.push_back(entry.indiceOffset);
+			length.push_back(entry.indiceCount);
+		}
+	}
+
+	size_t meshletCuller::size() const
+	{
+		return count;
+	}
+
+	void meshletCuller::cullGroups(const glm::vec4 *planes, const glm::vec3 &eye, bool cones, unsigned char *visible, size_t begin, size_t end) const
+	{
+		for (size_t group = begin; group < end; group++)
+		{
+			size_t base = group * 4;
+#ifdef MESHLET_SIMD
+			__m128 cx = _mm_loadu_ps(&centerX[base]);
+			__m128 cy = _mm_loadu_ps(&centerY[base]);
+			__m128 cz = _mm_loadu_ps(&centerZ[base]);
+			__m128 r = _mm_loadu_ps(&radius[base]);
+			__m128 negativeR = _mm_sub_ps(_mm_setzero_ps(), r);
+			// Outside once the center is more than the radius behind any plane
+			__m128 outside = _mm_setzero_ps();
+			for (int i = 0; i < 6; i++)
+			{
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[i].x)), _mm_mul_ps(cy, _mm_set1_ps(planes[i].y))),
+											 _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[i].z)), _mm_set1_ps(planes[i].w)));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negativeR));
+			}
+			if (cones)
+			{
+				// Backfacing once the whole sphere sees the cone from behind
+				__m128 dx = _mm_sub_ps(cx, _mm_set1_ps(eye.x));
+				__m128 dy = _mm_sub_ps(cy, _mm_set1_ps(eye.y));
+				__m128 dz = _mm_sub_ps(cz, _mm_set1_ps(eye.z));
+				__m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_loadu_ps(&axisX[base])), _mm_mul_ps(dy, _mm_loadu_ps(&axisY[base]))),
+										  _mm_mul_ps(dz, _mm_loadu_ps(&axisZ[base])));
+				__m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+				__m128 bound = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&cutoff[base]), distance), r);
+				outside = _mm_or_ps(outside, _mm_cmpge_ps(along, bound));
+			}
+			int mask = _mm_movemask_ps(outside);
+			for (int lane = 0; lane < 4; lane++)
+			{
+				visible[base + lane] = !(mask & (1 << lane));
+			}
+#else
+			for (size_t i = base; i < base + 4; i++)
+			{
+				glm::vec3 center(centerX[i], centerY[i], centerZ[i]);
+				bool outside = false;
+				for (int plane = 0; plane < 6; plane++)
+				{
+					outside |= glm::dot(glm::vec3(planes[plane]), center) + planes[plane].w < -radius[i];
+				}
+				if (cones)
+				{
+					glm::vec3 d = center - eye;
+					outside |= glm::dot(d, glm::vec3(axisX[i], axisY[i], axisZ[i])) >= cutoff[i] * glm::length(d) + radius[i];
+				}
+				visible[i] = !outside;
+			}
+#endif
+		}
+	}
+
+	size_t meshletCuller::cull(const glm::mat4 &transform, const glm::vec3 &eye, bool cones, GLuint indexBytes, vector<GLsizei> &counts, vector<const void*> &offsets) const
+	{
+		// Planes from the rows of the clip transform, so they come out in model space
+		glm::vec4 planes[6];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			glm::vec4 row(transform[0][axis], transform[1][axis], transform[2][axis], transform[3][axis]);
+			glm::vec4 w(transform[0][3], transform[1][3], transform[2][3], transform[3][3]);
+			planes[axis * 2] = w + row;
+			planes[axis * 2 + 1] = w - row;
+		}
+		for (auto &plane : planes)
+		{
+			plane /= glm::length(glm::vec3(plane));
+		}
+
+		thread_local vector<unsigned char> scratch;
+		scratch.resize(radius.size());
+		// Workers have scratch of their own, hand them this thread's
+		unsigned char *visible = scratch.data();
+		size_t groups = radius.size() / 4;
+		if (count >= parallelThreshold)
+		{
+			// Not the global pool, loading jobs there would hold up the frame
+			threadPool::render().parallelFor(0, groups, [&](size_t begin, size_t end) {
+				cullGroups(planes, eye, cones, visible, begin, end);
+			});
+		}
+		else
+			cullGroups(planes, eye, cones, visible, 0, groups);
+
+		counts.clear();
+		offsets.clear();
+		size_t kept = 0;
+		GLuint next = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!visible[i])
+				continue;
+			kept++;
+			if (!counts.empty() && first[i] == next)
+				counts.back() += length[i];
+			else
+			{
+				counts.push_back(length[i]);
+				offsets.push_back((const void*)((size_t)first[i] * indexBytes));
+			}
+			next = first[i] + length[i];
+		}
+		return kept;
+	}
+
+	size_t meshletCuller::parallelThreshold = 1024;
+}
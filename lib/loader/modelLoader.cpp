@@ -1,69 +1,145 @@
 #include "loader/modelLoader.hpp"
+#include "loader/meshOptimizer.hpp"
+#include "hash.hpp"
+
+#include "glm/gtc/packing.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <cctype>
+
+#define MESH_CACHE_MAGIC 0x4853454d
+// Bump when the layout or the conversion changes
+#define MESH_CACHE_VERSION 6
+#define MESH_CACHE_ALIGN 16
 
 namespace opengl
 {
 	const GLfloat *plainModel::rawVertex() const
 	{
-		return (const GLfloat *)vertices.data();
+		if (mapping)
+			return (const GLfloat *)mappedVertices;
+		return quantized ? (const GLfloat *)packedVertices.data() : (const GLfloat *)vertices.data();
 	}
 	size_t plainModel::rawVertexSize() const
 	{
-		return vertices.size() * (sizeof(vertexData) / sizeof(GLfloat));
+		return vertexSize() * (vertexStride() / sizeof(GLfloat));
 	}
 	size_t plainModel::vertexSize() const
 	{
-		return vertices.size();
+		if (mapping)
+			return mappedVertexCount;
+		return quantized ? packedVertices.size() : vertices.size();
+	}
+	size_t plainModel::vertexStride() const
+	{
+		return quantized ? sizeof(packedVertex) : sizeof(vertexData);
 	}
 
 	const GLuint* plainModel::rawIndice() const
 	{
-		return (const GLuint *)indices.data();
+		return (const GLuint *)(mapping ? mappedIndices : indices.data());
 	}
 	size_t plainModel::rawIndiceSize() const
 	{
-		return indices.size() * (sizeof(indiceData) / sizeof(GLuint));
+		return indiceSize() * (sizeof(indiceData) / sizeof(GLuint));
 	}
 	size_t plainModel::indiceSize() const
 	{
-		return indices.size();
+		return mapping ? mappedIndiceCount : indices.size();
+	}
+
+	// Maps a unit normal onto the octahedron unfolded into [-1, 1]^2
+	static glm::vec2 octEncode(const glm::vec3 &n)
+	{
+		glm::vec2 p = glm::vec2(n) / (abs(n.x) + abs(n.y) + abs(n.z));
+		if (n.z < 0.0f)
+		{
+			glm::vec2 sign(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+			p = (1.0f - glm::abs(glm::vec2(p.y, p.x))) * sign;
+		}
+		return p;
 	}
 
 	void scene::convertor(const aiNode *node, const aiScene *scene)
 	{
-		plainModel *model  = new plainModel();
-		vertexData *entity = new vertexData();
+		// Vertices are written once, in place, and the model moves into the scene
+		plainModel model;
+		model.quantized = quantize;
+		model.boundsMin = glm::vec3(numeric_limits<float>::max());
+		model.boundsMax = glm::vec3(-numeric_limits<float>::max());
+		size_t total = 0;
+		// Quantized positions need the bounds before the first vertex is written
 		for (size_t meshCount = 0; meshCount < node->mNumMeshes; meshCount++)
 		{
 			aiMesh *mesh = scene->mMeshes[node->mMeshes[meshCount]];
-			model->vertices.reserve(model->vertices.size() + mesh->mNumVertices);
-
 			for (size_t vertexCount = 0; vertexCount < mesh->mNumVertices; vertexCount++)
 			{
-				entity->vertex.x = mesh->mVertices[vertexCount].x;
-				entity->vertex.y = mesh->mVertices[vertexCount].y;
-				entity->vertex.z = mesh->mVertices[vertexCount].z;
+				glm::vec3 pos(mesh->mVertices[vertexCount].x, mesh->mVertices[vertexCount].y, mesh->mVertices[vertexCount].z);
+				model.boundsMin = glm::min(model.boundsMin, pos);
+				model.boundsMax = glm::max(model.boundsMax, pos);
+			}
+			total += mesh->mNumVertices;
+		}
+		if (total == 0)
+			model.boundsMin = model.boundsMax = glm::vec3(0.0f);
+		glm::vec3 extent = model.boundsMax - model.boundsMin;
+		glm::vec3 inverse(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+		if (model.quantized)
+			model.packedVertices.reserve(total);
+		else
+			model.vertices.reserve(total);
 
-				entity->normal.x = mesh->mNormals[vertexCount].x;
-				entity->normal.y = mesh->mNormals[vertexCount].y;
-				entity->normal.z = mesh->mNormals[vertexCount].z;
+		for (size_t meshCount = 0; meshCount < node->mNumMeshes; meshCount++)
+		{
+			aiMesh *mesh = scene->mMeshes[node->mMeshes[meshCount]];
+			// Indices of later meshes in the node follow the earlier vertices
+			GLuint base = model.vertexSize();
 
+			for (size_t vertexCount = 0; vertexCount < mesh->mNumVertices; vertexCount++)
+			{
+				glm::vec3 pos(mesh->mVertices[vertexCount].x, mesh->mVertices[vertexCount].y, mesh->mVertices[vertexCount].z);
+				glm::vec3 normal(mesh->mNormals[vertexCount].x, mesh->mNormals[vertexCount].y, mesh->mNormals[vertexCount].z);
+				glm::vec2 uv(0.0f);
 				if (mesh->mTextureCoords[0])
+					uv = glm::vec2(mesh->mTextureCoords[0][vertexCount].x, mesh->mTextureCoords[0][vertexCount].y);
+
+				if (model.quantized)
 				{
-					entity->texture.x = mesh->mTextureCoords[0][vertexCount].x;
-					entity->texture.y = mesh->mTextureCoords[0][vertexCount].y;
+					packedVertex &entity = model.packedVertices.emplace_back();
+					glm::vec3 unit = (pos - model.boundsMin) * inverse;
+					glm::vec2 oct = octEncode(normal);
+					for (int axis = 0; axis < 3; axis++)
+					{
+						entity.vertex[axis] = glm::packUnorm1x16(unit[axis]);
+					}
+					entity.vertex[3] = 0;
+					entity.normal[0] = glm::packSnorm1x16(oct.x);
+					entity.normal[1] = glm::packSnorm1x16(oct.y);
+					entity.texture[0] = glm::packHalf1x16(uv.x);
+					entity.texture[1] = glm::packHalf1x16(uv.y);
+				}
+				else
+				{
+					vertexData &entity = model.vertices.emplace_back();
+					entity.vertex = pos;
+					entity.normal = normal;
+					entity.texture = uv;
 				}
-
-				model->vertices.emplace_back(*entity);
 			}
 
-			model->indices.reserve(model->indices.size() + mesh->mNumFaces * mesh->mFaces[0].mNumIndices);
+			model.indices.reserve(model.indices.size() + mesh->mNumFaces * mesh->mFaces[0].mNumIndices);
 
 			for (size_t faceCount = 0; faceCount < mesh->mNumFaces; faceCount++)
 			{
-				aiFace face = mesh->mFaces[faceCount];
+				const aiFace &face = mesh->mFaces[faceCount];
 				for (size_t indiceCount = 0; indiceCount < face.mNumIndices; indiceCount++)
 				{
-					model->indices.emplace_back(face.mIndices[indiceCount]);
+					model.indices.emplace_back(base + face.mIndices[indiceCount]);
 				}
 			}
 
@@ -76,7 +152,7 @@ namespace opengl
 					material->GetTexture(aiTextureType_DIFFUSE, materialCount, &name);
 					string nameCleared("diffuseTexture_");
 					nameCleared += to_string(materialCount);
-					model->textures.emplace(make_pair(nameCleared, texture(directory + name.C_Str(), "2d")));
+					model.texturePaths.emplace(nameCleared, name.C_Str());
 				}
 				for (size_t materialCount = 0; materialCount < material->GetTextureCount(aiTextureType_SPECULAR); materialCount++)
 				{
@@ -86,15 +162,13 @@ namespace opengl
 					string nameCleared("specularTexture_");
 					nameCleared += to_string(materialCount);
 
-					model->textures.emplace(make_pair(nameCleared, texture(directory + name.C_Str(), "2d")));
+					model.texturePaths.emplace(nameCleared, name.C_Str());
 				}
 			}
 		}
 
-		delete entity;
 		if (node->mNumMeshes != 0)
-			this->emplace_back(*model);
-		delete model;
+			this->emplace_back(move(model));
 
 		for(unsigned int i = 0; i < node->mNumChildren; i++)
 		{
@@ -104,15 +178,307 @@ namespace opengl
 		return;
 	}
 
-	scene::scene(const string &filename)
+	scene::scene(const string &filename, bool withTextures)
 	{
-		Assimp::Importer import;
+		directory = filename.substr(0, filename.find_last_of('/') + 1);
+		string cachePath = filename + ".meshcache";
+		bool restamp = false;
+		if (useCache && readCache(cachePath, filename, restamp))
+		{
+			// Touched but unchanged, new stamps save hashing it next time
+			if (restamp)
+				writeCache(cachePath, filename);
+			if (withTextures)
+				loadTextures();
+			return;
+		}
+
+		// Importers are not shared between threads, each worker keeps its own
+		thread_local Assimp::Importer import;
 		auto scene = import.ReadFile(filename, defaultPostprocess);
 		if (!scene || (scene->mFlags && AI_SCENE_FLAGS_INCOMPLETE) || !scene->mRootNode)
 		{
 			throw error("Model load failed.", import.GetErrorString());
 		}
-		directory = filename.substr(0, filename.find_last_of('/') + 1);
 		convertor(scene->mRootNode, scene);
+		import.FreeScene();
+		for (auto &model : *this)
+		{
+			if (optimize)
+				meshOptimizer::optimize(model);
+			meshOptimizer::buildMeshlets(model);
+		}
+		if (useCache)
+			writeCache(cachePath, filename);
+		if (withTextures)
+			loadTextures();
+	}
+
+	void scene::loadTextures()
+	{
+		for (auto &model : *this)
+		{
+			for (auto &entry : model.texturePaths)
+			{
+				model.textures.emplace(make_pair(entry.first, texture(directory + entry.second, "2d")));
+			}
+		}
 	}
+
+	typedef struct __mesh_cache_header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t postprocess;
+		uint32_t modelCount;
+		// Contents of every source file, in the order of the source table
+		uint64_t sourceHash;
+		// Table of sourceCount entries, each modified time, size and path
+		uint64_t sourceOffset;
+		// 1 for packedVertex, 0 for vertexData
+		uint32_t vertexFormat;
+		// 1 when meshOptimizer ran over the models
+		uint32_t optimized;
+		uint32_t sourceCount;
+		uint32_t reserved;
+	}meshCacheHeader;
+
+	typedef struct __cache_source {
+		string path;
+		int64_t modified;
+		uint64_t size;
+	}cacheSource;
+
+	static cacheSource stampSource(const string &path)
+	{
+		error_code code;
+		cacheSource ret = {path, 0, 0};
+		ret.modified = filesystem::last_write_time(path, code).time_since_epoch().count();
+		ret.size = filesystem::file_size(path, code);
+		if (code)
+			ret.size = 0;
+		return ret;
+	}
+	// The model file and the material libraries an .obj names, as assimp reads them
+	static vector<cacheSource> findSources(const string &filename, const string &directory)
+	{
+		vector<cacheSource> ret = {stampSource(filename)};
+		string extension = filesystem::path(filename).extension().string();
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension != ".obj")
+			return ret;
+		ifstream file(filename);
+		string line;
+		while (getline(file, line))
+		{
+			if (line.compare(0, 7, "mtllib ") != 0)
+				continue;
+			size_t begin = line.find_first_not_of(" \t", 7);
+			size_t end = line.find_last_not_of(" \t\r");
+			if (begin != string::npos)
+				ret.push_back(stampSource(directory + line.substr(begin, end - begin + 1)));
+		}
+		return ret;
+	}
+	// A missing file hashes as empty, so creating it later misses too
+	static uint64_t hashSources(const vector<cacheSource> &sources)
+	{
+		uint64_t ret = FNV_OFFSET_BASIS;
+		for (auto &source : sources)
+		{
+			ifstream file(source.path, ios::binary);
+			vector<char> content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+			ret = fnv1a(source.path, ret);
+			ret = fnv1a(content.data(), content.size(), ret);
+		}
+		return ret;
+	}
+
+	// One per model after the header, offsets are from the start of the file
+	typedef struct __mesh_cache_entry {
+		uint64_t vertexOffset;
+		uint64_t vertexCount;
+		uint64_t indiceOffset;
+		uint64_t indiceCount;
+		// Pairs of uniform name and path, each a 32 bit length and the bytes
+		uint64_t textureOffset;
+		uint64_t textureCount;
+		uint64_t meshletOffset;
+		uint64_t meshletCount;
+		float boundsMin[3];
+		float boundsMax[3];
+	}meshCacheEntry;
+
+	bool scene::readCache(const string &path, const string &filename, bool &restamp)
+	{
+		error_code code;
+		if (!filesystem::exists(path, code))
+			return false;
+		shared_ptr<mappedFile> mapping;
+		try
+		{
+			mapping = make_shared<mappedFile>(path);
+		}
+		catch (error&)
+		{
+			return false;
+		}
+		const unsigned char *base = mapping->data();
+		size_t size = mapping->size();
+		if (size < sizeof(meshCacheHeader))
+			return false;
+		const meshCacheHeader &header = *(const meshCacheHeader*)base;
+		if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION || header.postprocess != (uint32_t)defaultPostprocess ||
+			header.vertexFormat != (uint32_t)quantize || header.optimized != (uint32_t)optimize ||
+			sizeof(meshCacheHeader) + header.modelCount * sizeof(meshCacheEntry) > size)
+			return false;
+
+		size_t offset = header.sourceOffset;
+		auto readString = [&](string &str) {
+			uint32_t length;
+			if (offset + sizeof(length) > size)
+				return false;
+			memcpy(&length, base + offset, sizeof(length));
+			offset += sizeof(length);
+			if (offset + length > size)
+				return false;
+			str.assign((const char*)base + offset, length);
+			offset += length;
+			return true;
+		};
+		// Unchanged stamps trust the cache without reading the sources
+		bool stamped = true;
+		for (uint32_t i = 0; i < header.sourceCount; i++)
+		{
+			cacheSource cached;
+			if (offset + sizeof(cached.modified) + sizeof(cached.size) > size)
+				return false;
+			memcpy(&cached.modified, base + offset, sizeof(cached.modified));
+			memcpy(&cached.size, base + offset + sizeof(cached.modified), sizeof(cached.size));
+			offset += sizeof(cached.modified) + sizeof(cached.size);
+			if (!readString(cached.path))
+				return false;
+			cacheSource current = stampSource(cached.path);
+			stamped &= current.modified == cached.modified && current.size == cached.size;
+		}
+		if (!stamped)
+		{
+			if (hashSources(findSources(filename, directory)) != header.sourceHash)
+				return false;
+			restamp = true;
+		}
+
+		const meshCacheEntry *entries = (const meshCacheEntry*)(base + sizeof(meshCacheHeader));
+		vector<plainModel> models(header.modelCount);
+		for (uint32_t i = 0; i < header.modelCount; i++)
+		{
+			const meshCacheEntry &entry = entries[i];
+			plainModel &model = models[i];
+			model.quantized = header.vertexFormat != 0;
+			if (entry.vertexOffset % MESH_CACHE_ALIGN != 0 || entry.indiceOffset % MESH_CACHE_ALIGN != 0 ||
+				entry.vertexOffset + entry.vertexCount * model.vertexStride() > size ||
+				entry.indiceOffset + entry.indiceCount * sizeof(indiceData) > size ||
+				entry.meshletOffset % MESH_CACHE_ALIGN != 0 || entry.meshletOffset + entry.meshletCount * sizeof(meshlet) > size)
+				return false;
+			model.mapping = mapping;
+			model.mappedVertices = base + entry.vertexOffset;
+			model.mappedVertexCount = entry.vertexCount;
+			model.mappedIndices = (const indiceData*)(base + entry.indiceOffset);
+			model.mappedIndiceCount = entry.indiceCount;
+			// Small next to the vertices, copied out so the culler owns them
+			const meshlet *meshlets = (const meshlet*)(base + entry.meshletOffset);
+			model.meshlets.assign(meshlets, meshlets + entry.meshletCount);
+			model.boundsMin = glm::vec3(entry.boundsMin[0], entry.boundsMin[1], entry.boundsMin[2]);
+			model.boundsMax = glm::vec3(entry.boundsMax[0], entry.boundsMax[1], entry.boundsMax[2]);
+
+			offset = entry.textureOffset;
+			for (uint64_t j = 0; j < entry.textureCount; j++)
+			{
+				string name, file;
+				if (!readString(name) || !readString(file))
+					return false;
+				model.texturePaths[name] = file;
+			}
+		}
+		for (auto &model : models)
+		{
+			this->emplace_back(move(model));
+		}
+		return true;
+	}
+	void scene::writeCache(const string &path, const string &filename) const
+	{
+		vector<unsigned char> buffer(sizeof(meshCacheHeader) + this->size() * sizeof(meshCacheEntry));
+		auto append = [&](const void *data, size_t length) {
+			size_t offset = buffer.size();
+			buffer.resize(offset + length);
+			memcpy(buffer.data() + offset, data, length);
+			return offset;
+		};
+		auto align = [&]() {
+			buffer.resize((buffer.size() + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN);
+			return buffer.size();
+		};
+
+		auto sources = findSources(filename, directory);
+		meshCacheHeader header = {MESH_CACHE_MAGIC, MESH_CACHE_VERSION, (uint32_t)defaultPostprocess, (uint32_t)this->size(),
+			hashSources(sources), 0, (uint32_t)quantize, (uint32_t)optimize, (uint32_t)sources.size(), 0};
+		for (size_t i = 0; i < this->size(); i++)
+		{
+			const plainModel &model = (*this)[i];
+			meshCacheEntry entry = {};
+			entry.textureOffset = buffer.size();
+			entry.textureCount = model.texturePaths.size();
+			for (auto &texturePath : model.texturePaths)
+			{
+				for (const string *str : {&texturePath.first, &texturePath.second})
+				{
+					uint32_t length = str->size();
+					append(&length, sizeof(length));
+					append(str->data(), length);
+				}
+			}
+			entry.vertexOffset = align();
+			entry.vertexCount = model.vertexSize();
+			append(model.rawVertex(), model.vertexSize() * model.vertexStride());
+			entry.indiceOffset = align();
+			entry.indiceCount = model.indiceSize();
+			append(model.rawIndice(), model.indiceSize() * sizeof(indiceData));
+			entry.meshletOffset = align();
+			entry.meshletCount = model.meshlets.size();
+			append(model.meshlets.data(), model.meshlets.size() * sizeof(meshlet));
+			for (int axis = 0; axis < 3; axis++)
+			{
+				entry.boundsMin[axis] = model.boundsMin[axis];
+				entry.boundsMax[axis] = model.boundsMax[axis];
+			}
+			memcpy(buffer.data() + sizeof(meshCacheHeader) + i * sizeof(meshCacheEntry), &entry, sizeof(entry));
+		}
+		header.sourceOffset = buffer.size();
+		for (auto &source : sources)
+		{
+			append(&source.modified, sizeof(source.modified));
+			append(&source.size, sizeof(source.size));
+			uint32_t length = source.path.size();
+			append(&length, sizeof(length));
+			append(source.path.data(), length);
+		}
+		memcpy(buffer.data(), &header, sizeof(header));
+
+		// A missing cache only costs the next load, never fail this one
+		error_code code;
+		string temp = path + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+		{
+			ofstream file(temp, ios::binary);
+			if (!file)
+				return;
+			file.write((const char*)buffer.data(), buffer.size());
+		}
+		filesystem::rename(temp, path, code);
+		if (code)
+			filesystem::remove(temp, code);
+	}
+
+	bool scene::useCache = true;
+	bool scene::quantize = true;
+	bool scene::optimize = true;
 }
@@ -0,0 +1,166 @@
+#include "loader/programCache.hpp"
+#include "hash.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+#define PROGRAM_CACHE_MAGIC 0x42504c47
+
+namespace opengl
+{
+	typedef void (APIENTRYP getProgramBinaryProc)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+	typedef void (APIENTRYP programBinaryProc)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+	typedef void (APIENTRYP programParameteriProc)(GLuint program, GLenum pname, GLint value);
+
+	static getProgramBinaryProc getProgramBinary = NULL;
+	static programBinaryProc programBinary = NULL;
+	static programParameteriProc programParameteri = NULL;
+
+	typedef struct __cache_header {
+		uint32_t magic;
+		uint32_t format;
+		uint32_t length;
+		uint32_t reserved;
+	}cacheHeader;
+
+	bool programCache::supported()
+	{
+		// Resolved once, every window shares the same driver
+		static bool available = []() {
+			if (!(glVersionAtLeast(4, 1) || glExtensionSupported("GL_ARB_get_program_binary")))
+				return false;
+			GLint formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			if (formats <= 0)
+				return false;
+			getProgramBinary = (getProgramBinaryProc)glGetProc("glGetProgramBinary");
+			programBinary = (programBinaryProc)glGetProc("glProgramBinary");
+			programParameteri = (programParameteriProc)glGetProc("glProgramParameteri");
+			return getProgramBinary != NULL && programBinary != NULL && programParameteri != NULL;
+		}();
+		return enabled && available;
+	}
+	string programCache::path(const string &key)
+	{
+		return directory + key + ".bin";
+	}
+
+	string programCache::key(const string &vertexCode, const string &fragmentCode)
+	{
+		uint64_t hash = fnv1a(vertexCode);
+		hash = fnv1a(fragmentCode, hash);
+		const GLenum driver[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+		for (auto name : driver)
+		{
+			const char *str = (const char*)glGetString(name);
+			hash = fnv1a(string(str == NULL ? "" : str), hash);
+		}
+		return hashToString(hash);
+	}
+
+	void programCache::prepare(GLuint program)
+	{
+		if (supported())
+			programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	bool programCache::load(GLuint program, const string &key)
+	{
+		if (!supported())
+			return false;
+		auto start = chrono::steady_clock::now();
+		ifstream file(path(key), ios::binary);
+		if (!file)
+			return false;
+		cacheHeader header;
+		file.read((char*)&header, sizeof(header));
+		if (!file || header.magic != PROGRAM_CACHE_MAGIC)
+		{
+			lock_guard<mutex> lock(statsLock);
+			stats.rejected++;
+			return false;
+		}
+		vector<char> binary(header.length);
+		file.read(binary.data(), header.length);
+		if (!file)
+		{
+			lock_guard<mutex> lock(statsLock);
+			stats.rejected++;
+			return false;
+		}
+		file.close();
+
+		programBinary(program, header.format, binary.data(), header.length);
+		// The driver may refuse a binary it wrote itself, relink from source then
+		GLint successCode;
+		glGetProgramiv(program, GL_LINK_STATUS, &successCode);
+		if (!successCode)
+		{
+			lock_guard<mutex> lock(statsLock);
+			stats.rejected++;
+			return false;
+		}
+		lock_guard<mutex> lock(statsLock);
+		stats.hits++;
+		stats.loadSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		return true;
+	}
+	void programCache::store(GLuint program, const string &key)
+	{
+		if (!supported())
+			return;
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		vector<char> binary(length);
+		GLenum format = 0;
+		getProgramBinary(program, length, NULL, &format, binary.data());
+
+		// A missing cache only costs the next start, never fail the caller
+		error_code code;
+		filesystem::create_directories(directory, code);
+		if (code)
+			return;
+		ofstream file(path(key), ios::binary);
+		if (!file)
+			return;
+		cacheHeader header = {PROGRAM_CACHE_MAGIC, format, (uint32_t)length, 0};
+		file.write((const char*)&header, sizeof(header));
+		file.write(binary.data(), length);
+	}
+
+	void programCache::recordCompile(double seconds)
+	{
+		lock_guard<mutex> lock(statsLock);
+		stats.compiled++;
+		stats.compileSeconds += seconds;
+	}
+	string programCache::report()
+	{
+		lock_guard<mutex> lock(statsLock);
+		ostringstream ret;
+		ret << fixed << setprecision(2);
+		ret << "Shader programs: " << stats.hits << " from cache in " << stats.loadSeconds * 1000.0 << " ms, ";
+		ret << stats.compiled << " compiled in " << stats.compileSeconds * 1000.0 << " ms";
+		if (stats.rejected > 0)
+			ret << " (" << stats.rejected << " cached binaries rejected)";
+		if (stats.hits > 0)
+			ret << ", " << stats.loadSeconds * 1000.0 / stats.hits << " ms per cached program";
+		if (stats.compiled > 0)
+			ret << ", " << stats.compileSeconds * 1000.0 / stats.compiled << " ms per compiled program";
+		return ret.str();
+	}
+
+	programCache::cacheStats programCache::stats = {0, 0, 0, 0.0, 0.0};
+	mutex programCache::statsLock;
+	string programCache::directory = "cache/shader/";
+	bool programCache::enabled = true;
+}
@@ -1,30 +1,37 @@
 #include "loader/shaderLoader.hpp"
+#include "loader/programCache.hpp"
+#include "loader/shaderWatcher.hpp"
+#include "hash.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+
+#define GL_COMPLETION_STATUS_KHR 0x91B1
 
 namespace opengl
 {
-	shader::shader(const string &str, GLenum shaderType):
+	// Last program passed to glUseProgram on the current context, each
+	// thread keeps one context current
+	static thread_local GLuint boundProgram = 0;
+
+	shader::shader(const string &str, GLenum shaderType, const string &defines):
 	shaderType(shaderType)
 	{
-		string code;
-		if (str.find_first_of(" \n\t") == str.npos)
-		{
-			ifstream file(str);
-			code.assign(istreambuf_iterator<GLchar>(file), istreambuf_iterator<GLchar>());
-			file.close();
-		}
-		else
-		{
-			code = str;
-		}
+		string code = preprocess(str, defines);
 
 		const GLchar *rawCode = code.c_str();
 		shaderId = glCreateShader(shaderType);
 		glShaderSource(shaderId, 1, &rawCode, NULL);
 		glCompileShader(shaderId);
-
+	}
+	shader::~shader()
+	{
+		glDeleteShader(shaderId);
+	}
+	void shader::check() const
+	{
+		// Blocks until the compile is done
 		GLint successCode;
 		GLchar status[ERROR_LOG_BUFFER_SIZE] = {};
 		glGetShaderiv(shaderId, GL_COMPILE_STATUS, &successCode);
@@ -34,9 +41,37 @@ namespace opengl
 			throw error("Error compiling.", status);
 		}
 	}
-	shader::~shader()
+	bool shader::isFile(const string &str)
 	{
-		glDeleteShader(shaderId);
+		return str.find_first_of(" \n\t") == str.npos;
+	}
+	string shader::preprocess(const string &str, const string &defines)
+	{
+		string code;
+		if (isFile(str))
+		{
+			ifstream file(str);
+			code.assign(istreambuf_iterator<GLchar>(file), istreambuf_iterator<GLchar>());
+			file.close();
+		}
+		else
+		{
+			code = str;
+		}
+		if (!defines.empty())
+			code = injectDefines(code, defines);
+		return code;
+	}
+	string shader::injectDefines(const string &code, const string &defines)
+	{
+		// #version has to stay the first statement
+		size_t pos = code.find("#version");
+		if (pos == code.npos)
+			return defines + code;
+		pos = code.find('\n', pos);
+		if (pos == code.npos)
+			return code + "\n" + defines;
+		return code.substr(0, pos + 1) + defines + code.substr(pos + 1);
 	}
 
 	uniformSetter::uniformSetter():
@@ -202,21 +237,9 @@ namespace opengl
 
 	shaderProgram::shaderProgram()
 	{}
-	shaderProgram::shaderProgram(const string &vShader, const string &fShader)
-	{
-		auto pos = regProgram.find(vShader + fShader);
-		if (pos == regProgram.end())
-		{
-			programId = glCreateProgram();
-
-			shader vertexShader(vShader, GL_VERTEX_SHADER);
-			shader fragmentShader(fShader, GL_FRAGMENT_SHADER);
-
-			linkProgram(vertexShader, fragmentShader);
-		}
-		else
-			programId = pos->second;
-	}
+	shaderProgram::shaderProgram(const string &vShader, const string &fShader, const shaderDefines &defines):
+	vertexSource(vShader), fragmentSource(fShader), defineBlock(toDefineBlock(defines))
+	{}
 	shaderProgram::shaderProgram(const json &jsonFile)
 	{
 		if (!jsonFile.is_object())
@@ -225,49 +248,461 @@ namespace opengl
 			throw error("JSON format error.");
 		if (!(jsonFile["vertex"].is_string() && jsonFile["fragment"].is_string()))
 			throw error("Value type error.");
-		auto pos = regProgram.find(jsonFile["vertex"].get<string>() + jsonFile["fragment"].get<string>());
-		if (pos == regProgram.end())
-		{
-			programId = glCreateProgram();
+		vertexSource = jsonFile["vertex"].get<string>();
+		fragmentSource = jsonFile["fragment"].get<string>();
+	}
+	shaderProgram::~shaderProgram()
+	{}
+	shaderProgram::programRecord::~__program_record()
+	{
+		if (programId == 0)
+			return;
+		if (boundProgram == programId)
+			boundProgram = 0;
+		glDeleteProgram(programId);
+	}
+	void shaderProgram::build()
+	{
+		submit();
+		resolve();
+	}
+	void shaderProgram::submit()
+	{
+		if (record)
+			return;
+		if (vertexSource.empty() || fragmentSource.empty())
+			throw error("Shader program has no source.");
+		string vertexCode = shader::preprocess(vertexSource, defineBlock);
+		string fragmentCode = shader::preprocess(fragmentSource, defineBlock);
+		uint64_t hash = fnv1a(fragmentCode, fnv1a(vertexCode));
 
-			shader vertexShader(jsonFile["vertex"].get<string>(), GL_VERTEX_SHADER);
-			shader fragmentShader(jsonFile["fragment"].get<string>(), GL_FRAGMENT_SHADER);
+		lock_guard<mutex> lock(registryLock);
+		auto pos = regProgram.find(hash);
+		if (pos != regProgram.end())
+		{
+			record = pos->second.lock();
+			if (record)
+			{
+				stats.shared++;
+				return;
+			}
+		}
+		record = make_shared<programRecord>();
+		record->hash = hash;
+		record->vertexSource = vertexSource;
+		record->fragmentSource = fragmentSource;
+		record->defineBlock = defineBlock;
+		regProgram[hash] = record;
 
-			linkProgram(vertexShader, fragmentShader);
+		string cacheKey = programCache::key(vertexCode, fragmentCode);
+		record->programId = glCreateProgram();
+		if (!programCache::load(record->programId, cacheKey))
+		{
+			parallelCompile();
+			auto &pending = record->pending;
+			pending.reset(new pendingBuild());
+			pending->start = chrono::steady_clock::now();
+			pending->cacheKey = cacheKey;
+			pending->linked = false;
+			pending->vertexShader.reset(new shader(vertexCode, GL_VERTEX_SHADER));
+			pending->fragmentShader.reset(new shader(fragmentCode, GL_FRAGMENT_SHADER));
+			// Linking right away lets the driver finish both stages in the background
+			linkProgram(*pending->vertexShader, *pending->fragmentShader);
+			pending->seconds = chrono::duration<double>(chrono::steady_clock::now() - pending->start).count();
+			stats.links++;
 		}
-		else
-			programId = pos->second;
 	}
-	shaderProgram::~shaderProgram()
+	bool shaderProgram::poll()
 	{
-		//glDeleteProgram(programId);
+		if (!record)
+			return false;
+		if (!record->pending)
+			return true;
+		// Without the extension any query would block, report unfinished
+		if (!parallelCompile())
+			return false;
+		if (record->pending->linked)
+			return true;
+		GLint done = GL_FALSE;
+		glGetProgramiv(record->programId, GL_COMPLETION_STATUS_KHR, &done);
+		// Finished in the background, timed up to the poll that noticed
+		if (done == GL_TRUE)
+		{
+			record->pending->linked = true;
+			record->pending->seconds = chrono::duration<double>(chrono::steady_clock::now() - record->pending->start).count();
+		}
+		return done == GL_TRUE;
 	}
-	void shaderProgram::linkProgram(shader &vShader, shader &fShader)
+	void shaderProgram::resolve()
 	{
-		glAttachShader(programId, vShader.getShader());
-		glAttachShader(programId, fShader.getShader());
-		glLinkProgram(programId);
-
+		if (!record || !record->pending)
+			return;
+		unique_ptr<pendingBuild> finished(move(record->pending));
+		auto queryStart = chrono::steady_clock::now();
 		GLint successCode;
-		GLchar status[ERROR_LOG_BUFFER_SIZE] = {};
-		glGetProgramiv(programId, GL_LINK_STATUS, &successCode);
+		glGetProgramiv(record->programId, GL_LINK_STATUS, &successCode);
+		// Not seen finishing, the status query waits for whatever is left
+		if (!finished->linked)
+			finished->seconds += chrono::duration<double>(chrono::steady_clock::now() - queryStart).count();
 		if (!successCode)
 		{
-			glGetProgramInfoLog(programId, ERROR_LOG_BUFFER_SIZE, NULL, status);
+			// A failed stage explains more than the link log
+			finished->vertexShader->check();
+			finished->fragmentShader->check();
+			GLchar status[ERROR_LOG_BUFFER_SIZE] = {};
+			glGetProgramInfoLog(record->programId, ERROR_LOG_BUFFER_SIZE, NULL, status);
 			throw error("Error linking.", status);
 		}
+		programCache::recordCompile(finished->seconds);
+		programCache::store(record->programId, finished->cacheKey);
+	}
+	bool shaderProgram::parallelCompile()
+	{
+		typedef void (APIENTRYP maxShaderCompilerThreadsProc)(GLuint count);
+		static bool available = []() {
+			const char *name = NULL;
+			if (glExtensionSupported("GL_KHR_parallel_shader_compile"))
+				name = "glMaxShaderCompilerThreadsKHR";
+			else if (glExtensionSupported("GL_ARB_parallel_shader_compile"))
+				name = "glMaxShaderCompilerThreadsARB";
+			else
+				return false;
+			auto maxThreads = (maxShaderCompilerThreadsProc)glGetProc(name);
+			// All ones leaves the thread count to the driver
+			if (maxThreads != NULL)
+				maxThreads(0xFFFFFFFF);
+			return true;
+		}();
+		return available;
+	}
+	shaderProgram& shaderProgram::variant(const shaderDefines &defines)
+	{
+		string key = toDefineBlock(defines);
+		if (key == defineBlock)
+			return *this;
+		auto pos = variants.find(key);
+		if (pos == variants.end())
+		{
+			pos = variants.emplace(key, make_shared<shaderProgram>()).first;
+			pos->second->vertexSource = vertexSource;
+			pos->second->fragmentSource = fragmentSource;
+			pos->second->defineBlock = key;
+		}
+		return *pos->second;
+	}
+	string shaderProgram::toDefineBlock(const shaderDefines &defines)
+	{
+		string ret;
+		for (auto &define : defines)
+		{
+			ret += "#define " + define.first + " " + define.second + "\n";
+		}
+		return ret;
+	}
+	string shaderProgram::report()
+	{
+		lock_guard<mutex> lock(registryLock);
+		GLuint live = 0;
+		for (auto &entry : regProgram)
+		{
+			if (!entry.second.expired())
+				live++;
+		}
+		return to_string(live) + " live programs, " + to_string(stats.links) + " linked from source, " +
+			   to_string(stats.shared) + " shared, " + to_string(stats.skippedBinds) + " of " +
+			   to_string(stats.binds + stats.skippedBinds) + " binds skipped";
+	}
+	static shaderWatcher& watcher()
+	{
+		static shaderWatcher instance;
+		return instance;
+	}
+	void shaderProgram::reloadChanged()
+	{
+		lock_guard<mutex> lock(registryLock);
+		vector<shared_ptr<programRecord>> live;
+		for (auto &entry : regProgram)
+		{
+			auto target = entry.second.lock();
+			if (!target)
+				continue;
+			// Records created since the last frame start being watched here
+			if (shader::isFile(target->vertexSource))
+				watcher().watch(target->vertexSource);
+			if (shader::isFile(target->fragmentSource))
+				watcher().watch(target->fragmentSource);
+			live.push_back(target);
+		}
+		auto files = watcher().changed();
+		if (files.empty())
+			return;
+		auto affected = [&files](const string &source) {
+			if (!shader::isFile(source))
+				return false;
+			string name = filesystem::path(source).lexically_normal().generic_string();
+			return find(files.begin(), files.end(), name) != files.end();
+		};
+		for (auto &target : live)
+		{
+			if (affected(target->vertexSource) || affected(target->fragmentSource))
+				reload(*target);
+		}
+	}
+	bool shaderProgram::reload(programRecord &target)
+	{
+		// A compile still in flight would be replaced anyway
+		target.pending.reset();
+		string vertexCode = shader::preprocess(target.vertexSource, target.defineBlock);
+		string fragmentCode = shader::preprocess(target.fragmentSource, target.defineBlock);
+
+		GLuint programId = glCreateProgram();
+		try
+		{
+			shader vertexShader(vertexCode, GL_VERTEX_SHADER);
+			shader fragmentShader(fragmentCode, GL_FRAGMENT_SHADER);
+			glAttachShader(programId, vertexShader.getShader());
+			glAttachShader(programId, fragmentShader.getShader());
+			programCache::prepare(programId);
+			glLinkProgram(programId);
+			vertexShader.check();
+			fragmentShader.check();
+			GLint successCode;
+			glGetProgramiv(programId, GL_LINK_STATUS, &successCode);
+			if (!successCode)
+			{
+				GLchar status[ERROR_LOG_BUFFER_SIZE] = {};
+				glGetProgramInfoLog(programId, ERROR_LOG_BUFFER_SIZE, NULL, status);
+				throw error("Error linking.", status);
+			}
+		}
+		catch (error &e)
+		{
+			// Keep drawing with the old program until the file is fixed
+			glDeleteProgram(programId);
+			cerr << "Shader reload failed, " << target.fragmentSource << ": " << e.what() << endl;
+			return false;
+		}
+		stats.links++;
+		programCache::store(programId, programCache::key(vertexCode, fragmentCode));
+
+		copyUniforms(target.programId, programId);
+		if (boundProgram == target.programId)
+			boundProgram = 0;
+		glDeleteProgram(target.programId);
+		target.programId = programId;
+		// Locations may move between links
+		target.setterList.clear();
+
+		// Later handles with the new sources find this record
+		auto pos = regProgram.find(target.hash);
+		if (pos != regProgram.end() && pos->second.lock().get() == &target)
+		{
+			weak_ptr<programRecord> self = pos->second;
+			regProgram.erase(pos);
+			target.hash = fnv1a(fragmentCode, fnv1a(vertexCode));
+			regProgram[target.hash] = self;
+		}
+		return true;
+	}
+	void shaderProgram::copyUniforms(GLuint from, GLuint to)
+	{
+		GLint previous;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+		glUseProgram(to);
+
+		GLint count = 0;
+		glGetProgramiv(from, GL_ACTIVE_UNIFORMS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			GLchar rawName[256];
+			GLsizei length;
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(from, i, sizeof(rawName), &length, &size, &type, rawName);
+			string name(rawName, length);
+			// Arrays are reported once as name[0]
+			if (size > 1 && name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+				name.erase(name.size() - 3);
+			for (GLint element = 0; element < size; element++)
+			{
+				string elementName = size > 1 ? name + "[" + to_string(element) + "]" : name;
+				GLint src = glGetUniformLocation(from, elementName.c_str());
+				GLint dst = glGetUniformLocation(to, elementName.c_str());
+				if (src < 0 || dst < 0)
+					continue;
+				GLfloat f[16];
+				GLint n[4];
+				GLuint u[4];
+				switch (type)
+				{
+					case GL_FLOAT:
+					glGetUniformfv(from, src, f);
+					glUniform1fv(dst, 1, f);
+					break;
+					case GL_FLOAT_VEC2:
+					glGetUniformfv(from, src, f);
+					glUniform2fv(dst, 1, f);
+					break;
+					case GL_FLOAT_VEC3:
+					glGetUniformfv(from, src, f);
+					glUniform3fv(dst, 1, f);
+					break;
+					case GL_FLOAT_VEC4:
+					glGetUniformfv(from, src, f);
+					glUniform4fv(dst, 1, f);
+					break;
+					case GL_FLOAT_MAT2:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix2fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT3:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix3fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT4:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix4fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT2x3:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix2x3fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT2x4:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix2x4fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT3x2:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix3x2fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT3x4:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix3x4fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT4x2:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix4x2fv(dst, 1, GL_FALSE, f);
+					break;
+					case GL_FLOAT_MAT4x3:
+					glGetUniformfv(from, src, f);
+					glUniformMatrix4x3fv(dst, 1, GL_FALSE, f);
+					break;
+					// Samplers hold their texture unit
+					case GL_INT:
+					case GL_BOOL:
+					case GL_SAMPLER_1D:
+					case GL_SAMPLER_2D:
+					case GL_SAMPLER_3D:
+					case GL_SAMPLER_CUBE:
+					case GL_SAMPLER_1D_SHADOW:
+					case GL_SAMPLER_2D_SHADOW:
+					case GL_SAMPLER_1D_ARRAY:
+					case GL_SAMPLER_2D_ARRAY:
+					case GL_SAMPLER_1D_ARRAY_SHADOW:
+					case GL_SAMPLER_2D_ARRAY_SHADOW:
+					case GL_SAMPLER_CUBE_SHADOW:
+					case GL_SAMPLER_BUFFER:
+					case GL_SAMPLER_2D_RECT:
+					case GL_SAMPLER_2D_RECT_SHADOW:
+					case GL_SAMPLER_2D_MULTISAMPLE:
+					case GL_SAMPLER_2D_MULTISAMPLE_ARRAY:
+					case GL_INT_SAMPLER_1D:
+					case GL_INT_SAMPLER_2D:
+					case GL_INT_SAMPLER_3D:
+					case GL_INT_SAMPLER_CUBE:
+					case GL_INT_SAMPLER_1D_ARRAY:
+					case GL_INT_SAMPLER_2D_ARRAY:
+					case GL_INT_SAMPLER_BUFFER:
+					case GL_INT_SAMPLER_2D_RECT:
+					case GL_INT_SAMPLER_2D_MULTISAMPLE:
+					case GL_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+					case GL_UNSIGNED_INT_SAMPLER_1D:
+					case GL_UNSIGNED_INT_SAMPLER_2D:
+					case GL_UNSIGNED_INT_SAMPLER_3D:
+					case GL_UNSIGNED_INT_SAMPLER_CUBE:
+					case GL_UNSIGNED_INT_SAMPLER_1D_ARRAY:
+					case GL_UNSIGNED_INT_SAMPLER_2D_ARRAY:
+					case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+					case GL_UNSIGNED_INT_SAMPLER_2D_RECT:
+					case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE:
+					case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+					glGetUniformiv(from, src, n);
+					glUniform1iv(dst, 1, n);
+					break;
+					case GL_INT_VEC2:
+					case GL_BOOL_VEC2:
+					glGetUniformiv(from, src, n);
+					glUniform2iv(dst, 1, n);
+					break;
+					case GL_INT_VEC3:
+					case GL_BOOL_VEC3:
+					glGetUniformiv(from, src, n);
+					glUniform3iv(dst, 1, n);
+					break;
+					case GL_INT_VEC4:
+					case GL_BOOL_VEC4:
+					glGetUniformiv(from, src, n);
+					glUniform4iv(dst, 1, n);
+					break;
+					case GL_UNSIGNED_INT:
+					glGetUniformuiv(from, src, u);
+					glUniform1uiv(dst, 1, u);
+					break;
+					case GL_UNSIGNED_INT_VEC2:
+					glGetUniformuiv(from, src, u);
+					glUniform2uiv(dst, 1, u);
+					break;
+					case GL_UNSIGNED_INT_VEC3:
+					glGetUniformuiv(from, src, u);
+					glUniform3uiv(dst, 1, u);
+					break;
+					case GL_UNSIGNED_INT_VEC4:
+					glGetUniformuiv(from, src, u);
+					glUniform4uiv(dst, 1, u);
+					break;
+					default:
+					// Skipped rather than set through a call of the wrong type
+					break;
+				}
+			}
+		}
+		glUseProgram(previous);
+	}
+	void shaderProgram::linkProgram(shader &vShader, shader &fShader)
+	{
+		glAttachShader(record->programId, vShader.getShader());
+		glAttachShader(record->programId, fShader.getShader());
+		programCache::prepare(record->programId);
+		glLinkProgram(record->programId);
+	}
+	void shaderProgram::useProgram()
+	{
+		build();
+		if (boundProgram == record->programId)
+		{
+			stats.skippedBinds++;
+			return;
+		}
+		glUseProgram(record->programId);
+		boundProgram = record->programId;
+		stats.binds++;
 	}
-	void shaderProgram::useProgram() const
+	void shaderProgram::resetBinding()
 	{
-		glUseProgram(programId);
+		boundProgram = 0;
 	}
 	uniformSetter& shaderProgram::operator[](const string &name)
 	{
-		if (setterList.find(name) == setterList.end())
+		build();
+		auto &setterList = record->setterList;
+		auto pos = setterList.find(name);
+		if (pos == setterList.end())
 		{
-			setterList.insert(make_pair(name, uniformSetter(glGetUniformLocation(programId, name.c_str()))));
+			pos = setterList.insert(make_pair(name, uniformSetter(glGetUniformLocation(record->programId, name.c_str())))).first;
 		}
-		return setterList[name];
+		return pos->second;
 	}
-	map<string, GLuint> shaderProgram::regProgram;
+	map<uint64_t, weak_ptr<shaderProgram::programRecord>> shaderProgram::regProgram;
+	mutex shaderProgram::registryLock;
+	shaderProgram::registryStats shaderProgram::stats = {0, 0, 0, 0};
 }
@@ -0,0 +1,95 @@
+#include "loader/shaderWatcher.hpp"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#define MTIME_POLL_INTERVAL 0.5
+
+namespace opengl
+{
+	shaderWatcher::shaderWatcher()
+	{
+#ifdef __linux__
+		notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notifyFd < 0)
+			throw error("inotify init failed.", to_string(errno));
+#else
+		lastPoll = chrono::steady_clock::now();
+#endif
+	}
+	shaderWatcher::~shaderWatcher()
+	{
+#ifdef __linux__
+		close(notifyFd);
+#endif
+	}
+
+	string shaderWatcher::normalize(const string &file)
+	{
+		return filesystem::path(file).lexically_normal().generic_string();
+	}
+
+	void shaderWatcher::watch(const string &file)
+	{
+		string name = normalize(file);
+		if (!files.insert(name).second)
+			return;
+#ifdef __linux__
+		string directory = filesystem::path(name).parent_path().generic_string();
+		if (directory.empty())
+			directory = ".";
+		if (!watchedDirectories.insert(directory).second)
+			return;
+		int wd = inotify_add_watch(notifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+		if (wd >= 0)
+			directories[wd] = directory;
+#else
+		error_code code;
+		modified[name] = filesystem::last_write_time(name, code);
+#endif
+	}
+
+	vector<string> shaderWatcher::changed()
+	{
+		set<string> ret;
+#ifdef __linux__
+		alignas(inotify_event) char buffer[4096];
+		while (true)
+		{
+			ssize_t length = read(notifyFd, buffer, sizeof(buffer));
+			if (length <= 0)
+				break;
+			for (char *ptr = buffer; ptr < buffer + length; )
+			{
+				inotify_event *event = (inotify_event*)ptr;
+				ptr += sizeof(inotify_event) + event->len;
+				auto dir = directories.find(event->wd);
+				if (dir == directories.end() || event->len == 0)
+					continue;
+				string name = normalize((filesystem::path(dir->second) / event->name).generic_string());
+				if (files.count(name))
+					ret.insert(name);
+			}
+		}
+#else
+		auto now = chrono::steady_clock::now();
+		if (chrono::duration<double>(now - lastPoll).count() < MTIME_POLL_INTERVAL)
+			return vector<string>();
+		lastPoll = now;
+		for (auto &entry : modified)
+		{
+			error_code code;
+			auto time = filesystem::last_write_time(entry.first, code);
+			if (!code && time != entry.second)
+			{
+				entry.second = time;
+				ret.insert(entry.first);
+			}
+		}
+#endif
+		return vector<string>(ret.begin(), ret.end());
+	}
+}
@@ -1,6 +1,26 @@
 #include "loader/textureLoader.hpp"
+#include "loader/blockCompressor.hpp"
+#include "threadPool.hpp"
+#include "hash.hpp"
 
 #include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <iomanip>
+
+// Bump when the encoder output changes to invalidate old cache files
+#define TEXTURE_CACHE_VERSION "bcn-1"
+#define DECODED_CACHE_VERSION "raw-1"
+#define DECODED_CACHE_MAGIC 0x31574152
+#define DECODED_MAX_LEVELS 16
+// Levels start on page boundaries, so mapped levels are page aligned too
+#define DECODED_PAGE_SIZE 4096
+#define TEXTURE_UNPACK_BUFFERS 4
 
 extern "C"
 {
@@ -11,109 +31,776 @@ extern "C"
 
 namespace opengl
 {
-	texture::texture(const string &filename, const string &type):
-	textureType(convertMap.at(type))
+	texture::texture(const string &filename, const string &type)
 	{
+		GLenum textureType = convertMap.at(type);
+		lock_guard<recursive_mutex> lock(registryLock);
 		auto pos = regTexture.find(filename);
-		if (pos == regTexture.end())
+		if (pos != regTexture.end())
+			record = pos->second.lock();
+		if (record)
+			return;
+
+		record = make_shared<textureRecord>();
+		record->textureType = textureType;
+		record->name = filename;
+		record->reloadable = true;
+		record->normalMap = compress && type == "normal";
+		record->held = holds > 0;
+		request(*record);
+		regTexture[filename] = record;
+	}
+	texture::texture(const string &name, const unsigned char *data, int channels, int width, int height, const string &type)
+	{
+		GLenum textureType = convertMap.at(type);
 		{
+			lock_guard<recursive_mutex> lock(registryLock);
+			auto pos = regTexture.find(name);
+			if (pos != regTexture.end())
+				record = pos->second.lock();
+		}
+		if (record)
+			return;
+
+		record = make_shared<textureRecord>();
+		record->textureType = textureType;
+		record->name = name;
+		if (channels != 1 && channels != 3 && channels != 4)
+			throw error("Channel type cannot be set automatically.");
+		// Expanded to RGBA8, single channel data stays in red
+		vector<unsigned char> rgba((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; i++)
+		{
+			const unsigned char *src = data + i * channels;
+			rgba[i * 4] = src[0];
+			rgba[i * 4 + 1] = channels == 1 ? 0 : src[1];
+			rgba[i * 4 + 2] = channels == 1 ? 0 : src[2];
+			rgba[i * 4 + 3] = channels == 4 ? src[3] : 255;
+		}
+		auto staging = make_shared<textureStaging>();
+		staging->width = width;
+		staging->height = height;
+		staging->channels = channels;
+		buildMips(*staging, move(rgba));
+		lock_guard<recursive_mutex> lock(registryLock);
+		upload(*record, staging);
+		regTexture[name] = record;
+	}
+	texture::~texture()
+	{}
+	texture::textureRecord::~__texture_record()
+	{
+		if (textureId != 0)
+			glDeleteTextures(1, &textureId);
+	}
+	packedStorage::~__packed_storage()
+	{
+		if (arrayId != 0)
+			glDeleteTextures(1, &arrayId);
+	}
+
+	void texture::request(textureRecord &target)
+	{
+		// Extensions are queried here, workers have no context
+		static bool s3tc = glExtensionSupported("GL_EXT_texture_compression_s3tc");
+		bool allowS3TC = compress && s3tc;
+		bool normalMap = target.normalMap;
+		string filename = target.name;
+		target.pending = threadPool::global().submit([filename, allowS3TC, normalMap]() {
+			return decode(filename, allowS3TC, normalMap);
+		});
+	}
+
+	// Header of a decoded cache file, the first page holds nothing else
+	typedef struct __decoded_header {
+		uint32_t magic;
+		uint32_t levelCount;
+		int64_t modified;
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		uint32_t width;
+		uint32_t height;
+		uint32_t channels;
+		uint32_t reserved;
+		uint64_t offsets[DECODED_MAX_LEVELS];
+		uint64_t sizes[DECODED_MAX_LEVELS];
+	}decodedHeader;
+
+	shared_ptr<textureStaging> texture::decode(const string &filename, bool s3tc, bool normalMap)
+	{
+		// An unchanged file is not even read, a touched one is compared by content
+		error_code code;
+		int64_t modified = filesystem::last_write_time(filename, code).time_since_epoch().count();
+		uint64_t fileSize = filesystem::file_size(filename, code);
+		string decodedPath = cacheDirectory + hashToString(fnv1a(filesystem::absolute(filename, code).generic_string(), fnv1a(DECODED_CACHE_VERSION))) + ".raw";
+		shared_ptr<mappedFile> decoded = normalMap ? NULL : openDecoded(decodedPath);
+		const decodedHeader *header = decoded ? (const decodedHeader*)decoded->data() : NULL;
+		// Images S3TC can take go through the KTX cache instead
+		bool decodedUsable = header != NULL && header->sourceSize == fileSize && !(s3tc && (header->channels == 3 || header->channels == 4));
+		if (decodedUsable && header->modified == modified)
+			return mapDecoded(decoded);
+
+		ifstream file(filename, ios::binary);
+		vector<unsigned char> source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		file.close();
+		if (source.empty())
+			throw error("Texture image load failed.", filename);
+		uint64_t sourceHash = fnv1a(source.data(), source.size());
+		if (decodedUsable && header->sourceHash == sourceHash)
+			return mapDecoded(decoded);
+		decoded.reset();
 
-			int width, height, channels;
-			stbi_set_flip_vertically_on_load(true);
-			unsigned char *textureData = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-			if (textureData == NULL)
+		auto staging = make_shared<textureStaging>();
+		int width, height, channels;
+		if (!stbi_info_from_memory(source.data(), (int)source.size(), &width, &height, &channels))
+			throw error("Texture image load failed.", filename);
+		// RGTC is core, BC1 and BC3 need S3TC
+		bool transcode = normalMap || (s3tc && (channels == 3 || channels == 4));
+		int sourceChannels = channels;
+		string cachePath = cacheDirectory + hashToString(fnv1a(source.data(), source.size(), fnv1a(string(TEXTURE_CACHE_VERSION) + (normalMap ? "normal" : "color")))) + ".ktx";
+		if (transcode && readCache(cachePath, *staging))
+		{
+			stats.compressedHits++;
+			return staging;
+		}
+		stats.misses++;
+
+		// The flip flag is per thread, workers never share it
+		stbi_set_flip_vertically_on_load_thread(true);
+		// Mips are built on the CPU for streaming, so raw images are RGBA8 too
+		unsigned char *textureData = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 4);
+		if (textureData == NULL)
+			throw error("Texture image load failed.", filename);
+		staging->width = width;
+		staging->height = height;
+		if (!transcode)
+		{
+			if (sourceChannels == 1 || sourceChannels == 2)
 			{
-				throw error("Texture image load failed.");
+				// Keep the single channel in red as GL_RED did
+				for (size_t i = 0; i < (size_t)width * height; i++)
+				{
+					textureData[i * 4 + 1] = textureData[i * 4 + 2] = 0;
+				}
 			}
-			GLenum channelType;
-			switch (channels)
-			{
-				case 3:
-				channelType = GL_RGB;
-				break;
-				case 4:
-				channelType = GL_RGBA;
+			staging->channels = sourceChannels;
+			buildMips(*staging, vector<unsigned char>(textureData, textureData + (size_t)width * height * 4));
+			stbi_image_free(textureData);
+			if (!normalMap)
+				writeDecoded(decodedPath, *staging, modified, source.size(), sourceHash);
+			return staging;
+		}
+
+		// Decodes already run one per worker, so blocks are encoded serially here
+		blockFormat format = normalMap ? BC5_FORMAT : (channels == 4 ? BC3_FORMAT : BC1_FORMAT);
+		staging->channels = normalMap ? 2 : channels;
+		staging->compressedFormat = blockCompressor::glFormat(format);
+		vector<unsigned char> level(textureData, textureData + (size_t)width * height * 4);
+		stbi_image_free(textureData);
+		int w = width, h = height;
+		while (true)
+		{
+			staging->levels.emplace_back(blockCompressor::compress(level.data(), w, h, format));
+			if (w == 1 && h == 1)
 				break;
-				default:
-				throw error("Channel type cannot be set automatically.");
+			level = blockCompressor::downsample(level.data(), w, h);
+			w = max(w / 2, 1);
+			h = max(h / 2, 1);
+		}
+		writeCache(cachePath, *staging);
+		return staging;
+	}
+
+	// KTX 1.1 layout, only what a single 2D texture needs
+	typedef struct __ktx_header {
+		unsigned char identifier[12];
+		uint32_t endianness;
+		uint32_t glType;
+		uint32_t glTypeSize;
+		uint32_t glFormat;
+		uint32_t glInternalFormat;
+		uint32_t glBaseInternalFormat;
+		uint32_t pixelWidth;
+		uint32_t pixelHeight;
+		uint32_t pixelDepth;
+		uint32_t numberOfArrayElements;
+		uint32_t numberOfFaces;
+		uint32_t numberOfMipmapLevels;
+		uint32_t bytesOfKeyValueData;
+	}ktxHeader;
+	static const unsigned char ktxIdentifier[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+	bool texture::readCache(const string &path, textureStaging &staging)
+	{
+		ifstream file(path, ios::binary);
+		if (!file)
+			return false;
+		ktxHeader header;
+		file.read((char*)&header, sizeof(header));
+		if (!file || memcmp(header.identifier, ktxIdentifier, 12) != 0 || header.endianness != 0x04030201 ||
+			header.glType != 0 || header.numberOfMipmapLevels == 0)
+			return false;
+		file.seekg(header.bytesOfKeyValueData, ios::cur);
+		staging.width = header.pixelWidth;
+		staging.height = header.pixelHeight;
+		staging.compressedFormat = header.glInternalFormat;
+		staging.channels = header.glBaseInternalFormat == GL_RGBA ? 4 : (header.glBaseInternalFormat == GL_RG ? 2 : 3);
+		staging.levels.resize(header.numberOfMipmapLevels);
+		for (auto &level : staging.levels)
+		{
+			uint32_t size;
+			file.read((char*)&size, sizeof(size));
+			level.resize(size);
+			file.read((char*)level.data(), size);
+			// Levels are padded to four bytes
+			file.seekg((4 - size % 4) % 4, ios::cur);
+			if (!file)
+			{
+				staging.levels.clear();
+				return false;
+			}
+		}
+		return true;
+	}
+	void texture::writeCache(const string &path, const textureStaging &staging)
+	{
+		// A missing cache only costs the next start, never fail the load
+		error_code code;
+		filesystem::create_directories(cacheDirectory, code);
+		if (code)
+			return;
+		// Written aside and renamed, a parallel load never sees half a file
+		string temp = path + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+		{
+			ofstream file(temp, ios::binary);
+			if (!file)
+				return;
+			ktxHeader header = {};
+			memcpy(header.identifier, ktxIdentifier, 12);
+			header.endianness = 0x04030201;
+			header.glTypeSize = 1;
+			header.glInternalFormat = staging.compressedFormat;
+			header.glBaseInternalFormat = staging.channels == 4 ? GL_RGBA : (staging.channels == 2 ? GL_RG : GL_RGB);
+			header.pixelWidth = staging.width;
+			header.pixelHeight = staging.height;
+			header.numberOfFaces = 1;
+			header.numberOfMipmapLevels = staging.levels.size();
+			file.write((const char*)&header, sizeof(header));
+			const char padding[4] = {};
+			for (auto &level : staging.levels)
+			{
+				uint32_t size = level.size();
+				file.write((const char*)&size, sizeof(size));
+				file.write((const char*)level.data(), size);
+				file.write(padding, (4 - size % 4) % 4);
 			}
+		}
+		filesystem::rename(temp, path, code);
+		if (code)
+			filesystem::remove(temp, code);
+	}
 
-			glGenTextures(1, &textureId);
-			glBindTexture(textureType, textureId);
+	shared_ptr<mappedFile> texture::openDecoded(const string &path)
+	{
+		error_code code;
+		if (!filesystem::exists(path, code))
+			return NULL;
+		shared_ptr<mappedFile> mapping;
+		try
+		{
+			mapping = make_shared<mappedFile>(path);
+		}
+		catch (error&)
+		{
+			return NULL;
+		}
+		if (mapping->size() < DECODED_PAGE_SIZE)
+			return NULL;
+		const decodedHeader &header = *(const decodedHeader*)mapping->data();
+		if (header.magic != DECODED_CACHE_MAGIC || header.levelCount == 0 || header.levelCount > DECODED_MAX_LEVELS)
+			return NULL;
+		for (uint32_t level = 0; level < header.levelCount; level++)
+		{
+			if (header.offsets[level] + header.sizes[level] > mapping->size())
+				return NULL;
+		}
+		return mapping;
+	}
+	shared_ptr<textureStaging> texture::mapDecoded(shared_ptr<mappedFile> mapping)
+	{
+		const decodedHeader &header = *(const decodedHeader*)mapping->data();
+		auto staging = make_shared<textureStaging>();
+		staging->width = header.width;
+		staging->height = header.height;
+		staging->channels = header.channels;
+		for (uint32_t level = 0; level < header.levelCount; level++)
+		{
+			staging->mappedLevels.emplace_back(header.offsets[level], header.sizes[level]);
+			stats.mappedBytes += header.sizes[level];
+		}
+		staging->mapping = mapping;
+		stats.decodedHits++;
+		return staging;
+	}
+	void texture::writeDecoded(const string &path, const textureStaging &staging, int64_t modified, uint64_t sourceSize, uint64_t sourceHash)
+	{
+		if (staging.levelCount() > DECODED_MAX_LEVELS)
+			return;
+		error_code code;
+		filesystem::create_directories(cacheDirectory, code);
+		if (code)
+			return;
+		decodedHeader header = {};
+		header.magic = DECODED_CACHE_MAGIC;
+		header.levelCount = staging.levelCount();
+		header.modified = modified;
+		header.sourceSize = sourceSize;
+		header.sourceHash = sourceHash;
+		header.width = staging.width;
+		header.height = staging.height;
+		header.channels = staging.channels;
+		uint64_t offset = DECODED_PAGE_SIZE;
+		for (uint32_t level = 0; level < header.levelCount; level++)
+		{
+			header.offsets[level] = offset;
+			header.sizes[level] = staging.levelSize(level);
+			offset += (staging.levelSize(level) + DECODED_PAGE_SIZE - 1) / DECODED_PAGE_SIZE * DECODED_PAGE_SIZE;
+		}
 
-			glTexParameteri(textureType, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(textureType, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(textureType, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(textureType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		string temp = path + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+		{
+			ofstream file(temp, ios::binary);
+			if (!file)
+				return;
+			vector<char> padding(DECODED_PAGE_SIZE, 0);
+			file.write((const char*)&header, sizeof(header));
+			file.write(padding.data(), DECODED_PAGE_SIZE - sizeof(header));
+			for (uint32_t level = 0; level < header.levelCount; level++)
+			{
+				size_t size = staging.levelSize(level);
+				file.write((const char*)staging.levelData(level), size);
+				file.write(padding.data(), (DECODED_PAGE_SIZE - size % DECODED_PAGE_SIZE) % DECODED_PAGE_SIZE);
+			}
+		}
+		filesystem::rename(temp, path, code);
+		if (code)
+			filesystem::remove(temp, code);
+		else
+			stats.writtenBytes += offset;
+	}
 
-			glTexImage2D(textureType, 0, channelType, width, height, 0, channelType, GL_UNSIGNED_BYTE, textureData);
-			glGenerateMipmap(textureType);
+	void texture::buildMips(textureStaging &staging, vector<unsigned char> &&rgba)
+	{
+		staging.compressedFormat = 0;
+		staging.levels.clear();
+		int w = staging.width, h = staging.height;
+		staging.levels.emplace_back(move(rgba));
+		while (w > 1 || h > 1)
+		{
+			staging.levels.emplace_back(blockCompressor::downsample(staging.levels.back().data(), w, h));
+			w = max(w / 2, 1);
+			h = max(h / 2, 1);
+		}
+	}
 
-			stbi_image_free(textureData);
+	typedef void (APIENTRYP texStorage2DProc)(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+	static texStorage2DProc texStorage2D = NULL;
+
+	void texture::upload(textureRecord &target, shared_ptr<textureStaging> staging)
+	{
+		static bool storage = []() {
+			if (glVersionAtLeast(4, 2) || glExtensionSupported("GL_ARB_texture_storage"))
+				texStorage2D = (texStorage2DProc)glGetProc("glTexStorage2D");
+			return texStorage2D != NULL;
+		}();
+		GLint levels = staging->levelCount();
+
+		// A demoted texture is replaced by the full one
+		if (target.textureId != 0)
+			glDeleteTextures(1, &target.textureId);
+		target.demoted = false;
+		target.residentBytes = 0;
+		for (GLint level = 0; level < levels; level++)
+		{
+			target.residentBytes += staging->levelSize(level);
+		}
+		glGenTextures(1, &target.textureId);
+		glBindTexture(target.textureType, target.textureId);
+
+		glTexParameteri(target.textureType, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(target.textureType, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(target.textureType, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(target.textureType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(target.textureType, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+		target.immutable = storage;
+		if (storage)
+			texStorage2D(target.textureType, levels, staging->compressedFormat != 0 ? staging->compressedFormat : GL_RGBA8, staging->width, staging->height);
+
+		// Everything from the tail up is sampled right away, base level hides the rest
+		target.staging = staging;
+		target.baseLevel = levels;
+		while (target.baseLevel > 0)
+		{
+			GLint level = target.baseLevel - 1;
+			if (max(staging->width >> level, staging->height >> level) > tailSize)
+				break;
+			streamLevel(target);
+		}
+		if (target.baseLevel == levels)
+			streamLevel(target);
+	}
+	size_t texture::streamLevel(textureRecord &target)
+	{
+		textureStaging &staging = *target.staging;
+		GLint level = target.baseLevel - 1;
+		// Mapped cache levels are copied once, straight into the unpack buffer
+		const unsigned char *data = staging.levelData(level);
+		size_t size = staging.levelSize(level);
+		GLsizei w = max(staging.width >> level, 1), h = max(staging.height >> level, 1);
+
+		if (unpackBuffers.empty())
+		{
+			unpackBuffers.resize(TEXTURE_UNPACK_BUFFERS);
+			glGenBuffers(unpackBuffers.size(), unpackBuffers.data());
+		}
+		GLuint buffer = unpackBuffers[nextUnpackBuffer];
+		nextUnpackBuffer = (nextUnpackBuffer + 1) % unpackBuffers.size();
+		// Orphaning lets the driver hand out fresh memory while older copies are in flight
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		const void *source = data;
+		if (mapped != NULL)
+		{
+			memcpy(mapped, data, size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			source = NULL;
 		}
 		else
-			textureId = pos->second;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		glBindTexture(target.textureType, target.textureId);
+		if (staging.compressedFormat != 0)
+		{
+			if (target.immutable)
+				glCompressedTexSubImage2D(target.textureType, level, 0, 0, w, h, staging.compressedFormat, size, source);
+			else
+				glCompressedTexImage2D(target.textureType, level, staging.compressedFormat, w, h, 0, size, source);
+		}
+		else
+		{
+			if (target.immutable)
+				glTexSubImage2D(target.textureType, level, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, source);
+			else
+				glTexImage2D(target.textureType, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, source);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glTexParameteri(target.textureType, GL_TEXTURE_BASE_LEVEL, level);
+		target.baseLevel = level;
+
+		if (level == 0)
+			target.staging.reset();
+		return size;
+	}
+	bool texture::finish(textureRecord &target)
+	{
+		// The packer reads the decode off the lock, so held ones are not touched
+		if (target.held)
+			return false;
+		if (!target.pending.valid())
+			return true;
+		if (target.pending.wait_for(chrono::seconds(0)) != future_status::ready)
+			return false;
+		// Rethrows a failed decode on the GL thread
+		upload(target, target.pending.get());
+		return true;
 	}
-	texture::texture(const string &name, const unsigned char *data, int channels, int width, int height, const string &type):
-	textureType(convertMap.at(type))
+
+	void texture::useTexture() const
 	{
-		auto pos = regTexture.find(name);
-		if (pos == regTexture.end())
+		glBindTexture(getTarget(), resolve());
+	}
+	GLuint texture::resolve() const
+	{
+		lock_guard<recursive_mutex> lock(registryLock);
+		record->lastUsed = uploadTime;
+		// Held records belong to the packer until the hold is lifted
+		if (!record->held)
 		{
-			GLenum channelType;
-			switch (channels)
+			if (record->packed)
+				return record->packed->arrayId;
+			if (record->demoted && !record->pending.valid())
+				request(*record);
+			// A demoted texture keeps serving its mip tail while the full image decodes
+			if (finish(*record) || record->textureId != 0)
+				return record->textureId;
+		}
+		if (placeholder == 0)
+		{
+			const unsigned char gray[4] = {128, 128, 128, 255};
+			glGenTextures(1, &placeholder);
+			glBindTexture(GL_TEXTURE_2D, placeholder);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, gray);
+		}
+		return placeholder;
+	}
+	GLenum texture::getTarget() const
+	{
+		return record->packed ? GL_TEXTURE_2D_ARRAY : record->textureType;
+	}
+	bool texture::ready() const
+	{
+		return !record->pending.valid();
+	}
+	bool texture::isPacked() const
+	{
+		return (bool)record->packed;
+	}
+	GLint texture::getLayer() const
+	{
+		return record->layer;
+	}
+	const glm::vec4& texture::getRect() const
+	{
+		return record->rect;
+	}
+	void texture::wait() const
+	{
+		if (record->pending.valid())
+			record->pending.wait();
+		lock_guard<recursive_mutex> lock(registryLock);
+		finish(*record);
+		while (record->staging)
+		{
+			streamLevel(*record);
+		}
+	}
+	void texture::processUploads()
+	{
+		lock_guard<recursive_mutex> lock(registryLock);
+		uploadTime = chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+		// Every window thread calls this once per frame, they share one budget
+		if (!streamRound.insert(this_thread::get_id()).second)
+		{
+			streamRound = {this_thread::get_id()};
+			streamSpent = 0;
+		}
+		size_t &spent = streamSpent;
+		bool streamed = spent > 0;
+		for (auto cur = regTexture.begin(); cur != regTexture.end(); )
+		{
+			auto target = cur->second.lock();
+			if (!target)
 			{
-				case 1:
-				channelType = GL_RED;
-				break;
-				case 3:
-				channelType = GL_RGB;
-				break;
-				case 4:
-				channelType = GL_RGBA;
-				break;
-				default:
-				throw error("Channel type cannot be set automatically.");
+				cur = regTexture.erase(cur);
+				continue;
 			}
+			finish(*target);
+			// Larger levels of one texture go in order, smallest first
+			while (target->staging)
+			{
+				size_t size = target->staging->levelSize(target->baseLevel - 1);
+				if (streamed && spent + size > streamBudget)
+					break;
+				spent += streamLevel(*target);
+				streamed = true;
+			}
+			++cur;
+		}
+		enforceBudget();
+	}
 
-			glGenTextures(1, &textureId);
-			glBindTexture(textureType, textureId);
-
-			glTexParameteri(textureType, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(textureType, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(textureType, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(textureType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	void texture::holdUploads(bool hold)
+	{
+		lock_guard<recursive_mutex> lock(registryLock);
+		if (hold)
+		{
+			holds++;
+			return;
+		}
+		if (holds == 0 || --holds > 0)
+			return;
+		for (auto &entry : regTexture)
+		{
+			auto target = entry.second.lock();
+			if (target)
+				target->held = false;
+		}
+	}
+	void texture::demote(textureRecord &target)
+	{
+		GLenum type = target.textureType;
+		GLint width, height, format, maxLevel;
+		glBindTexture(type, target.textureId);
+		glGetTexLevelParameteriv(type, 0, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(type, 0, GL_TEXTURE_HEIGHT, &height);
+		glGetTexLevelParameteriv(type, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+		glGetTexParameteriv(type, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+		GLint first = 0;
+		while (first < maxLevel && max(width >> first, height >> first) > tailSize)
+		{
+			first++;
+		}
+		if (first == 0)
+			return;
 
-			glTexImage2D(textureType, 0, channelType, width, height, 0, channelType, GL_UNSIGNED_BYTE, data);
-			glGenerateMipmap(textureType);
+		// Reading back stalls, but only cold textures get here and rarely
+		auto staging = make_shared<textureStaging>();
+		staging->width = max(width >> first, 1);
+		staging->height = max(height >> first, 1);
+		staging->compressedFormat = format == GL_RGBA8 ? 0 : format;
+		for (GLint level = first; level <= maxLevel; level++)
+		{
+			vector<unsigned char> data;
+			if (staging->compressedFormat != 0)
+			{
+				GLint size;
+				glGetTexLevelParameteriv(type, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+				data.resize(size);
+				glGetCompressedTexImage(type, level, data.data());
+			}
+			else
+			{
+				data.resize((size_t)max(width >> level, 1) * max(height >> level, 1) * 4);
+				glGetTexImage(type, level, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
+			}
+			staging->levels.emplace_back(move(data));
 		}
-		else
-			textureId = pos->second;
+		upload(target, staging);
+		target.demoted = true;
 	}
-	texture::texture(GLuint id):
-	textureId(id)
-	{}
-	texture::~texture()
+	void texture::evict(textureRecord &target)
+	{
+		glDeleteTextures(1, &target.textureId);
+		target.textureId = 0;
+		target.residentBytes = 0;
+		target.demoted = true;
+	}
+	void texture::enforceBudget()
 	{
-		auto end = regTexture.end();
-		for (auto cur = regTexture.begin(); cur != end; ++cur)
+		if (memoryBudget == 0)
+			return;
+		size_t resident = 0;
+		set<packedStorage*> arrays;
+		vector<textureRecord*> cold;
+		for (auto &entry : regTexture)
 		{
-			if (cur->second == textureId)
+			auto target = entry.second.lock();
+			if (!target || target->held)
+				continue;
+			// Merged records hold no texture of their own, their array counts once
+			if (target->packed)
 			{
-				glDeleteTextures(1, &textureId);
-				regTexture.erase(cur);
+				if (arrays.insert(target->packed.get()).second)
+					resident += target->packed->bytes;
+				continue;
+			}
+			resident += target->residentBytes;
+			// Streaming or reloading textures are left alone until they settle
+			if (target->reloadable && target->textureId != 0 && !target->pending.valid() &&
+				!target->staging && target->lastUsed + coldSeconds < uploadTime)
+				cold.push_back(target.get());
+		}
+		if (resident <= memoryBudget)
+			return;
+		sort(cold.begin(), cold.end(), [](const textureRecord *a, const textureRecord *b) {
+			return a->lastUsed < b->lastUsed;
+		});
+		// Dropping top mips first keeps something sampleable if they come back
+		for (auto target : cold)
+		{
+			if (resident <= memoryBudget)
 				return;
+			if (target->demoted)
+				continue;
+			resident -= target->residentBytes;
+			demote(*target);
+			resident += target->residentBytes;
+		}
+		for (auto target : cold)
+		{
+			if (resident <= memoryBudget)
+				return;
+			resident -= target->residentBytes;
+			evict(*target);
+		}
+	}
+
+	string texture::memoryReport(bool detailed)
+	{
+		lock_guard<recursive_mutex> lock(registryLock);
+		size_t resident = 0, packed = 0;
+		GLuint full = 0, demoted = 0, evicted = 0;
+		set<packedStorage*> arrays;
+		stringstream list;
+		for (auto &entry : regTexture)
+		{
+			auto target = entry.second.lock();
+			if (!target || target->held)
+				continue;
+			if (target->packed)
+			{
+				if (arrays.insert(target->packed.get()).second)
+					packed += target->packed->bytes;
+				continue;
+			}
+			resident += target->residentBytes;
+			const char *state = "full";
+			if (!target->demoted)
+				full++;
+			else if (target->textureId != 0)
+			{
+				state = "demoted";
+				demoted++;
+			}
+			else
+			{
+				state = "evicted";
+				evicted++;
 			}
+			if (detailed)
+				list << endl << "  " << entry.first << ": " << state << ", " << target->residentBytes / 1024 << " KiB, unused for " << uploadTime - target->lastUsed << " s";
 		}
+		stringstream ret;
+		ret << fixed << setprecision(1) << "Texture memory: " << (resident + packed) / 1048576.0 << " MiB";
+		if (memoryBudget != 0)
+			ret << " of " << memoryBudget / 1048576.0 << " MiB budget";
+		ret << ", " << packed / 1048576.0 << " MiB of it in " << arrays.size() << " arrays, "
+			<< full << " full, " << demoted << " demoted, " << evicted << " evicted" << list.str();
+		return ret.str();
 	}
-	void texture::useTexture() const
+
+	string texture::cacheReport()
 	{
-		glBindTexture(textureType, textureId);
+		stringstream ret;
+		ret << fixed << setprecision(1) << "Texture cache: " << stats.compressedHits << " compressed hits, "
+			<< stats.decodedHits << " decoded hits (" << stats.mappedBytes / 1048576.0 << " MiB mapped), "
+			<< stats.misses << " misses (" << stats.writtenBytes / 1048576.0 << " MiB written)";
+		return ret.str();
 	}
 
 	map<string, GLenum> texture::convertMap = {
 		{"2d", GL_TEXTURE_2D},
-		{"3d", GL_TEXTURE_2D}
+		{"3d", GL_TEXTURE_2D},
+		{"normal", GL_TEXTURE_2D}
 	};
-	map<string, GLuint> texture::regTexture;
+	string texture::cacheDirectory = "cache/texture/";
+	bool texture::compress = true;
+	int texture::tailSize = 128;
+	size_t texture::streamBudget = 4 << 20;
+	size_t texture::memoryBudget = (size_t)512 << 20;
+	double texture::coldSeconds = 2.0;
+	atomic<double> texture::uploadTime(0.0);
+	size_t texture::streamSpent = 0;
+	set<thread::id> texture::streamRound;
+	GLuint texture::holds = 0;
+	texture::cacheStats texture::stats;
+	vector<GLuint> texture::unpackBuffers;
+	size_t texture::nextUnpackBuffer = 0;
+	map<string, weak_ptr<texture::textureRecord>> texture::regTexture;
+	recursive_mutex texture::registryLock;
+	GLuint texture::placeholder = 0;
 }
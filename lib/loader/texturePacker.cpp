@@ -0,0 +1,275 @@
+#include "loader/texturePacker.hpp"
+#include "loader/blockCompressor.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <sstream>
+#include <cstring>
+
+// Levels kept in atlas pages, lower ones would bleed between neighbours
+#define ATLAS_LEVELS 4
+
+namespace opengl
+{
+	texturePacker::texturePacker():
+	stats({0, 0, 0, 0}){}
+
+	void texturePacker::add(const texture &target, bool atlasAllowed)
+	{
+		auto pos = indexOf.find(target.record.get());
+		if (pos != indexOf.end())
+		{
+			entries[pos->second].atlasAllowed &= atlasAllowed;
+			return;
+		}
+		indexOf[target.record.get()] = entries.size();
+		entries.push_back({target.record, NULL, atlasAllowed});
+	}
+
+	void texturePacker::pack()
+	{
+		// Only textures that have not been uploaded yet can move into an array
+		// While uploads are held, drawing threads may take any other record
+		vector<packEntry*> waiting;
+		{
+			lock_guard<recursive_mutex> lock(texture::registryLock);
+			for (auto &entry : entries)
+			{
+				if (entry.record->packed || !entry.record->pending.valid() || (texture::holds > 0 && !entry.record->held))
+					continue;
+				waiting.push_back(&entry);
+			}
+		}
+		for (auto entry : waiting)
+		{
+			// Rethrows a failed decode
+			entry->staging = entry->record->pending.get();
+		}
+
+		map<tuple<GLenum, int, int, size_t>, vector<packEntry*>> groups;
+		for (auto entry : waiting)
+		{
+			const textureStaging &staging = *entry->staging;
+			groups[make_tuple(staging.compressedFormat, staging.width, staging.height, staging.levelCount())].push_back(entry);
+		}
+		vector<packEntry*> single;
+		for (auto &group : groups)
+		{
+			if (group.second.size() < 2)
+			{
+				single.push_back(group.second[0]);
+				continue;
+			}
+			vector<const textureStaging*> layers;
+			for (auto entry : group.second)
+			{
+				layers.push_back(entry->staging.get());
+			}
+			auto storage = createArray(layers, GL_REPEAT);
+			for (size_t i = 0; i < group.second.size(); i++)
+			{
+				textureRecord &target = *group.second[i]->record;
+				target.packed = storage;
+				target.layer = i;
+				target.rect = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+			}
+			stats.arrays++;
+			stats.layers += group.second.size();
+		}
+
+		packAtlas(single);
+		// Handed back as a finished decode, the drawing thread uploads and
+		// streams it within its budget as it does any other
+		lock_guard<recursive_mutex> lock(texture::registryLock);
+		for (auto entry : single)
+		{
+			promise<shared_ptr<textureStaging>> decoded;
+			decoded.set_value(entry->staging);
+			entry->record->pending = decoded.get_future();
+			stats.unpacked++;
+		}
+		for (auto &entry : entries)
+		{
+			entry.staging.reset();
+		}
+	}
+
+	void texturePacker::packAtlas(vector<packEntry*> &candidates)
+	{
+		map<GLenum, vector<packEntry*>> byFormat;
+		vector<packEntry*> rest;
+		for (auto entry : candidates)
+		{
+			const textureStaging &staging = *entry->staging;
+			// Offsets stay whole blocks down to the last atlas level
+			int align = (staging.compressedFormat != 0 ? 4 : 1) << (ATLAS_LEVELS - 1);
+			if (entry->atlasAllowed && staging.width <= maxAtlasSize && staging.height <= maxAtlasSize &&
+				staging.width % align == 0 && staging.height % align == 0 && staging.levelCount() >= ATLAS_LEVELS)
+				byFormat[staging.compressedFormat].push_back(entry);
+			else
+				rest.push_back(entry);
+		}
+
+		for (auto &group : byFormat)
+		{
+			auto &images = group.second;
+			if (images.size() < 2)
+			{
+				rest.insert(rest.end(), images.begin(), images.end());
+				continue;
+			}
+			// Shelves fill best with the tallest images first
+			sort(images.begin(), images.end(), [](const packEntry *a, const packEntry *b) {
+				return a->staging->height > b->staging->height;
+			});
+			GLenum format = group.first;
+			int unit = format != 0 ? 4 : 1;
+			// Edge copies around every image, still a whole block wide on the
+			// last atlas level so no level filters in a neighbour
+			int gutter = unit << (ATLAS_LEVELS - 1);
+			vector<tuple<GLint, int, int>> placement;
+			GLint page = 0;
+			int x = 0, y = 0, shelf = 0;
+			for (auto entry : images)
+			{
+				int w = entry->staging->width + gutter * 2, h = entry->staging->height + gutter * 2;
+				if (x + w > atlasPageSize)
+				{
+					y += shelf;
+					x = shelf = 0;
+				}
+				if (y + h > atlasPageSize)
+				{
+					page++;
+					x = y = shelf = 0;
+				}
+				placement.emplace_back(page, x, y);
+				x += w;
+				shelf = max(shelf, h);
+			}
+
+			size_t unitBytes = format != 0 ? blockCompressor::blockBytes(format) : 4;
+			vector<textureStaging> pages(page + 1);
+			for (auto &target : pages)
+			{
+				target.width = target.height = atlasPageSize;
+				target.compressedFormat = format;
+				target.channels = images[0]->staging->channels;
+				for (int level = 0; level < ATLAS_LEVELS; level++)
+				{
+					size_t side = (atlasPageSize >> level) / unit;
+					target.levels.emplace_back(side * side * unitBytes, 0);
+				}
+			}
+			for (size_t i = 0; i < images.size(); i++)
+			{
+				const textureStaging &source = *images[i]->staging;
+				auto [layer, px, py] = placement[i];
+				textureStaging &target = pages[layer];
+				for (int level = 0; level < ATLAS_LEVELS; level++)
+				{
+					// Rows of texels, or rows of 4x4 blocks when compressed
+					size_t rows = (source.height >> level) / unit;
+					size_t columns = (source.width >> level) / unit;
+					size_t border = (gutter >> level) / unit;
+					size_t rowBytes = columns * unitBytes;
+					size_t stride = (atlasPageSize >> level) / unit * unitBytes;
+					unsigned char *slot = target.levels[level].data() + ((py >> level) / unit) * stride + (px >> level) / unit * unitBytes;
+					for (size_t row = 0; row < rows + border * 2; row++)
+					{
+						// The gutter repeats the outermost texels, or blocks
+						size_t from = min(max(row, border) - border, rows - 1);
+						const unsigned char *line = source.levelData(level) + from * rowBytes;
+						unsigned char *out = slot + row * stride;
+						for (size_t i = 0; i < border; i++)
+						{
+							memcpy(out + i * unitBytes, line, unitBytes);
+							memcpy(out + (border + columns + i) * unitBytes, line + rowBytes - unitBytes, unitBytes);
+						}
+						memcpy(out + border * unitBytes, line, rowBytes);
+					}
+				}
+			}
+
+			vector<const textureStaging*> layers;
+			for (auto &target : pages)
+			{
+				layers.push_back(&target);
+			}
+			auto storage = createArray(layers, GL_CLAMP_TO_EDGE);
+			float size = atlasPageSize;
+			for (size_t i = 0; i < images.size(); i++)
+			{
+				const textureStaging &source = *images[i]->staging;
+				auto [layer, px, py] = placement[i];
+				textureRecord &target = *images[i]->record;
+				target.packed = storage;
+				target.layer = layer;
+				// Inset by half a texel so filtering stays inside the image, the
+				// gutter covers the wider footprint of the smaller levels
+				target.rect = glm::vec4((px + gutter + 0.5f) / size, (py + gutter + 0.5f) / size, (source.width - 1.0f) / size, (source.height - 1.0f) / size);
+			}
+			stats.arrays++;
+			stats.layers += pages.size();
+			stats.atlased += images.size();
+		}
+		candidates = rest;
+	}
+
+	shared_ptr<packedStorage> texturePacker::createArray(const vector<const textureStaging*> &layers, GLenum wrap)
+	{
+		auto storage = make_shared<packedStorage>();
+		const textureStaging &first = *layers[0];
+		GLsizei count = layers.size();
+		GLint levels = first.levelCount();
+
+		for (auto layer : layers)
+		{
+			for (GLint level = 0; level < levels; level++)
+			{
+				storage->bytes += layer->levelSize(level);
+			}
+		}
+		glGenTextures(1, &storage->arrayId);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, storage->arrayId);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+		for (GLint level = 0; level < levels; level++)
+		{
+			GLsizei w = max(first.width >> level, 1), h = max(first.height >> level, 1);
+			GLsizei size = first.levelSize(level);
+			if (first.compressedFormat != 0)
+			{
+				glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, first.compressedFormat, w, h, count, 0, size * count, NULL);
+				for (GLsizei i = 0; i < count; i++)
+				{
+					glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, w, h, 1, first.compressedFormat, size, layers[i]->levelData(level));
+				}
+			}
+			else
+			{
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, w, h, count, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+				for (GLsizei i = 0; i < count; i++)
+				{
+					glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, i, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, layers[i]->levelData(level));
+				}
+			}
+		}
+		return storage;
+	}
+
+	string texturePacker::report() const
+	{
+		stringstream ret;
+		ret << "Texture packing: " << stats.layers << " layers in " << stats.arrays << " arrays, "
+			<< stats.atlased << " textures in atlases, " << stats.unpacked << " left unpacked";
+		return ret.str();
+	}
+
+	int texturePacker::atlasPageSize = 1024;
+	int texturePacker::maxAtlasSize = 256;
+}
@@ -0,0 +1,105 @@
+#include "threadPool.hpp"
+
+namespace opengl
+{
+	threadPool::threadPool(size_t count):
+	stopping(false)
+	{
+		if (count == 0)
+			count = thread::hardware_concurrency();
+		if (count == 0)
+			count = 1;
+		workers.reserve(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			workers.emplace_back(&threadPool::workerLoop, this);
+		}
+	}
+	threadPool::~threadPool()
+	{
+		{
+			lock_guard<mutex> lock(taskLock);
+			stopping = true;
+		}
+		taskReady.notify_all();
+		for (auto &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	void threadPool::workerLoop()
+	{
+		while (true)
+		{
+			function<void ()> task;
+			{
+				unique_lock<mutex> lock(taskLock);
+				taskReady.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				// Queued tasks are still finished when stopping
+				if (tasks.empty())
+					return;
+				task = move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+	void threadPool::parallelFor(size_t begin, size_t end, const function<void (size_t, size_t)> &body)
+	{
+		if (begin >= end)
+			return;
+		size_t count = end - begin;
+		size_t chunks = min(count, workers.size() + 1);
+		size_t step = (count + chunks - 1) / chunks;
+
+		vector<future<void>> results;
+		results.reserve(chunks);
+		size_t cur = begin;
+		for (; cur + step < end; cur += step)
+		{
+			results.emplace_back(submit([&body, cur, step]() { body(cur, cur + step); }));
+		}
+		// Every range must finish before leaving, the tasks reference body
+		exception_ptr failure;
+		try
+		{
+			body(cur, end);
+		}
+		catch (...)
+		{
+			failure = current_exception();
+		}
+		for (auto &result : results)
+		{
+			try
+			{
+				result.get();
+			}
+			catch (...)
+			{
+				if (!failure)
+					failure = current_exception();
+			}
+		}
+		if (failure)
+			rethrow_exception(failure);
+	}
+
+	size_t threadPool::size() const
+	{
+		return workers.size();
+	}
+
+	threadPool& threadPool::global()
+	{
+		static threadPool pool;
+		return pool;
+	}
+	threadPool& threadPool::render()
+	{
+		static threadPool pool;
+		return pool;
+	}
+}
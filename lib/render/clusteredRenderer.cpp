@@ -0,0 +1,307 @@
+#include "render/clusteredRenderer.hpp"
+#include "threadPool.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CLUSTER_SIMD
+#endif
+
+#define CLUSTER_SLICE (CLUSTER_X * CLUSTER_Y)
+#define CLUSTER_TOTAL (CLUSTER_SLICE * CLUSTER_Z)
+// Texels of lightData per light
+#define CLUSTER_LIGHT_STRIDE 5
+
+namespace opengl
+{
+	static_assert(CLUSTER_SLICE % 4 == 0, "Clusters of a slice are tested in groups of four.");
+	static_assert(OBJECT_TEXTURE_UNITS + 3 <= 16, "The light buffers must fit in the units GL 3.3 guarantees.");
+
+	clusteredRenderer::clusteredRenderer(const string &shaderDirectory):
+	boxMinX(CLUSTER_TOTAL), boxMinY(CLUSTER_TOTAL), boxMinZ(CLUSTER_TOTAL),
+	boxMaxX(CLUSTER_TOTAL), boxMaxY(CLUSTER_TOTAL), boxMaxZ(CLUSTER_TOTAL),
+	lastProjection(0.0f), nearPlane(0.0f), farPlane(0.0f),
+	clusterCount(CLUSTER_TOTAL), clusterLights(CLUSTER_TOTAL * CLUSTER_MAX_LIGHTS), parallelCount(0),
+	program(new shaderProgram(shaderDirectory + "gbuffer.vs", shaderDirectory + "clustered.fs")),
+	flashlight(true)
+	{
+		struct {
+			GLuint *buffer;
+			GLuint *texture;
+			GLenum format;
+		} layout[] = {
+			{&lightBuffer, &lightTexture, GL_RGBA32F},
+			{&gridBuffer, &gridTexture, GL_RG32UI},
+			{&indexBuffer, &indexTexture, GL_R32UI}
+		};
+		for (auto &target : layout)
+		{
+			glGenBuffers(1, target.buffer);
+			glBindBuffer(GL_TEXTURE_BUFFER, *target.buffer);
+			glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+			glGenTextures(1, target.texture);
+			glBindTexture(GL_TEXTURE_BUFFER, *target.texture);
+			glTexBuffer(GL_TEXTURE_BUFFER, target.format, *target.buffer);
+		}
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+	clusteredRenderer::~clusteredRenderer()
+	{
+		GLuint buffers[] = {lightBuffer, gridBuffer, indexBuffer};
+		GLuint textures[] = {lightTexture, gridTexture, indexTexture};
+		glDeleteTextures(3, textures);
+		glDeleteBuffers(3, buffers);
+		delete program;
+	}
+
+	void clusteredRenderer::buildClusters(const glm::mat4 &projection)
+	{
+		// glm::perspective stores -(f + n) / (f - n) and -2fn / (f - n)
+		nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+		farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+		glm::mat4 inverseProjection = glm::inverse(projection);
+
+		for (GLuint z = 0; z < CLUSTER_Z; z++)
+		{
+			// Exponential slices keep clusters roughly cubic in view space
+			float sliceNear = nearPlane * glm::pow(farPlane / nearPlane, (float)z / CLUSTER_Z);
+			float sliceFar = nearPlane * glm::pow(farPlane / nearPlane, (float)(z + 1) / CLUSTER_Z);
+			for (GLuint y = 0; y < CLUSTER_Y; y++)
+			{
+				for (GLuint x = 0; x < CLUSTER_X; x++)
+				{
+					glm::vec3 low(numeric_limits<float>::max());
+					glm::vec3 high(-numeric_limits<float>::max());
+					for (int corner = 0; corner < 4; corner++)
+					{
+						glm::vec2 ndc(-1.0f + 2.0f * (x + (corner & 1)) / CLUSTER_X, -1.0f + 2.0f * (y + (corner >> 1)) / CLUSTER_Y);
+						glm::vec4 onNear = inverseProjection * glm::vec4(ndc, -1.0f, 1.0f);
+						glm::vec3 ray = glm::vec3(onNear) / onNear.w;
+						ray /= -ray.z;
+						low = glm::min(low, glm::min(ray * sliceNear, ray * sliceFar));
+						high = glm::max(high, glm::max(ray * sliceNear, ray * sliceFar));
+					}
+					GLuint index = z * CLUSTER_SLICE + y * CLUSTER_X + x;
+					boxMinX[index] = low.x;
+					boxMinY[index] = low.y;
+					boxMinZ[index] = low.z;
+					boxMaxX[index] = high.x;
+					boxMaxY[index] = high.y;
+					boxMaxZ[index] = high.z;
+				}
+			}
+		}
+		lastProjection = projection;
+	}
+
+	void clusteredRenderer::cullSlices(const vector<culledLight> &lights, GLuint firstLight, size_t begin, size_t end)
+	{
+		for (size_t z = begin; z < end; z++)
+		{
+			size_t sliceBase = z * CLUSTER_SLICE;
+			fill(clusterCount.begin() + sliceBase, clusterCount.begin() + sliceBase + CLUSTER_SLICE, 0);
+			float sliceBack = boxMinZ[sliceBase];
+			float sliceFront = boxMaxZ[sliceBase];
+
+			for (GLuint li = 0; li < lights.size(); li++)
+			{
+				const culledLight &light = lights[li];
+				if (light.center.z - light.radius > sliceFront || light.center.z + light.radius < sliceBack)
+					continue;
+
+				auto accept = [&](size_t index) {
+					if (light.spot)
+					{
+						// Cone against the bounding sphere of the cluster
+						glm::vec3 low(boxMinX[index], boxMinY[index], boxMinZ[index]);
+						glm::vec3 high(boxMaxX[index], boxMaxY[index], boxMaxZ[index]);
+						glm::vec3 v = (low + high) * 0.5f - light.center;
+						float sphere = glm::length(high - low) * 0.5f;
+						float along = glm::dot(v, light.axis);
+						float across = glm::sqrt(glm::max(glm::dot(v, v) - along * along, 0.0f));
+						if (light.cosAngle * across - along * light.sinAngle > sphere)
+							return;
+						if (along > sphere + light.radius || along < -sphere)
+							return;
+					}
+					GLuint &count = clusterCount[index];
+					if (count < CLUSTER_MAX_LIGHTS)
+						clusterLights[index * CLUSTER_MAX_LIGHTS + count++] = firstLight + li;
+				};
+
+				float radiusSquare = light.radius * light.radius;
+#ifdef CLUSTER_SIMD
+				__m128 zero = _mm_setzero_ps();
+				__m128 cx = _mm_set1_ps(light.center.x);
+				__m128 cy = _mm_set1_ps(light.center.y);
+				__m128 cz = _mm_set1_ps(light.center.z);
+				__m128 r2 = _mm_set1_ps(radiusSquare);
+				for (size_t group = sliceBase; group < sliceBase + CLUSTER_SLICE; group += 4)
+				{
+					// Distance from the center to the box, zero inside
+					__m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&boxMinX[group]), cx), zero),
+										   _mm_max_ps(_mm_sub_ps(cx, _mm_loadu_ps(&boxMaxX[group])), zero));
+					__m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&boxMinY[group]), cy), zero),
+										   _mm_max_ps(_mm_sub_ps(cy, _mm_loadu_ps(&boxMaxY[group])), zero));
+					__m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&boxMinZ[group]), cz), zero),
+										   _mm_max_ps(_mm_sub_ps(cz, _mm_loadu_ps(&boxMaxZ[group])), zero));
+					__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+					int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+					for (int lane = 0; lane < 4; lane++)
+					{
+						if (mask & (1 << lane))
+							accept(group + lane);
+					}
+				}
+#else
+				for (size_t index = sliceBase; index < sliceBase + CLUSTER_SLICE; index++)
+				{
+					float dx = glm::max(boxMinX[index] - light.center.x, 0.0f) + glm::max(light.center.x - boxMaxX[index], 0.0f);
+					float dy = glm::max(boxMinY[index] - light.center.y, 0.0f) + glm::max(light.center.y - boxMaxY[index], 0.0f);
+					float dz = glm::max(boxMinZ[index] - light.center.z, 0.0f) + glm::max(light.center.z - boxMaxZ[index], 0.0f);
+					if (dx * dx + dy * dy + dz * dz <= radiusSquare)
+						accept(index);
+				}
+#endif
+			}
+		}
+	}
+
+	void clusteredRenderer::assign(const vector<objectArray::lightUsage> &lights, const glm::mat4 &view, const glm::mat4 &projection)
+	{
+		if (projection != lastProjection)
+			buildClusters(projection);
+
+		// Parallel lights reach every fragment, they go first and skip culling
+		vector<objectArray::lightUsage> ordered;
+		ordered.reserve(lights.size());
+		for (auto &light : lights)
+		{
+			if (light.unbounded())
+				ordered.push_back(light);
+		}
+		parallelCount = ordered.size();
+
+		vector<culledLight> culled;
+		culled.reserve(lights.size());
+		for (auto &light : lights)
+		{
+			if (light.unbounded())
+				continue;
+			ordered.push_back(light);
+
+			culledLight entry;
+			entry.center = glm::vec3(view * glm::vec4(light.pos, 1.0f));
+			entry.radius = glm::min(light.radius(), farPlane);
+			entry.spot = light.type == objectArray::SPOT_LIGHT && light.outerCutoff > 0.0f;
+			entry.axis = glm::vec3(0.0f);
+			entry.cosAngle = 0.0f;
+			entry.sinAngle = 1.0f;
+			if (entry.spot)
+			{
+				entry.axis = glm::normalize(glm::mat3(view) * light.direction);
+				entry.cosAngle = light.outerCutoff;
+				entry.sinAngle = glm::sqrt(1.0f - light.outerCutoff * light.outerCutoff);
+			}
+			culled.push_back(entry);
+		}
+
+		// Slices are disjoint, workers never write the same cluster. The global
+		// pool may be busy decoding and importing for seconds while loading
+		threadPool::render().parallelFor(0, CLUSTER_Z, [&](size_t begin, size_t end) {
+			cullSlices(culled, parallelCount, begin, end);
+		});
+
+		upload(ordered);
+	}
+
+	void clusteredRenderer::upload(const vector<objectArray::lightUsage> &lights)
+	{
+		vector<glm::vec4> lightData;
+		lightData.reserve(lights.size() * CLUSTER_LIGHT_STRIDE + 1);
+		for (auto &light : lights)
+		{
+			lightData.emplace_back(light.pos, (float)light.type);
+			lightData.emplace_back(light.color, light.cutoff);
+			lightData.emplace_back(light.direction, light.outerCutoff);
+			lightData.emplace_back(light.strength, 0.0f);
+			lightData.emplace_back(light.attenuation, 0.0f);
+		}
+		// Zero sized buffers are not allowed
+		if (lightData.empty())
+			lightData.emplace_back(0.0f);
+
+		vector<GLuint> grid(CLUSTER_TOTAL * 2);
+		vector<GLuint> indices;
+		indices.reserve(CLUSTER_TOTAL);
+		for (GLuint cluster = 0; cluster < CLUSTER_TOTAL; cluster++)
+		{
+			grid[cluster * 2] = indices.size();
+			grid[cluster * 2 + 1] = clusterCount[cluster];
+			auto first = clusterLights.begin() + cluster * CLUSTER_MAX_LIGHTS;
+			indices.insert(indices.end(), first, first + clusterCount[cluster]);
+		}
+		if (indices.empty())
+			indices.push_back(0);
+
+		// Orphan and refill, the previous frame may still read the old storage
+		glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, lightData.size() * sizeof(glm::vec4), lightData.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, gridBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, grid.size() * sizeof(GLuint), grid.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	void clusteredRenderer::render(objectArray &renderArray, const glm::mat4 &view, const glm::mat4 &projection,
+								   const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo)
+	{
+		vector<objectArray::lightUsage> lights;
+		for (auto &light : renderArray.getLights(globalInfo))
+		{
+			lights.push_back(light.second);
+		}
+		if (flashlight)
+			lights.push_back(renderArray.getFlashlight(viewPos, viewFacing));
+		assign(lights, view, projection);
+		glm::vec3 spotAmbient(0.0f);
+		for (auto &light : lights)
+		{
+			spotAmbient += light.ambient();
+		}
+
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+
+		// Above the object textures, which count up from unit 0
+		GLuint textures[] = {lightTexture, gridTexture, indexTexture};
+		const char *names[] = {"lightData", "clusterGrid", "lightIndex"};
+		program->useProgram();
+		for (GLuint i = 0; i < 3; i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + OBJECT_TEXTURE_UNITS + i);
+			glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+			const auto &setter = (*program)[names[i]];
+			setter = {(int)(OBJECT_TEXTURE_UNITS + i)};
+		}
+		glActiveTexture(GL_TEXTURE0);
+
+		shaderProgram &sProgram = *program;
+		sProgram["viewPos"] = viewPos;
+		sProgram["spotAmbient"] = spotAmbient;
+		const auto &parallel = sProgram["parallelCount"];
+		parallel = {(int)parallelCount};
+		const auto &size = sProgram["clusterSize"];
+		size = {CLUSTER_X, CLUSTER_Y, CLUSTER_Z};
+		const auto &depthRange = sProgram["depthRange"];
+		depthRange = {nearPlane, farPlane};
+		const auto &viewportSetter = sProgram["viewport"];
+		viewportSetter = {(float)viewport[0], (float)viewport[1], (float)viewport[2], (float)viewport[3]};
+
+		renderArray.drawGeometry(view, projection, sProgram, globalInfo);
+	}
+}
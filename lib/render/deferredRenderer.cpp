@@ -0,0 +1,212 @@
+#include "render/deferredRenderer.hpp"
+
+#include <limits>
+
+namespace opengl
+{
+	deferredRenderer::deferredRenderer(const string &shaderDirectory):
+	gBuffer(0), albedoTexture(0), specularTexture(0), normalTexture(0), depthTexture(0),
+	capacityWidth(0), capacityHeight(0), screenArray(0),
+	geometryProgram(new shaderProgram(shaderDirectory + "gbuffer.vs", shaderDirectory + "gbuffer.fs")),
+	lightProgram(new shaderProgram(shaderDirectory + "deferred.vs", shaderDirectory + "deferred.fs")),
+	flashlight(true)
+	{
+		// Core profile needs a bound VAO even without attributes
+		glGenVertexArrays(1, &screenArray);
+	}
+	deferredRenderer::~deferredRenderer()
+	{
+		release();
+		glDeleteVertexArrays(1, &screenArray);
+		delete geometryProgram;
+		delete lightProgram;
+	}
+
+	void deferredRenderer::allocate(GLsizei w, GLsizei h)
+	{
+		release();
+
+		glGenFramebuffers(1, &gBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+
+		struct {
+			GLuint *id;
+			GLint internalFormat;
+			GLenum format;
+			GLenum type;
+			GLenum attachment;
+		} layout[] = {
+			{&albedoTexture, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT0},
+			{&specularTexture, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT1},
+			{&normalTexture, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, GL_COLOR_ATTACHMENT2},
+			{&depthTexture, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_DEPTH_ATTACHMENT}
+		};
+		for (auto &target : layout)
+		{
+			glGenTextures(1, target.id);
+			glBindTexture(GL_TEXTURE_2D, *target.id);
+			glTexImage2D(GL_TEXTURE_2D, 0, target.internalFormat, w, h, 0, target.format, target.type, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, target.attachment, GL_TEXTURE_2D, *target.id, 0);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+		glDrawBuffers(3, buffers);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			release();
+			throw error("G-buffer incomplete.");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		capacityWidth = w;
+		capacityHeight = h;
+	}
+	void deferredRenderer::release()
+	{
+		if (gBuffer != 0)
+			glDeleteFramebuffers(1, &gBuffer);
+		GLuint textures[] = {albedoTexture, specularTexture, normalTexture, depthTexture};
+		for (auto id : textures)
+		{
+			if (id != 0)
+				glDeleteTextures(1, &id);
+		}
+		gBuffer = albedoTexture = specularTexture = normalTexture = depthTexture = 0;
+		capacityWidth = capacityHeight = 0;
+	}
+
+	void deferredRenderer::render(objectArray &renderArray, const glm::mat4 &view, const glm::mat4 &projection,
+								  const glm::vec3 &viewPos, const glm::vec3 &viewFacing, void *globalInfo)
+	{
+		GLint target;
+		GLint viewport[4];
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		GLboolean depthEnabled = glIsEnabled(GL_DEPTH_TEST);
+		GLboolean blendEnabled = glIsEnabled(GL_BLEND);
+
+		// Grow only, smaller viewports use the lower left corner
+		if (viewport[2] > capacityWidth || viewport[3] > capacityHeight)
+			allocate(glm::max(viewport[2], capacityWidth), glm::max(viewport[3], capacityHeight));
+
+		// Geometry pass
+		glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+		glViewport(0, 0, viewport[2], viewport[3]);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+		renderArray.drawGeometry(view, projection, *geometryProgram, globalInfo);
+
+		// Light accumulation
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glDisable(GL_DEPTH_TEST);
+
+		GLuint textures[] = {albedoTexture, specularTexture, normalTexture, depthTexture};
+		const char *names[] = {"gAlbedo", "gSpecular", "gNormal", "gDepth"};
+		lightProgram->useProgram();
+		for (GLuint i = 0; i < 4; i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			const auto &setter = (*lightProgram)[names[i]];
+			setter = {(int)i};
+		}
+		(*lightProgram)["inverseViewProjection"] = glm::inverse(projection * view);
+		const auto &viewportSetter = (*lightProgram)["viewport"];
+		viewportSetter = {(float)viewport[0], (float)viewport[1], (float)viewport[2], (float)viewport[3]};
+		(*lightProgram)["viewPos"] = viewPos;
+		auto cameraLight = renderArray.getFlashlight(viewPos, viewFacing);
+		glm::vec3 spotAmbient = flashlight ? cameraLight.ambient() : glm::vec3(0.0f);
+		auto lights = renderArray.getLights(globalInfo);
+		for (auto &light : lights)
+		{
+			spotAmbient += light.second.ambient();
+		}
+		(*lightProgram)["spotAmbient"] = spotAmbient;
+		glBindVertexArray(screenArray);
+
+		// Every geometry pixel replaces the clear color, as forward drawing does
+		const auto &pass = (*lightProgram)["pass"];
+		pass = {0};
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		pass = {1};
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		glEnable(GL_SCISSOR_TEST);
+		for (auto &light : lights)
+		{
+			lightPass(light.second, view, projection, viewport);
+		}
+		if (flashlight)
+			lightPass(cameraLight, view, projection, viewport);
+		glDisable(GL_SCISSOR_TEST);
+
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+		if (depthEnabled)
+			glEnable(GL_DEPTH_TEST);
+		if (!blendEnabled)
+			glDisable(GL_BLEND);
+	}
+
+	void deferredRenderer::lightPass(const objectArray::lightUsage &light, const glm::mat4 &view, const glm::mat4 &projection, GLint viewport[4])
+	{
+		// Screen rectangle of the light's bounding sphere
+		GLint left = viewport[0], bottom = viewport[1], width = viewport[2], height = viewport[3];
+		float radius = light.radius();
+		if (radius < numeric_limits<float>::max())
+		{
+			glm::mat4 viewProjection = projection * view;
+			glm::vec2 low(1.0f), high(-1.0f);
+			bool clipped = false;
+			for (int corner = 0; corner < 8 && !clipped; corner++)
+			{
+				glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius, (corner & 4) ? radius : -radius);
+				glm::vec4 clip = viewProjection * glm::vec4(light.pos + offset, 1.0f);
+				// A corner behind the eye makes the projection unusable
+				if (clip.w <= 0.0f)
+				{
+					clipped = true;
+					break;
+				}
+				glm::vec2 ndc = glm::vec2(clip) / clip.w;
+				low = glm::min(low, ndc);
+				high = glm::max(high, ndc);
+			}
+			if (!clipped)
+			{
+				low = glm::clamp(low, -1.0f, 1.0f);
+				high = glm::clamp(high, -1.0f, 1.0f);
+				if (low.x >= high.x || low.y >= high.y)
+					return;
+				left = viewport[0] + (GLint)((low.x * 0.5f + 0.5f) * viewport[2]);
+				bottom = viewport[1] + (GLint)((low.y * 0.5f + 0.5f) * viewport[3]);
+				width = (GLint)glm::ceil((high.x - low.x) * 0.5f * viewport[2]) + 1;
+				height = (GLint)glm::ceil((high.y - low.y) * 0.5f * viewport[3]) + 1;
+			}
+		}
+		glScissor(left, bottom, width, height);
+
+		shaderProgram &program = *lightProgram;
+		const auto &type = program["type"];
+		type = {(int)light.type};
+		program["lighting.pos"] = light.pos;
+		program["lighting.color"] = light.color;
+		program["lighting.direction"] = light.direction;
+		program["lighting.strength"] = light.strength;
+		program["lighting.attenuation"] = light.attenuation;
+		const auto &cutoff = program["lighting.cutoff"];
+		cutoff = {light.cutoff};
+		const auto &outerCutoff = program["lighting.outerCutoff"];
+		outerCutoff = {light.outerCutoff};
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+}
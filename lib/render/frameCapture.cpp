@@ -0,0 +1,242 @@
+#include "render/frameCapture.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <array>
+
+namespace opengl
+{
+	namespace
+	{
+		// Static local keeps the table initialization thread safe
+		const unsigned int* crcTable()
+		{
+			static const array<unsigned int, 256> table = []() {
+				array<unsigned int, 256> ret;
+				for (unsigned int n = 0; n < 256; n++)
+				{
+					unsigned int c = n;
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+					ret[n] = c;
+				}
+				return ret;
+			}();
+			return table.data();
+		}
+
+		unsigned int crc(const unsigned char *data, size_t length, unsigned int c = 0xFFFFFFFFu)
+		{
+			const unsigned int *table = crcTable();
+			for (size_t i = 0; i < length; i++)
+				c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+			return c;
+		}
+
+		void putBigEndian(vector<unsigned char> &out, unsigned int value)
+		{
+			out.push_back((value >> 24) & 0xFF);
+			out.push_back((value >> 16) & 0xFF);
+			out.push_back((value >> 8) & 0xFF);
+			out.push_back(value & 0xFF);
+		}
+
+		void putChunk(ofstream &file, const char *type, const vector<unsigned char> &data)
+		{
+			vector<unsigned char> chunk;
+			chunk.reserve(data.size() + 12);
+			putBigEndian(chunk, data.size());
+			chunk.insert(chunk.end(), type, type + 4);
+			chunk.insert(chunk.end(), data.begin(), data.end());
+			putBigEndian(chunk, crc(chunk.data() + 4, chunk.size() - 4) ^ 0xFFFFFFFFu);
+			file.write((const char*)chunk.data(), chunk.size());
+		}
+	}
+
+	frameCapture::frameCapture(GLuint slotCount, GLuint latency):
+	slotCount(slotCount), latency(latency), frameIndex(0), encoder(1)
+	{
+		if (slotCount == 0)
+			throw error("Argument error.", "Capture needs at least one slot.");
+	}
+	frameCapture::~frameCapture()
+	{
+		for (auto &slot : slots)
+		{
+			if (slot.fence != NULL)
+				glDeleteSync(slot.fence);
+			glDeleteBuffers(1, &slot.buffer);
+		}
+	}
+
+	void frameCapture::request(const string &filename)
+	{
+		requests.push_back(filename);
+	}
+
+	void frameCapture::process(GLsizei width, GLsizei height)
+	{
+		// Buffers are created lazily, the constructor may run without a context
+		if (slots.empty())
+		{
+			slots.resize(slotCount);
+			for (auto &slot : slots)
+			{
+				glGenBuffers(1, &slot.buffer);
+			}
+		}
+
+		// Collect finished readbacks first, this frees their slots
+		for (auto &slot : slots)
+		{
+			if (slot.fence != NULL && frameIndex >= slot.frame + latency)
+				collect(slot);
+		}
+
+		// One readback per frame, requests wait if every slot is in flight
+		if (!requests.empty() && width > 0 && height > 0)
+		{
+			for (auto &slot : slots)
+			{
+				if (slot.fence == NULL)
+				{
+					slot.filename = requests.front();
+					requests.pop_front();
+					readback(slot, width, height);
+					break;
+				}
+			}
+		}
+		frameIndex++;
+	}
+
+	size_t frameCapture::pending() const
+	{
+		size_t ret = requests.size();
+		for (auto &slot : slots)
+		{
+			if (slot.fence != NULL)
+				ret++;
+		}
+		return ret;
+	}
+
+	void frameCapture::readback(captureSlot &slot, GLsizei width, GLsizei height)
+	{
+		GLsizeiptr size = (GLsizeiptr)width * height * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		if (slot.width != width || slot.height != height)
+		{
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+			slot.width = width;
+			slot.height = height;
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		// With a pack buffer bound this only queues the copy
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.frame = frameIndex;
+	}
+
+	bool frameCapture::collect(captureSlot &slot)
+	{
+		// Zero timeout, the render loop never waits on the GPU here
+		GLenum state = glClientWaitSync(slot.fence, 0, 0);
+		if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+			return false;
+		glDeleteSync(slot.fence);
+		slot.fence = NULL;
+
+		size_t size = (size_t)slot.width * slot.height * 4;
+		auto pixels = make_shared<vector<unsigned char>>(size);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+		bool read = false;
+		if (mapped != NULL)
+		{
+			memcpy(pixels->data(), mapped, size);
+			// False when the store was lost while mapped, the copy is garbage then
+			read = glUnmapBuffer(GL_PIXEL_PACK_BUFFER) == GL_TRUE;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		// Only this capture is lost, the slot is free again and the frame goes on
+		if (!read)
+		{
+			cerr << "Capture buffer map failed, dropped " << slot.filename << endl;
+			return false;
+		}
+
+		string filename = slot.filename;
+		int width = slot.width, height = slot.height;
+		encoder.submit([filename, pixels, width, height]() {
+			try
+			{
+				writePNG(filename, pixels->data(), width, height);
+			}
+			catch (error &e)
+			{
+				cerr << e.what() << endl;
+			}
+		});
+		return true;
+	}
+
+	// Uncompressed PNG, deflate stored blocks keep the encoder trivial
+	void frameCapture::writePNG(const string &filename, const unsigned char *rgba, int width, int height)
+	{
+		size_t stride = (size_t)width * 4;
+		// GL rows start at the bottom, PNG rows at the top
+		vector<unsigned char> raw;
+		raw.reserve((stride + 1) * height);
+		for (int row = height - 1; row >= 0; row--)
+		{
+			raw.push_back(0);
+			raw.insert(raw.end(), rgba + row * stride, rgba + (row + 1) * stride);
+		}
+
+		vector<unsigned char> zlib;
+		zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+		zlib.push_back(0x78);
+		zlib.push_back(0x01);
+		size_t offset = 0;
+		do
+		{
+			size_t block = min<size_t>(raw.size() - offset, 65535);
+			bool last = offset + block == raw.size();
+			zlib.push_back(last ? 1 : 0);
+			zlib.push_back(block & 0xFF);
+			zlib.push_back((block >> 8) & 0xFF);
+			zlib.push_back(~block & 0xFF);
+			zlib.push_back((~block >> 8) & 0xFF);
+			zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + block);
+			offset += block;
+		} while (offset < raw.size());
+
+		unsigned int a = 1, b = 0;
+		for (auto byte : raw)
+		{
+			a = (a + byte) % 65521;
+			b = (b + a) % 65521;
+		}
+		putBigEndian(zlib, (b << 16) | a);
+
+		vector<unsigned char> header;
+		putBigEndian(header, width);
+		putBigEndian(header, height);
+		// 8 bit depth, RGBA, default compression, filter and interlace
+		header.insert(header.end(), {8, 6, 0, 0, 0});
+
+		ofstream file(filename, ios::binary);
+		if (!file)
+			throw error("Capture file open failed.", filename);
+		const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		file.write((const char*)signature, sizeof(signature));
+		putChunk(file, "IHDR", header);
+		putChunk(file, "IDAT", zlib);
+		putChunk(file, "IEND", vector<unsigned char>());
+		file.close();
+	}
+}
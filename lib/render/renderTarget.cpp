@@ -0,0 +1,88 @@
+#include "render/renderTarget.hpp"
+
+namespace opengl
+{
+	renderTarget::renderTarget():
+	frameBuffer(0), colorTexture(0), depthBuffer(0),
+	capacityWidth(0), capacityHeight(0), width(0), height(0)
+	{}
+	renderTarget::~renderTarget()
+	{
+		release();
+	}
+
+	void renderTarget::allocate(GLsizei w, GLsizei h)
+	{
+		release();
+
+		glGenFramebuffers(1, &frameBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+
+		glGenTextures(1, &colorTexture);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			release();
+			throw error("Framebuffer incomplete.");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		capacityWidth = w;
+		capacityHeight = h;
+	}
+	void renderTarget::release()
+	{
+		if (frameBuffer != 0)
+			glDeleteFramebuffers(1, &frameBuffer);
+		if (colorTexture != 0)
+			glDeleteTextures(1, &colorTexture);
+		if (depthBuffer != 0)
+			glDeleteRenderbuffers(1, &depthBuffer);
+		frameBuffer = colorTexture = depthBuffer = 0;
+		capacityWidth = capacityHeight = 0;
+	}
+
+	void renderTarget::reserve(GLsizei w, GLsizei h)
+	{
+		if (w <= 0 || h <= 0)
+			return;
+		if (w != capacityWidth || h != capacityHeight)
+			allocate(w, h);
+	}
+	void renderTarget::resize(GLsizei w, GLsizei h)
+	{
+		if (w > capacityWidth || h > capacityHeight)
+			reserve(w > capacityWidth ? w : capacityWidth, h > capacityHeight ? h : capacityHeight);
+		width = w;
+		height = h;
+	}
+
+	void renderTarget::bind() const
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+		glViewport(0, 0, width, height);
+	}
+	void renderTarget::blitToDefault(GLsizei w, GLsizei h) const
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, frameBuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, w, h);
+	}
+}
@@ -0,0 +1,99 @@
+#include "render/resolutionScaler.hpp"
+
+#include <cmath>
+
+namespace opengl
+{
+	resolutionScaler::resolutionScaler(float minScale, float maxScale, double budget):
+	current(0), initialized(false), scale(maxScale), gpuTime(0.0), overCount(0), underCount(0),
+	minScale(minScale), maxScale(maxScale), budget(budget),
+	upperRatio(1.0f), lowerRatio(0.8f), settleFrames(8), increaseStep(0.05f)
+	{
+		for (GLuint i = 0; i < SCALER_QUERY_COUNT; i++)
+		{
+			queries[i] = 0;
+			issued[i] = false;
+		}
+	}
+	resolutionScaler::~resolutionScaler()
+	{
+		if (initialized)
+			glDeleteQueries(SCALER_QUERY_COUNT, queries);
+	}
+
+	void resolutionScaler::beginFrame()
+	{
+		if (!initialized)
+		{
+			glGenQueries(SCALER_QUERY_COUNT, queries);
+			initialized = true;
+		}
+
+		// The oldest query is the one about to be reused, take its result if ready
+		if (issued[current])
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(queries[current], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(queries[current], GL_QUERY_RESULT, &elapsed);
+				feed(elapsed / 1.0e6);
+				issued[current] = false;
+			}
+		}
+		// Skip timing this frame rather than block on a busy query
+		if (!issued[current])
+			glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+	}
+	void resolutionScaler::endFrame()
+	{
+		if (!initialized || issued[current])
+		{
+			current = (current + 1) % SCALER_QUERY_COUNT;
+			return;
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+		issued[current] = true;
+		current = (current + 1) % SCALER_QUERY_COUNT;
+	}
+
+	void resolutionScaler::feed(double milliseconds)
+	{
+		gpuTime = milliseconds;
+
+		if (milliseconds > budget * upperRatio)
+		{
+			overCount++;
+			underCount = 0;
+		}
+		else if (milliseconds < budget * lowerRatio)
+		{
+			underCount++;
+			overCount = 0;
+		}
+		else
+		{
+			overCount = 0;
+			underCount = 0;
+		}
+
+		if (overCount >= settleFrames)
+		{
+			// Cost follows pixel count, which goes with the square of the scale
+			scale *= (float)std::sqrt(budget / milliseconds);
+			overCount = 0;
+		}
+		else if (underCount >= settleFrames)
+		{
+			// Grow slowly, overshooting costs a visible drop
+			scale += increaseStep;
+			underCount = 0;
+		}
+
+		if (scale < minScale)
+			scale = minScale;
+		if (scale > maxScale)
+			scale = maxScale;
+	}
+}
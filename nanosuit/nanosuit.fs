@@ -1,5 +1,16 @@
 #version 330 core
 
+// Permutation defines, injected by shaderProgram::variant
+#ifndef NUM_POINT_LIGHTS
+#define NUM_POINT_LIGHTS 0
+#endif
+#ifndef NUM_PARALLEL_LIGHTS
+#define NUM_PARALLEL_LIGHTS 0
+#endif
+#ifndef NUM_SPOT_LIGHTS
+#define NUM_SPOT_LIGHTS 0
+#endif
+
 in vec3 aNormal;
 in vec3 fragPos;
 in vec2 aTexture;
@@ -26,93 +37,124 @@ struct light {
 };
 
 uniform Material material;
-uniform light white;
-uniform light white_parallel;
-uniform light white_spotlight;
+#if NUM_POINT_LIGHTS > 0
+uniform light pointLights[NUM_POINT_LIGHTS];
+#endif
+#if NUM_PARALLEL_LIGHTS > 0
+uniform light parallelLights[NUM_PARALLEL_LIGHTS];
+#endif
+#if NUM_SPOT_LIGHTS > 0
+uniform light spotLights[NUM_SPOT_LIGHTS];
+#endif
+
+#ifdef FLASHLIGHT
+uniform light flashlight;
+#endif
 
 uniform vec3 viewPos;
 uniform vec3 viewFacing;
 
+// Packed textures live in an array layer at an offset xy and scale zw
+#ifdef HAS_DIFFUSE_TEXTURE
+#ifdef DIFFUSE_ARRAY
+uniform sampler2DArray diffuseTexture_0;
+uniform float diffuseTexture_0_layer;
+uniform vec4 diffuseTexture_0_rect;
+#define DIFFUSE_SAMPLE texture(diffuseTexture_0, vec3(diffuseTexture_0_rect.xy + aTexture * diffuseTexture_0_rect.zw, diffuseTexture_0_layer))
+#else
 uniform sampler2D diffuseTexture_0;
+#define DIFFUSE_SAMPLE texture(diffuseTexture_0, aTexture)
+#endif
+#endif
+#ifdef HAS_SPECULAR_TEXTURE
+#ifdef SPECULAR_ARRAY
+uniform sampler2DArray specularTexture_0;
+uniform float specularTexture_0_layer;
+uniform vec4 specularTexture_0_rect;
+#define SPECULAR_SAMPLE texture(specularTexture_0, vec3(specularTexture_0_rect.xy + aTexture * specularTexture_0_rect.zw, specularTexture_0_layer))
+#else
 uniform sampler2D specularTexture_0;
+#define SPECULAR_SAMPLE texture(specularTexture_0, aTexture)
+#endif
+#endif
+
+vec3 normal;
+vec3 viewDir;
+vec3 diffColor;
+vec3 specColor;
 
-// 0 == Dot
-// 1 == Parallel
-// 2 == Spot
-vec3 phongModel(light lighting, vec4 diffTexture, vec4 specTexture, int type)
+vec3 shade(light lighting, vec3 lightRelative)
 {
-	lighting.direction = normalize(lighting.direction);
+	float diffusion = max(dot(normal, lightRelative), 0.0);
+	vec3 diffuse = lighting.strength[1] * diffusion * diffColor;
 
-	float dist = length(lighting.pos - fragPos);
-	float attenuation = 1.0 / (lighting.attenuation[0] + lighting.attenuation[1] * dist + lighting.attenuation[2] * (dist * dist));
+	vec3 reflectRelative = reflect(-lightRelative, normal);
+	float specularation = pow(max(dot(viewDir, reflectRelative), 0.0), material.shininess);
+	vec3 specular = lighting.strength[2] * specularation * specColor;
 
-	vec3 ambient = lighting.color * lighting.strength[0] * vec3(diffTexture);
+	return lighting.color * (diffuse + specular);
+}
 
-	vec3 lightRelative;
-	if (type == 1)
-		lightRelative = normalize(-lighting.direction);
-	else
-		lightRelative = normalize(lighting.pos - fragPos);
+float attenuate(light lighting)
+{
+	float dist = length(lighting.pos - fragPos);
+	return 1.0 / (lighting.attenuation[0] + lighting.attenuation[1] * dist + lighting.attenuation[2] * (dist * dist));
+}
 
-	float theta = dot(lightRelative, normalize(-lighting.direction));
-	float epsilon = lighting.cutoff - lighting.outerCutoff;
-	float intensity = clamp((theta - lighting.outerCutoff) / epsilon, 0.0, 1.0);
+vec3 pointModel(light lighting)
+{
+	vec3 ambient = lighting.color * lighting.strength[0] * diffColor;
+	return (ambient + shade(lighting, normalize(lighting.pos - fragPos))) * attenuate(lighting);
+}
 
-	if ((theta > lighting.outerCutoff && type == 2) || type != 2)
-	{
-		vec3 normal = normalize(aNormal);
-		float diffusion = max(dot(normal, lightRelative), 0.0);
-		vec3 diffuse = lighting.color * lighting.strength[1] * diffusion * vec3(diffTexture);
-
-		vec3 viewDir = normalize(viewPos - fragPos);
-		vec3 reflectRelative = reflect(-lightRelative, normal);
-		float specularation = pow(max(dot(viewDir, reflectRelative), 0.0), material.shininess);
-		vec3 specular = lighting.color * lighting.strength[2] * specularation * vec3(specTexture);
-
-		if (type == 0)
-			ambient *= attenuation;
-		if (type != 1)
-		{
-			diffuse *= attenuation;
-			specular *= attenuation;
-		}
-		if (type == 2)
-		{
-			diffuse *= intensity;
-			specular *= intensity;
-		}
-
-		return ambient + diffuse + specular;
-	}
-	else
-	{
-		return ambient;
-	}
+vec3 parallelModel(light lighting)
+{
+	vec3 ambient = lighting.color * lighting.strength[0] * diffColor;
+	return ambient + shade(lighting, normalize(-lighting.direction));
 }
 
-vec3 flashlight(float cutoff, float outerCutoff, vec3 color, vec3 attenuation, vec3 strength, vec4 diffTexture, vec4 specTexture)
+vec3 spotModel(light lighting)
 {
-	light fl;
-	fl.pos = viewPos;
-	fl.direction = viewFacing;
-	fl.cutoff = cos(radians(cutoff));
-	fl.outerCutoff = cos(radians(outerCutoff));
-	fl.color = color;
-	fl.strength = strength;
-	fl.attenuation = attenuation;
-	return phongModel(fl, diffTexture, specTexture, 2);
+	vec3 ambient = lighting.color * lighting.strength[0] * diffColor;
+	vec3 lightRelative = normalize(lighting.pos - fragPos);
+	float theta = dot(lightRelative, normalize(-lighting.direction));
+	if (theta <= lighting.outerCutoff)
+		return ambient;
+	float epsilon = lighting.cutoff - lighting.outerCutoff;
+	float intensity = clamp((theta - lighting.outerCutoff) / epsilon, 0.0, 1.0);
+	return ambient + shade(lighting, lightRelative) * attenuate(lighting) * intensity;
 }
 
 void main()
 {
-	vec4 diffTex = texture(diffuseTexture_0, aTexture);
-	vec4 specTex = texture(specularTexture_0, aTexture);
-	// vec4 diffTex = vec4(1.0, 1.0, 1.0, 1.0);
-	// vec4 specTex = vec4(1.0, 1.0, 1.0, 1.0);
+	normal = normalize(aNormal);
+	viewDir = normalize(viewPos - fragPos);
+#ifdef HAS_DIFFUSE_TEXTURE
+	diffColor = vec3(DIFFUSE_SAMPLE);
+#else
+	diffColor = material.diffuse;
+#endif
+#ifdef HAS_SPECULAR_TEXTURE
+	specColor = vec3(SPECULAR_SAMPLE);
+#else
+	specColor = material.specular;
+#endif
+
 	vec3 result = vec3(0.0, 0.0, 0.0);
-	result += phongModel(white, diffTex, specTex, 0);
-	// result += phongModel(white_parallel, diffTex, specTex, 1);
-	result += phongModel(white_spotlight, diffTex, specTex, 2);
-	result += flashlight(5.0, 10.0, vec3(1.0), white_spotlight.attenuation, white_spotlight.strength, diffTex, specTex);
+#if NUM_POINT_LIGHTS > 0
+	for (int i = 0; i < NUM_POINT_LIGHTS; i++)
+		result += pointModel(pointLights[i]);
+#endif
+#if NUM_PARALLEL_LIGHTS > 0
+	for (int i = 0; i < NUM_PARALLEL_LIGHTS; i++)
+		result += parallelModel(parallelLights[i]);
+#endif
+#if NUM_SPOT_LIGHTS > 0
+	for (int i = 0; i < NUM_SPOT_LIGHTS; i++)
+		result += spotModel(spotLights[i]);
+#endif
+#ifdef FLASHLIGHT
+	result += spotModel(flashlight);
+#endif
 	FragColor = vec4(result, 1.0f);
 }
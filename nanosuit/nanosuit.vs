@@ -13,10 +13,31 @@ uniform mat4 projection;
 
 uniform mat3 normalMat;
 
+#ifdef QUANTIZED
+// Positions arrive as unorm16 across the mesh bounds, normals octahedral in snorm16
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
+vec3 octDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+#endif
+
 void main()
 {
-	gl_Position = projection * view * model * vec4(inputPos, 1.0);
-	fragPos = vec3(model * vec4(inputPos, 1.0));
-	aNormal = mat3(normalMat) * inputNormal;
+#ifdef QUANTIZED
+	vec3 position = positionOffset + inputPos * positionScale;
+	vec3 normal = octDecode(inputNormal.xy);
+#else
+	vec3 position = inputPos;
+	vec3 normal = inputNormal;
+#endif
+	gl_Position = projection * view * model * vec4(position, 1.0);
+	fragPos = vec3(model * vec4(position, 1.0));
+	aNormal = mat3(normalMat) * normal;
 	aTexture = inputTexture;
 }
@@ -0,0 +1,174 @@
+#version 330 core
+
+in vec3 aNormal;
+in vec3 fragPos;
+in vec2 aTexture;
+
+out vec4 FragColor;
+
+struct Material {
+	vec3 ambient;
+	vec3 diffuse;
+	vec3 specular;
+	float shininess;
+};
+
+struct light {
+	vec3 pos;
+	vec3 color;
+	vec3 direction;
+
+	vec3 strength;
+	vec3 attenuation;
+
+	float cutoff;
+	float outerCutoff;
+};
+
+uniform Material material;
+uniform vec3 color;
+uniform bool emissive;
+
+uniform bool hasDiffuseTexture;
+uniform bool hasSpecularTexture;
+uniform sampler2D diffuseTexture_0;
+uniform sampler2D specularTexture_0;
+// Packed textures, a layer below 0 samples the plain sampler instead
+uniform sampler2DArray diffuseTexture_0_array;
+uniform sampler2DArray specularTexture_0_array;
+uniform float diffuseTexture_0_layer;
+uniform float specularTexture_0_layer;
+// Offset xy and scale zw of the image inside its layer
+uniform vec4 diffuseTexture_0_rect;
+uniform vec4 specularTexture_0_rect;
+
+uniform vec3 viewPos;
+uniform mat4 view;
+
+// Five texels per light: pos + type, color + cutoff, direction + outerCutoff, strength, attenuation
+uniform samplerBuffer lightData;
+// Offset into lightIndex and light count of each cluster
+uniform usamplerBuffer clusterGrid;
+uniform usamplerBuffer lightIndex;
+
+// Parallel lights come first in lightData and are never culled
+uniform int parallelCount;
+// Ambient of every spot light, added once instead of per light
+uniform vec3 spotAmbient;
+uniform ivec3 clusterSize;
+// Near and far plane
+uniform vec2 depthRange;
+uniform vec4 viewport;
+
+light fetchLight(int id, out int type)
+{
+	int base = id * 5;
+	vec4 a = texelFetch(lightData, base);
+	vec4 b = texelFetch(lightData, base + 1);
+	vec4 c = texelFetch(lightData, base + 2);
+	light ret;
+	ret.pos = a.xyz;
+	ret.color = b.rgb;
+	ret.cutoff = b.a;
+	ret.direction = c.xyz;
+	ret.outerCutoff = c.w;
+	ret.strength = texelFetch(lightData, base + 3).xyz;
+	ret.attenuation = texelFetch(lightData, base + 4).xyz;
+	type = int(a.w);
+	return ret;
+}
+
+// 0 == Dot
+// 1 == Parallel
+// 2 == Spot
+vec3 phongModel(light lighting, int type, vec3 normal, vec3 diffTexture, vec3 specTexture)
+{
+	vec3 direction = normalize(lighting.direction);
+
+	float dist = length(lighting.pos - fragPos);
+	float attenuation = 1.0 / (lighting.attenuation[0] + lighting.attenuation[1] * dist + lighting.attenuation[2] * (dist * dist));
+
+	vec3 ambient = lighting.color * lighting.strength[0] * diffTexture;
+
+	vec3 lightRelative;
+	if (type == 1)
+		lightRelative = normalize(-direction);
+	else
+		lightRelative = normalize(lighting.pos - fragPos);
+
+	float theta = dot(lightRelative, normalize(-direction));
+	float epsilon = lighting.cutoff - lighting.outerCutoff;
+	float intensity = clamp((theta - lighting.outerCutoff) / epsilon, 0.0, 1.0);
+
+	if (type == 0)
+		ambient *= attenuation;
+	// Spot ambient is summed into spotAmbient
+	if (type == 2)
+		ambient = vec3(0.0);
+	if (type == 2 && theta <= lighting.outerCutoff)
+		return ambient;
+
+	float diffusion = max(dot(normal, lightRelative), 0.0);
+	vec3 diffuse = lighting.color * lighting.strength[1] * diffusion * diffTexture;
+
+	vec3 viewDir = normalize(viewPos - fragPos);
+	vec3 reflectRelative = reflect(-lightRelative, normal);
+	float specularation = pow(max(dot(viewDir, reflectRelative), 0.0), material.shininess);
+	vec3 specular = lighting.color * lighting.strength[2] * specularation * specTexture;
+
+	if (type != 1)
+	{
+		diffuse *= attenuation;
+		specular *= attenuation;
+	}
+	if (type == 2)
+	{
+		diffuse *= intensity;
+		specular *= intensity;
+	}
+	return ambient + diffuse + specular;
+}
+
+vec3 sampleTexture(sampler2D plain, sampler2DArray packed, float layer, vec4 rect)
+{
+	if (layer < 0.0)
+		return texture(plain, aTexture).rgb;
+	return texture(packed, vec3(rect.xy + aTexture * rect.zw, layer)).rgb;
+}
+
+void main()
+{
+	if (emissive)
+	{
+		FragColor = vec4(color, 1.0);
+		return;
+	}
+	vec3 diffTex = hasDiffuseTexture ? sampleTexture(diffuseTexture_0, diffuseTexture_0_array, diffuseTexture_0_layer, diffuseTexture_0_rect) : material.diffuse;
+	vec3 specTex = hasSpecularTexture ? sampleTexture(specularTexture_0, specularTexture_0_array, specularTexture_0_layer, specularTexture_0_rect) : material.specular;
+	vec3 normal = normalize(aNormal);
+
+	vec3 result = spotAmbient * diffTex;
+	int type;
+	for (int i = 0; i < parallelCount; i++)
+	{
+		light lighting = fetchLight(i, type);
+		result += phongModel(lighting, type, normal, diffTex, specTex);
+	}
+
+	// Same cluster layout as the CPU side, x fastest then y then z
+	ivec2 tile = ivec2((gl_FragCoord.xy - viewport.xy) / viewport.zw * vec2(clusterSize.xy));
+	tile = clamp(tile, ivec2(0), clusterSize.xy - 1);
+	float depth = -(view * vec4(fragPos, 1.0)).z;
+	int slice = int(log(depth / depthRange.x) / log(depthRange.y / depthRange.x) * float(clusterSize.z));
+	slice = clamp(slice, 0, clusterSize.z - 1);
+	int cluster = (slice * clusterSize.y + tile.y) * clusterSize.x + tile.x;
+
+	uvec2 range = texelFetch(clusterGrid, cluster).rg;
+	for (uint i = 0u; i < range.y; i++)
+	{
+		int id = int(texelFetch(lightIndex, int(range.x + i)).r);
+		light lighting = fetchLight(id, type);
+		result += phongModel(lighting, type, normal, diffTex, specTex);
+	}
+	FragColor = vec4(result, 1.0);
+}
@@ -0,0 +1,113 @@
+#version 330 core
+
+out vec4 FragColor;
+
+struct light {
+	vec3 pos;
+	vec3 color;
+	vec3 direction;
+
+	vec3 strength;
+	vec3 attenuation;
+
+	float cutoff;
+	float outerCutoff;
+};
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+uniform mat4 inverseViewProjection;
+// Origin and size of the target viewport
+uniform vec4 viewport;
+uniform vec3 viewPos;
+// Ambient of every spot light, added once in the unlit pass
+uniform vec3 spotAmbient;
+
+// 0 == Unlit pass
+// 1 == Light pass
+uniform int pass;
+// 0 == Dot
+// 1 == Parallel
+// 2 == Spot
+uniform int type;
+uniform light lighting;
+
+vec3 phongModel(vec3 fragPos, vec3 normal, vec3 diffTexture, vec3 specTexture, float shininess)
+{
+	vec3 direction = normalize(lighting.direction);
+
+	float dist = length(lighting.pos - fragPos);
+	float attenuation = 1.0 / (lighting.attenuation[0] + lighting.attenuation[1] * dist + lighting.attenuation[2] * (dist * dist));
+
+	vec3 ambient = lighting.color * lighting.strength[0] * diffTexture;
+
+	vec3 lightRelative;
+	if (type == 1)
+		lightRelative = normalize(-direction);
+	else
+		lightRelative = normalize(lighting.pos - fragPos);
+
+	float theta = dot(lightRelative, normalize(-direction));
+	float epsilon = lighting.cutoff - lighting.outerCutoff;
+	float intensity = clamp((theta - lighting.outerCutoff) / epsilon, 0.0, 1.0);
+
+	if (type == 0)
+		ambient *= attenuation;
+	// Spot ambient is summed into spotAmbient
+	if (type == 2)
+		ambient = vec3(0.0);
+	if (type == 2 && theta <= lighting.outerCutoff)
+		return ambient;
+
+	float diffusion = max(dot(normal, lightRelative), 0.0);
+	vec3 diffuse = lighting.color * lighting.strength[1] * diffusion * diffTexture;
+
+	vec3 viewDir = normalize(viewPos - fragPos);
+	vec3 reflectRelative = reflect(-lightRelative, normal);
+	float specularation = pow(max(dot(viewDir, reflectRelative), 0.0), shininess);
+	vec3 specular = lighting.color * lighting.strength[2] * specularation * specTexture;
+
+	if (type != 1)
+	{
+		diffuse *= attenuation;
+		specular *= attenuation;
+	}
+	if (type == 2)
+	{
+		diffuse *= intensity;
+		specular *= intensity;
+	}
+	return ambient + diffuse + specular;
+}
+
+void main()
+{
+	vec2 local = gl_FragCoord.xy - viewport.xy;
+	ivec2 texel = ivec2(local);
+	float depth = texelFetch(gDepth, texel, 0).r;
+	// Background keeps the clear color
+	if (depth == 1.0)
+		discard;
+
+	vec4 albedo = texelFetch(gAlbedo, texel, 0);
+	// Lit pixels start from the spot ambient, the light passes add onto it
+	if (pass == 0)
+	{
+		FragColor = albedo.a == 0.0 ? vec4(spotAmbient * albedo.rgb, 1.0) : vec4(albedo.rgb, 1.0);
+		return;
+	}
+	if (albedo.a != 0.0)
+		discard;
+
+	vec4 specular = texelFetch(gSpecular, texel, 0);
+	vec3 normal = normalize(texelFetch(gNormal, texel, 0).xyz);
+
+	vec4 clip = vec4(local / viewport.zw * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	vec4 world = inverseViewProjection * clip;
+	vec3 fragPos = world.xyz / world.w;
+
+	FragColor = vec4(phongModel(fragPos, normal, albedo.rgb, specular.rgb, specular.a * 256.0), 1.0);
+}
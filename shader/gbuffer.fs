@@ -0,0 +1,58 @@
+#version 330 core
+
+in vec3 aNormal;
+in vec3 fragPos;
+in vec2 aTexture;
+
+// Albedo, alpha marks unlit pixels
+layout (location = 0) out vec4 gAlbedo;
+// Specular color, alpha is shininess / 256
+layout (location = 1) out vec4 gSpecular;
+layout (location = 2) out vec4 gNormal;
+
+struct Material {
+	vec3 ambient;
+	vec3 diffuse;
+	vec3 specular;
+	float shininess;
+};
+
+uniform Material material;
+uniform vec3 color;
+uniform bool emissive;
+
+uniform bool hasDiffuseTexture;
+uniform bool hasSpecularTexture;
+uniform sampler2D diffuseTexture_0;
+uniform sampler2D specularTexture_0;
+// Packed textures, a layer below 0 samples the plain sampler instead
+uniform sampler2DArray diffuseTexture_0_array;
+uniform sampler2DArray specularTexture_0_array;
+uniform float diffuseTexture_0_layer;
+uniform float specularTexture_0_layer;
+// Offset xy and scale zw of the image inside its layer
+uniform vec4 diffuseTexture_0_rect;
+uniform vec4 specularTexture_0_rect;
+
+vec3 sampleTexture(sampler2D plain, sampler2DArray packed, float layer, vec4 rect)
+{
+	if (layer < 0.0)
+		return texture(plain, aTexture).rgb;
+	return texture(packed, vec3(rect.xy + aTexture * rect.zw, layer)).rgb;
+}
+
+void main()
+{
+	if (emissive)
+	{
+		gAlbedo = vec4(color, 1.0);
+		gSpecular = vec4(0.0);
+		gNormal = vec4(0.0);
+		return;
+	}
+	vec3 diffuse = hasDiffuseTexture ? sampleTexture(diffuseTexture_0, diffuseTexture_0_array, diffuseTexture_0_layer, diffuseTexture_0_rect) : material.diffuse;
+	vec3 specular = hasSpecularTexture ? sampleTexture(specularTexture_0, specularTexture_0_array, specularTexture_0_layer, specularTexture_0_rect) : material.specular;
+	gAlbedo = vec4(diffuse, 0.0);
+	gSpecular = vec4(specular, clamp(material.shininess / 256.0, 0.0, 1.0));
+	gNormal = vec4(normalize(aNormal), 0.0);
+}
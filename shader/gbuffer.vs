@@ -0,0 +1,37 @@
+#version 330 core
+layout (location = 0) in vec3 inputPos;
+layout (location = 1) in vec3 inputNormal;
+layout (location = 2) in vec2 inputTexture;
+
+out vec3 aNormal;
+out vec3 fragPos;
+out vec2 aTexture;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+uniform mat3 normalMat;
+
+// Positions arrive as unorm16 across the mesh bounds, normals octahedral in snorm16
+uniform bool quantized;
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
+vec3 octDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+
+void main()
+{
+	vec3 position = quantized ? positionOffset + inputPos * positionScale : inputPos;
+	vec3 normal = quantized ? octDecode(inputNormal.xy) : inputNormal;
+	gl_Position = projection * view * model * vec4(position, 1.0);
+	fragPos = vec3(model * vec4(position, 1.0));
+	aNormal = mat3(normalMat) * normal;
+	aTexture = inputTexture;
+}